@@ -20,6 +20,7 @@ using keycode_t = guint;
 struct config_t {
 	gint scroll_lines;
 	gint scroll_amount;
+	gint copy_last_lines; /* Lines copied by "Copy last lines" */
 
 	VteCursorShape cursor_type;
 
@@ -43,12 +44,29 @@ struct config_t {
 	// bool reload_config_on_modify;
 	bool ignore_overwrite;
 
+	bool log_output; /* Log the output of new tabs */
+	const char *log_directory;
+	bool log_compress;
+	gint log_max_size;			 /* MiB per log file */
+	gint log_rotate_minutes; /* Start a new log file after this long */
+
+	bool save_session;
+	gint session_save_interval;		 /* Seconds between checkpoints, 0 for only on exit */
+	gint session_scrollback_lines; /* Rows of scrollback saved per tab */
+	bool persistent_sessions;			 /* Shells run under the session holder and survive the GUI */
+	gint dropdown_height;					 /* Percent of the monitor, --dropdown only */
+	bool accessibility;						 /* Terminals are accessible when an assistive technology runs */
+	const char *fast_render_colorsets; /* Colorset numbers, tabs using them render fast */
+	gint fast_render_interval;				 /* ms between PTY reads of a fast tab, 0 for as fast as it comes */
+	bool early_shell;									 /* The first tab's shell starts before the window, without WINDOWID */
+
 	const char *icon;
 	const char *word_chars; /* Exceptions for word selection */
 
 	PangoFontDescription *font;
 
-	gchar *tab_default_title;
+	const char *tab_default_title; /* NULL for the default "Terminal %d" */
+	/* Runtime state, kept in the state journal rather than the config file */
 	gint last_colorset;
 
 	accel_t open_url_modifier;
@@ -60,43 +78,280 @@ struct config_t {
 
 	accel_t switch_tab_modifier;
 	accel_t move_tab_modifier;
-	gint prev_tab_key;
-	gint next_tab_key;
+	keycode_t prev_tab_key;
+	keycode_t next_tab_key;
 
 	accel_t copy_modifier;
-	gint copy_key;
-	gint paste_key;
+	keycode_t copy_key;
+	keycode_t paste_key;
+	keycode_t copy_output_key;
 
 	accel_t scrollbar_modifier;
-	gint scrollbar_key;
-	gint scroll_up_key;
-	gint scroll_down_key;
-	gint page_up_key;
-	gint page_down_key;
+	keycode_t scrollbar_key;
+	keycode_t scroll_up_key;
+	keycode_t scroll_down_key;
+	keycode_t page_up_key;
+	keycode_t page_down_key;
+	keycode_t prev_prompt_key;
+	keycode_t next_prompt_key;
 
 	accel_t set_tab_name_modifier;
-	gint set_tab_name_key;
+	keycode_t set_tab_name_key;
 
 	accel_t search_modifier;
-	gint search_key;
+	keycode_t search_key;
 
 	accel_t reload_modifier;
 	keycode_t reload_key;
 
-	gint fullscreen_key;
+	keycode_t fullscreen_key;
 
 	accel_t font_size_modifier;
-	gint increase_font_size_key;
-	gint decrease_font_size_key;
+	keycode_t increase_font_size_key;
+	keycode_t decrease_font_size_key;
+	keycode_t reset_font_size_key;
 
 	accel_t set_colorset_modifier;
-	std::array<gint, NUM_COLORSETS> set_colorset_keys;
+	std::array<keycode_t, NUM_COLORSETS> set_colorset_keys;
 
-	VteRegex *http_vteregexp, *mail_vteregexp;
+	/* The [matches] group, "name\x1fregex\x1faction" per rule and each ended by \x1e. Compiled by
+	 * ume_matches_compile */
+	gchar *match_rules;
 
 	term_colors_t colors;
 };
 
+/* Config schema. Every key of the [ume] group is one row of CONFIG_SCHEMA: its type, default, the
+ * config_t member it loads into and what a reload has to redo when it changes. Loading, saving,
+ * reload diffing and the README table (ume --config-docs) all walk it. */
+enum class config_type_t {
+	INT,
+	BOOL,
+	YES_NO, /* Older keys, stored as "Yes" or "No" */
+	STRING,
+	MODIFIER, /* GdkModifierType mask, stored as an integer */
+	KEY,			/* Key name. Integer keyvals of old config files are still read */
+	FONT,
+	CURSOR, /* block, underline or ibeam */
+};
+
+/* Redone by ume_config_apply for the open tabs. Keys without any are read whenever they're used */
+enum config_apply_t : guint {
+	APPLY_NONE = 0,
+	APPLY_FONT = 1 << 0,
+	APPLY_TERMINALS = 1 << 1, /* VTE settings and scrollbar of every tab */
+	APPLY_TABS = 1 << 2,			/* Notebook tab bar */
+	APPLY_SESSION_TIMER = 1 << 3,
+	APPLY_MATCHES = 1 << 4, /* Match rules of every tab */
+};
+
+union config_member_t {
+	gint config_t::*integer;
+	guint config_t::*uinteger; /* MODIFIER and KEY */
+	bool config_t::*boolean;
+	const char *config_t::*string;
+	PangoFontDescription *config_t::*font;
+	VteCursorShape config_t::*cursor;
+	std::array<keycode_t, NUM_COLORSETS> config_t::*keys; /* Indexed by config_entry_t::index */
+
+	constexpr config_member_t(gint config_t::*member) : integer(member) {}
+	constexpr config_member_t(guint config_t::*member) : uinteger(member) {}
+	constexpr config_member_t(bool config_t::*member) : boolean(member) {}
+	constexpr config_member_t(const char *config_t::*member) : string(member) {}
+	constexpr config_member_t(PangoFontDescription *config_t::*member) : font(member) {}
+	constexpr config_member_t(VteCursorShape config_t::*member) : cursor(member) {}
+	constexpr config_member_t(std::array<keycode_t, NUM_COLORSETS> config_t::*member) : keys(member) {}
+};
+
+struct config_entry_t {
+	const char *key;
+	config_type_t type;
+	config_member_t member;
+	gint int_default;						/* Everything but STRING and FONT */
+	const char *string_default; /* STRING and FONT. A NULL string leaves the key out of the file */
+	guint apply;
+	const char *doc;
+	int index; /* Element of an array member, -1 for plain members */
+};
+
+constexpr config_entry_t config_int(const char *key, gint config_t::*member, gint value, guint apply, const char *doc) {
+	return {key, config_type_t::INT, member, value, NULL, apply, doc, -1};
+}
+constexpr config_entry_t config_bool(const char *key, bool config_t::*member, bool value, guint apply,
+																		 const char *doc) {
+	return {key, config_type_t::BOOL, member, value, NULL, apply, doc, -1};
+}
+constexpr config_entry_t config_yes_no(const char *key, bool config_t::*member, bool value, guint apply,
+																			 const char *doc) {
+	return {key, config_type_t::YES_NO, member, value, NULL, apply, doc, -1};
+}
+constexpr config_entry_t config_string(const char *key, const char *config_t::*member, const char *value,
+																			 guint apply, const char *doc) {
+	return {key, config_type_t::STRING, member, 0, value, apply, doc, -1};
+}
+constexpr config_entry_t config_font(const char *key, PangoFontDescription *config_t::*member, const char *value,
+																		 const char *doc) {
+	return {key, config_type_t::FONT, member, 0, value, APPLY_FONT, doc, -1};
+}
+constexpr config_entry_t config_cursor(const char *key, VteCursorShape config_t::*member, VteCursorShape value,
+																			 const char *doc) {
+	return {key, config_type_t::CURSOR, member, value, NULL, APPLY_TERMINALS, doc, -1};
+}
+constexpr config_entry_t config_modifier(const char *key, accel_t config_t::*member, guint value, const char *doc) {
+	return {key, config_type_t::MODIFIER, member, (gint)value, NULL, APPLY_NONE, doc, -1};
+}
+constexpr config_entry_t config_key(const char *key, keycode_t config_t::*member, guint value, const char *doc) {
+	return {key, config_type_t::KEY, member, (gint)value, NULL, APPLY_NONE, doc, -1};
+}
+constexpr config_entry_t config_colorset_key(const char *key, int colorset, const char *doc) {
+	return {key, config_type_t::KEY, &config_t::set_colorset_keys, (gint)DEFAULT_COLORSET_KEYS[colorset], NULL,
+					APPLY_NONE, doc, colorset};
+}
+
+/* Keyval a KEY row points at, plain member or array element */
+inline keycode_t &config_keyval(const config_entry_t &entry, config_t &config) {
+	if (entry.index >= 0)
+		return (config.*entry.member.keys)[entry.index];
+	return config.*entry.member.uinteger;
+}
+
+/* In the order of the README table */
+static constexpr config_entry_t CONFIG_SCHEMA[] = {
+		config_int("scroll_lines", &config_t::scroll_lines, DEFAULT_SCROLL_LINES, APPLY_TERMINALS,
+							 "How many lines of scrollback to store"),
+		config_int("scroll_amount", &config_t::scroll_amount, DEFAULT_SCROLL_AMOUNT, APPLY_NONE,
+							 "Amount to scroll up when you scroll up"),
+		config_int("copy_last_lines", &config_t::copy_last_lines, DEFAULT_COPY_LAST_LINES, APPLY_NONE,
+							 "How many lines the \"Copy last lines\" menu entry copies"),
+		config_font("font", &config_t::font, DEFAULT_FONT, "Default font"),
+		config_yes_no("show_always_first_tab", &config_t::first_tab, false, APPLY_TABS,
+									"Should ume always show the first tab"),
+		config_bool("scrollbar", &config_t::show_scrollbar, false, APPLY_TERMINALS,
+								"Should the terminal show the scroll bar"),
+		config_bool("closebutton", &config_t::show_closebutton, true, APPLY_NONE, "Should ume show the close button"),
+		config_bool("tabs_on_bottom", &config_t::tabs_on_bottom, false, APPLY_TABS, "Show tabs on the bottom of the screen"),
+		config_bool("less_questions", &config_t::less_questions, false, APPLY_NONE, "Show less pop ups"),
+		config_bool("disable_numbered_tabswitch", &config_t::disable_numbered_tabswitch, false, APPLY_NONE,
+								"Allows you to switch to tabs by pressing numbers"),
+		config_bool("use_fading", &config_t::use_fading, false, APPLY_NONE,
+								"Fade text out when terminal is not focused"),
+		config_bool("scrollable_tabs", &config_t::scrollable_tabs, true, APPLY_TABS,
+								"Use the scrollwheel to scroll over tabs"),
+		config_yes_no("urgent_bell", &config_t::urgent_bell, true, APPLY_NONE,
+									"Enable urgent bell when something pops up in the terminal"),
+		config_yes_no("audible_bell", &config_t::audible_bell, true, APPLY_TERMINALS, "Should the bell make a sound"),
+		config_yes_no("blinking_cursor", &config_t::blinking_cursor, false, APPLY_TERMINALS, "Should the cursor blink"),
+		config_yes_no("stop_tab_cycling_at_end_tabs", &config_t::stop_tab_cycling_at_end_tabs, false, APPLY_NONE,
+									"Stop at the end when tabbing through tabs"),
+		config_yes_no("allow_bold", &config_t::allow_bold, true, APPLY_TERMINALS, "Allow displaying bolded characters"),
+		config_cursor("cursor_type", &config_t::cursor_type, VTE_CURSOR_SHAPE_BLOCK, "Shape of the cursor"),
+		config_string("word_chars", &config_t::word_chars, DEFAULT_WORD_CHARS, APPLY_TERMINALS,
+									"Characters that define breaks between words"),
+		config_modifier("add_tab_modifier", &config_t::add_tab_modifier, DEFAULT_ADD_TAB_MODIFIER,
+										"Modifier for creating tabs"),
+		config_modifier("del_tab_modifier", &config_t::del_tab_modifier, DEFAULT_DEL_TAB_MODIFIER,
+										"Modifier for deleting tabs"),
+		config_modifier("switch_tab_modifier", &config_t::switch_tab_modifier, DEFAULT_SWITCH_TAB_MODIFIER,
+										"Modifier for switching tabs"),
+		config_modifier("move_tab_modifier", &config_t::move_tab_modifier, DEFAULT_MOVE_TAB_MODIFIER,
+										"Modifier for moving tabs"),
+		config_modifier("copy_modifier", &config_t::copy_modifier, DEFAULT_COPY_MODIFIER, "Modifier for copying"),
+		config_modifier("scrollbar_modifier", &config_t::scrollbar_modifier, DEFAULT_SCROLLBAR_MODIFIER,
+										"Modifier for toggling the scrollbar"),
+		config_modifier("open_url_modifier", &config_t::open_url_modifier, DEFAULT_OPEN_URL_MODIFIER,
+										"Modifier for opening a url"),
+		config_modifier("font_size_modifier", &config_t::font_size_modifier, DEFAULT_FONT_SIZE_MODIFIER,
+										"Modifier for adjusting font size"),
+		config_modifier("set_tab_name_modifier", &config_t::set_tab_name_modifier, DEFAULT_SET_TAB_NAME_MODIFIER,
+										"Modifier for setting the tab name"),
+		config_modifier("search_modifier", &config_t::search_modifier, DEFAULT_SEARCH_MODIFIER,
+										"Modifier for opening the search menu"),
+		config_key("add_tab_key", &config_t::add_tab_key, DEFAULT_ADD_TAB_KEY,
+							 "Key to create a new tab, uses `add_tab_modifier`"),
+		config_key("del_tab_key", &config_t::del_tab_key, DEFAULT_DEL_TAB_KEY, "Key to close a tab, uses `del_tab_modifier`"),
+		config_key("prev_tab_key", &config_t::prev_tab_key, DEFAULT_PREV_TAB_KEY,
+							 "Key to switch to the previous tab, uses `switch_tab_modifier`"),
+		config_key("next_tab_key", &config_t::next_tab_key, DEFAULT_NEXT_TAB_KEY,
+							 "Key to switch to the next tab, uses `switch_tab_modifier`"),
+		config_key("copy_key", &config_t::copy_key, DEFAULT_COPY_KEY, "Key to copy selection, uses `copy_modifier`"),
+		config_key("paste_key", &config_t::paste_key, DEFAULT_PASTE_KEY, "Key to paste, uses `copy_modifier`"),
+		config_key("copy_output_key", &config_t::copy_output_key, DEFAULT_COPY_OUTPUT_KEY,
+							 "Key to copy the output of the last command marked by the shell, uses `copy_modifier`"),
+		config_key("scrollbar_key", &config_t::scrollbar_key, DEFAULT_SCROLLBAR_KEY,
+							 "Key to toggle the scroll bar, uses `scrollbar_modifier`"),
+		config_key("scroll_up_key", &config_t::scroll_up_key, DEFAULT_SCROLL_UP_KEY,
+							 "Key to scroll up, uses `scrollbar_modifier`"),
+		config_key("scroll_down_key", &config_t::scroll_down_key, DEFAULT_SCROLL_DOWN_KEY,
+							 "Key to scroll down, uses `scrollbar_modifier`"),
+		config_key("page_up_key", &config_t::page_up_key, DEFAULT_PAGE_UP_KEY, "Key to page up, uses `scrollbar_modifier`"),
+		config_key("page_down_key", &config_t::page_down_key, DEFAULT_PAGE_DOWN_KEY,
+							 "Key to page down, uses `scrollbar_modifier`"),
+		config_key("prev_prompt_key", &config_t::prev_prompt_key, DEFAULT_PREV_PROMPT_KEY,
+							 "Key to jump to the previous shell prompt, uses `scrollbar_modifier`"),
+		config_key("next_prompt_key", &config_t::next_prompt_key, DEFAULT_NEXT_PROMPT_KEY,
+							 "Key to jump to the next shell prompt, uses `scrollbar_modifier`"),
+		config_key("set_tab_name_key", &config_t::set_tab_name_key, DEFAULT_SET_TAB_NAME_KEY,
+							 "Key to set the current tab name, uses `set_tab_name_modifier`"),
+		config_key("search_key", &config_t::search_key, DEFAULT_SEARCH_KEY, "Key to open search menu, uses `search_modifier`"),
+		config_key("increase_font_size_key", &config_t::increase_font_size_key, DEFAULT_INCREASE_FONT_SIZE_KEY,
+							 "Key to zoom the current tab in, uses `font_size_modifier`"),
+		config_key("decrease_font_size_key", &config_t::decrease_font_size_key, DEFAULT_DECREASE_FONT_SIZE_KEY,
+							 "Key to zoom the current tab out, uses `font_size_modifier`"),
+		config_key("reset_font_size_key", &config_t::reset_font_size_key, DEFAULT_RESET_FONT_SIZE_KEY,
+							 "Key to reset the zoom of the current tab, uses `font_size_modifier`"),
+		config_key("fullscreen_key", &config_t::fullscreen_key, DEFAULT_FULLSCREEN_KEY,
+							 "Key to make the terminal fullscreen, doesn't have an modifier"),
+		config_colorset_key("colors1_key", 0, "Key to switch to the 1st colorset, uses `set_colorset_modifier`"),
+		config_colorset_key("colors2_key", 1, "Key to switch to the 2nd colorset, uses `set_colorset_modifier`"),
+		config_colorset_key("colors3_key", 2, "Key to switch to the 3rd colorset, uses `set_colorset_modifier`"),
+		config_colorset_key("colors4_key", 3, "Key to switch to the 4th colorset, uses `set_colorset_modifier`"),
+		config_colorset_key("colors5_key", 4, "Key to switch to the 5th colorset, uses `set_colorset_modifier`"),
+		config_colorset_key("colors6_key", 5, "Key to switch to the 6th colorset, uses `set_colorset_modifier`"),
+		config_modifier("set_colorset_modifier", &config_t::set_colorset_modifier, DEFAULT_SELECT_COLORSET_MODIFIER,
+										"Modifier for changing to a colorset"),
+		config_string("icon_file", &config_t::icon, ICON_FILE, APPLY_NONE, "Path to icon file"),
+		config_string("tab_default_title", &config_t::tab_default_title, NULL, APPLY_NONE,
+									"Label of new tabs, `%d` is replaced by the tab number. `Terminal %d` when unset"),
+		config_bool("ignore_overwrite", &config_t::ignore_overwrite, false, APPLY_NONE,
+								"Ignore the overwrite prompt when closing ume. Does not overwrite the existing config file"),
+		config_bool("log_output", &config_t::log_output, false, APPLY_NONE,
+								"Log everything printed in new tabs. \"Log output\" in the popup menu toggles it per tab"),
+		config_string("log_directory", &config_t::log_directory, "", APPLY_NONE,
+									"Where logs go, `$XDG_STATE_HOME/ume/logs` when empty"),
+		config_bool("log_compress", &config_t::log_compress, true, APPLY_NONE, "Gzip log files"),
+		config_int("log_max_size", &config_t::log_max_size, DEFAULT_LOG_MAX_SIZE, APPLY_NONE,
+							 "Start a new log file after this many MiB of output"),
+		config_int("log_rotate_minutes", &config_t::log_rotate_minutes, DEFAULT_LOG_ROTATE_MINUTES, APPLY_NONE,
+							 "Start a new log file after this many minutes"),
+		config_bool("save_session", &config_t::save_session, true, APPLY_SESSION_TIMER,
+								"Save the open tabs (order, directory, names set by hand, colorset and scrollback) to "
+								"`$XDG_STATE_HOME/ume/session` periodically and on exit, `ume --restore` opens them again"),
+		config_int("session_save_interval", &config_t::session_save_interval, DEFAULT_SESSION_SAVE_INTERVAL,
+							 APPLY_SESSION_TIMER, "Seconds between session saves, `0` saves only on exit"),
+		config_int("session_scrollback_lines", &config_t::session_scrollback_lines, DEFAULT_SESSION_SCROLLBACK_LINES,
+							 APPLY_NONE, "Rows of scrollback saved per tab"),
+		config_bool("persistent_sessions", &config_t::persistent_sessions, false, APPLY_NONE,
+								"Run the shells of new tabs under a session holder process, so they survive ume crashing or its "
+								"window being closed. The next ume brings back the tabs left behind, with their recent output"),
+		config_int("dropdown_height", &config_t::dropdown_height, DEFAULT_DROPDOWN_HEIGHT, APPLY_NONE,
+							 "Height of the `--dropdown` window, in percent of the monitor it's shown on"),
+		config_bool("accessibility", &config_t::accessibility, true, APPLY_NONE,
+								"Let screen readers and other assistive technologies read the terminals, when one is running. "
+								"`false` (or `--no-accessibility`) saves VTE the work of reporting every change of the text"),
+		config_string("fast_render_colorsets", &config_t::fast_render_colorsets, "", APPLY_NONE,
+									"Colorsets whose tabs render fast, e.g. `5,6`. \"Fast rendering\" in the popup menu toggles it per "
+									"tab. A fast tab trades BiDi, shaping and link detection for output throughput"),
+		config_int("fast_render_interval", &config_t::fast_render_interval, 0, APPLY_NONE,
+							 "Milliseconds a fast tab waits between reads of its output, so it's redrawn less often. `0` reads "
+							 "it as it comes"),
+		config_bool("early_shell", &config_t::early_shell, false, APPLY_NONE,
+								"Start the first tab's shell while the window is being built, so its prompt shows up sooner. That "
+								"shell doesn't get `WINDOWID`, there is no window yet"),
+		config_modifier("reload_modifier", &config_t::reload_modifier, DEFAULT_RELOAD_MODIFIER,
+										"Modifier to for the reload keybind"),
+		config_key("reload_key", &config_t::reload_key, DEFAULT_RELOAD_KEY, "Key to reload config file"),
+};
+
 /*
  *struct keybind_t parse_keybind(const char *cstr) {
  *  assert(cstr != nullptr);
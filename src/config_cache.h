@@ -0,0 +1,200 @@
+#pragma once
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+#include "config.h"
+
+/* Fully resolved config_t, so launching with an unchanged config file skips parsing it. It is only
+ * valid for the config file with the mtime and size in the header, and for the build and schema
+ * that wrote it. Layout: a header, the colors as they are in memory, one value per CONFIG_SCHEMA
+ * row, one for the [matches] rules and then the strings those values point into. Written in host byte order like the session file. */
+struct config_cache_header_t {
+	char magic[8];
+	guint32 version;
+	guint32 schema_hash; /* See config_cache_t::schema_hash */
+	gint64 config_mtime_ns;
+	guint64 config_size;
+	guint32 entries;
+	guint32 colors_size;
+};
+
+struct config_cache_value_t {
+	gint64 value;					 /* Numbers, booleans, keyvals and cursor shapes */
+	guint32 string_offset; /* STRING and FONT, from the start of the string area */
+	guint32 string_len;		 /* NO_STRING for a NULL string */
+};
+
+struct config_cache_t {
+	static constexpr char MAGIC[8] = {'U', 'M', 'E', 'C', 'O', 'N', 'F', '\0'};
+	static constexpr guint32 FORMAT_VERSION = 2;
+	static constexpr guint32 NO_STRING = G_MAXUINT32;
+	static constexpr gsize ENTRIES = G_N_ELEMENTS(CONFIG_SCHEMA);
+	static constexpr gsize VALUES = ENTRIES + 1; /* The match rules follow the schema rows */
+
+	/* FNV-1a of the version and of every row's key and type, a cache from another build or schema is
+	 * never trusted */
+	static constexpr guint32 schema_hash() {
+		guint32 hash = 2166136261u;
+		for (const char *c = VERSION; *c; ++c)
+			hash = (hash ^ (guint8)*c) * 16777619u;
+		for (const config_entry_t &entry : CONFIG_SCHEMA) {
+			for (const char *c = entry.key; *c; ++c)
+				hash = (hash ^ (guint8)*c) * 16777619u;
+			hash = (hash ^ (guint32)entry.type) * 16777619u;
+		}
+		return hash;
+	}
+
+	static gint64 mtime_ns(const GStatBuf &st) {
+		return (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st.st_mtim.tv_nsec;
+	}
+
+	static void add_string(GByteArray *strings, config_cache_value_t &value, const char *string) {
+		if (!string) {
+			value.string_len = NO_STRING;
+			return;
+		}
+		value.string_offset = strings->len;
+		value.string_len = strlen(string);
+		g_byte_array_append(strings, (const guint8 *)string, value.string_len);
+	}
+
+	/* config must be exactly what the config file described by st loads to */
+	static bool write(const char *path, const GStatBuf &st, config_t &config, GError **error) {
+		config_cache_header_t header = {};
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = FORMAT_VERSION;
+		header.schema_hash = schema_hash();
+		header.config_mtime_ns = mtime_ns(st);
+		header.config_size = st.st_size;
+		header.entries = ENTRIES;
+		header.colors_size = sizeof(term_colors_t);
+
+		GByteArray *out = g_byte_array_new();
+		GByteArray *strings = g_byte_array_new();
+		g_byte_array_append(out, (const guint8 *)&header, sizeof(header));
+		g_byte_array_append(out, (const guint8 *)&config.colors, sizeof(term_colors_t));
+
+		for (const config_entry_t &entry : CONFIG_SCHEMA) {
+			config_cache_value_t value = {};
+			switch (entry.type) {
+			case config_type_t::INT:
+				value.value = config.*entry.member.integer;
+				break;
+			case config_type_t::BOOL:
+			case config_type_t::YES_NO:
+				value.value = config.*entry.member.boolean;
+				break;
+			case config_type_t::MODIFIER:
+				value.value = config.*entry.member.uinteger;
+				break;
+			case config_type_t::KEY:
+				value.value = config_keyval(entry, config);
+				break;
+			case config_type_t::CURSOR:
+				value.value = config.*entry.member.cursor;
+				break;
+			case config_type_t::STRING:
+				add_string(strings, value, config.*entry.member.string);
+				break;
+			case config_type_t::FONT: {
+				gchar *descriptor = pango_font_description_to_string(config.*entry.member.font);
+				add_string(strings, value, descriptor);
+				g_free(descriptor);
+				break;
+			}
+			}
+			g_byte_array_append(out, (const guint8 *)&value, sizeof(value));
+		}
+		config_cache_value_t rules = {};
+		add_string(strings, rules, config.match_rules);
+		g_byte_array_append(out, (const guint8 *)&rules, sizeof(rules));
+		g_byte_array_append(out, strings->data, strings->len);
+		g_byte_array_unref(strings);
+
+		bool ok = g_file_set_contents_full(path, (const gchar *)out->data, out->len, G_FILE_SET_CONTENTS_CONSISTENT, 0600,
+																			 error);
+		g_byte_array_unref(out);
+		return ok;
+	}
+
+	/* Fills config from the cache, false without touching it if the cache is missing, stale or damaged.
+	 * Strings and the font are new, like the ones the key file loader makes */
+	static bool read(const char *path, const GStatBuf &st, config_t &config) {
+		GMappedFile *mapped = g_mapped_file_new(path, false, NULL);
+		if (!mapped)
+			return false;
+
+		gsize size = g_mapped_file_get_length(mapped);
+		const guint8 *data = (const guint8 *)g_mapped_file_get_contents(mapped);
+		const config_cache_header_t *header = (const config_cache_header_t *)data;
+		gsize fixed = sizeof(*header) + sizeof(term_colors_t) + VALUES * sizeof(config_cache_value_t);
+		if (size < fixed || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != FORMAT_VERSION ||
+				header->schema_hash != schema_hash() || header->entries != ENTRIES ||
+				header->colors_size != sizeof(term_colors_t) || header->config_mtime_ns != mtime_ns(st) ||
+				header->config_size != (guint64)st.st_size) {
+			g_mapped_file_unref(mapped);
+			return false;
+		}
+
+		const config_cache_value_t *values =
+				(const config_cache_value_t *)(data + sizeof(*header) + sizeof(term_colors_t));
+		const char *strings = (const char *)data + fixed;
+		gsize strings_size = size - fixed;
+		for (gsize i = 0; i < VALUES; ++i) {
+			const config_cache_value_t &value = values[i];
+			bool has_string = i == ENTRIES || CONFIG_SCHEMA[i].type == config_type_t::STRING ||
+												CONFIG_SCHEMA[i].type == config_type_t::FONT;
+			if (has_string && value.string_len != NO_STRING &&
+					(value.string_offset > strings_size || value.string_len > strings_size - value.string_offset)) {
+				g_mapped_file_unref(mapped);
+				return false;
+			}
+		}
+
+		memcpy(&config.colors, data + sizeof(*header), sizeof(term_colors_t));
+		for (gsize i = 0; i < ENTRIES; ++i) {
+			const config_entry_t &entry = CONFIG_SCHEMA[i];
+			const config_cache_value_t &value = values[i];
+			gchar *string = NULL;
+			if (value.string_len != NO_STRING && (entry.type == config_type_t::STRING || entry.type == config_type_t::FONT))
+				string = g_strndup(strings + value.string_offset, value.string_len);
+
+			switch (entry.type) {
+			case config_type_t::INT:
+				config.*entry.member.integer = value.value;
+				break;
+			case config_type_t::BOOL:
+			case config_type_t::YES_NO:
+				config.*entry.member.boolean = value.value != 0;
+				break;
+			case config_type_t::MODIFIER:
+				config.*entry.member.uinteger = value.value;
+				break;
+			case config_type_t::KEY:
+				config_keyval(entry, config) = value.value;
+				break;
+			case config_type_t::CURSOR:
+				config.*entry.member.cursor = (VteCursorShape)value.value;
+				break;
+			case config_type_t::STRING:
+				config.*entry.member.string = string;
+				string = NULL;
+				break;
+			case config_type_t::FONT:
+				config.*entry.member.font = pango_font_description_from_string(string ? string : "");
+				break;
+			}
+			g_free(string);
+		}
+		const config_cache_value_t &rules = values[ENTRIES];
+		config.match_rules = NULL;
+		if (rules.string_len != NO_STRING)
+			config.match_rules = g_strndup(strings + rules.string_offset, rules.string_len);
+
+		g_mapped_file_unref(mapped);
+		return true;
+	}
+};
@@ -2,15 +2,36 @@
 #include <gdk/gdk.h>
 
 static constexpr const char *ICON_FILE = "terminal-tango.svg";
+/* ICON_FILE rasterized at build time and compiled in with the stylesheet, see ume.gresource.xml */
+static constexpr int ICON_SIZES[] = {16, 32, 48, 128};
+static constexpr const char *ICON_RESOURCE_FORMAT = "/org/ume/icons/terminal-tango-%d.png";
+static constexpr const char *CSS_RESOURCE = "/org/ume/ume.css";
 static constexpr int SCROLL_LINES = 4096;
 static constexpr int DEFAULT_SCROLL_LINES = 4096;
-static constexpr const char *HTTP_REGEXP = "(ftp|http)s?://[^ \t\n\b()<>{}«»\\[\\]\'\"]+[^.]";
-static constexpr const char *MAIL_REGEXP = "[^ \t\n\b]+@([^ \t\n\b]+\\.)+([a-zA-Z]{2,4})";
+/* [matches] group: NAME = REGEX, with the action for it in NAME_action. A config file without the
+ * group gets these */
+static constexpr const char *MATCHES_GROUP = "matches";
+static constexpr const char *MATCH_ACTION_SUFFIX = "_action";
+static constexpr const char *MATCH_DEFAULT_ACTION = "open";
+struct match_default_t {
+	const char *name, *regex, *action;
+};
+static constexpr match_default_t DEFAULT_MATCHES[] = {
+		{"url", "(ftp|http)s?://[^ \t\n\b()<>{}«»\\[\\]\'\"]+[^.]", "open"},
+		{"mail", "[^ \t\n\b]+@([^ \t\n\b]+\\.)+([a-zA-Z]{2,4})", "mail"},
+};
+/* Separators of config_t::match_rules, control characters no regex in a config file has */
+static constexpr char MATCH_FIELD_SEPARATOR = '\x1f';
+static constexpr char MATCH_RULE_SEPARATOR = '\x1e';
 static constexpr const char *DEFAULT_CONFIGFILE = "ume.conf";
 static constexpr int DEFAULT_COLUMNS = 80;
 static constexpr int DEFAULT_ROWS = 24;
 static constexpr const char *DEFAULT_FONT = "Ubuntu Mono,monospace 12";
 static constexpr int FONT_MINIMAL_SIZE = (PANGO_SCALE * 6);
+/* Per-tab zoom is a VTE font scale, each step multiplies it. VTE clamps it to 0.25 - 4 */
+static constexpr double FONT_SCALE_STEP = 1.1;
+static constexpr double FONT_SCALE_MIN = 0.25;
+static constexpr double FONT_SCALE_MAX = 4.0;
 static constexpr const char *DEFAULT_WORD_CHARS = "-,./?%&#_~:";
 static constexpr int TAB_MAX_SIZE = 40;
 static constexpr int TAB_MIN_SIZE = 6;
@@ -34,23 +55,29 @@ static constexpr guint DEFAULT_PREV_TAB_KEY = GDK_KEY_Left;
 static constexpr guint DEFAULT_NEXT_TAB_KEY = GDK_KEY_Right;
 static constexpr guint DEFAULT_COPY_KEY = GDK_KEY_C;
 static constexpr guint DEFAULT_PASTE_KEY = GDK_KEY_V;
+static constexpr guint DEFAULT_COPY_OUTPUT_KEY = GDK_KEY_O;
 
 static constexpr guint DEFAULT_SCROLLBAR_KEY = GDK_KEY_S;
 static constexpr guint DEFAULT_SCROLL_UP_KEY = GDK_KEY_K;
 static constexpr guint DEFAULT_SCROLL_DOWN_KEY = GDK_KEY_J;
 static constexpr guint DEFAULT_PAGE_UP_KEY = GDK_KEY_U;
 static constexpr guint DEFAULT_PAGE_DOWN_KEY = GDK_KEY_D;
+static constexpr guint DEFAULT_PREV_PROMPT_KEY = GDK_KEY_Up;
+static constexpr guint DEFAULT_NEXT_PROMPT_KEY = GDK_KEY_Down;
 static constexpr int DEFAULT_SCROLL_AMOUNT = 10;
+static constexpr int DEFAULT_COPY_LAST_LINES = 1000;
 
 static constexpr guint DEFAULT_SET_TAB_NAME_KEY = GDK_KEY_N;
 static constexpr guint DEFAULT_SEARCH_KEY = GDK_KEY_F;
 static constexpr guint DEFAULT_FULLSCREEN_KEY = GDK_KEY_F11;
 static constexpr guint DEFAULT_INCREASE_FONT_SIZE_KEY = GDK_KEY_plus;
 static constexpr guint DEFAULT_DECREASE_FONT_SIZE_KEY = GDK_KEY_minus;
+static constexpr guint DEFAULT_RESET_FONT_SIZE_KEY = GDK_KEY_0;
 static constexpr bool DEFAULT_SCROLLABLE_TABS = false;
 
 static constexpr int DEFAULT_RELOAD_MODIFIER = 5;
 static constexpr guint DEFAULT_RELOAD_KEY = GDK_KEY_R;
+static constexpr guint DEFAULT_COLORSET_KEYS[] = {GDK_KEY_F1, GDK_KEY_F2, GDK_KEY_F3, GDK_KEY_F4, GDK_KEY_F5, GDK_KEY_F6};
 
 static constexpr int NUM_COLORSETS = 6;
 
@@ -59,33 +86,128 @@ static constexpr const char *COLOR_FOREGROUND_KEY = "foreground";
 static constexpr const char *COLOR_BACKGROUND_KEY = "background";
 static constexpr const char *COLOR_CURSOR_KEY = "cursor";
 static constexpr const char *COLOR_PALETTE_KEY = "color%u";
-static constexpr const char *COLOR_SWITCH_KEY = "colors%u_key";
 
 static constexpr int PALETTE_SIZE = 16;
-/* 16 color palettes in GdkRGBA format (red, green, blue, alpha)
+static constexpr GdkRGBA palette_rgb(int red, int green, int blue) {
+	return {red / 255.0, green / 255.0, blue / 255.0, 1.0};
+}
+/* Colors of a colorset missing from the config file */
+static constexpr GdkRGBA DEFAULT_FOREGROUND = palette_rgb(192, 192, 192);
+static constexpr GdkRGBA DEFAULT_BACKGROUND = palette_rgb(0, 0, 0);
+static constexpr GdkRGBA DEFAULT_CURSOR = palette_rgb(255, 255, 255);
+/* 16 color palettes, GdkRGBA values built at compile time.
  * Text displayed in the first 8 colors (0-7) is meek (uses thin strokes).
  * Text displayed in the second 8 colors (8-15) is bold (uses thick strokes). */
-static constexpr const char *DEFAULT_PALETTES[NUM_COLORSETS][PALETTE_SIZE] = {
-		{"rgba(33,33,33,1)", "rgba(221,50,90,1)", "rgba(69,123,36,1)", "rgba(255,172,120,1)", "rgba(19,78,178,1)",
-		 "rgba(86,0,136,1)", "rgba(14,113,124,1)", "rgba(239,239,239,1)", "rgba(125,125,125,1)", "rgba(232,59,63,1)",
-		 "rgba(122,186,58,1)", "rgba(255,133,55,1)", "rgba(84,164,243,1)", "rgba(170,77,188,1)", "rgba(38,187,209,1)",
-		 "rgba(217,217,217,1)"},
-		{"rgba(0,0,0,1)", "rgba(204,0,0,1)", "rgba(77,154,5,1)", "rgba(195,160,0,1)", "rgba(52,100,163,1)",
-		 "rgba(117,79,123,1)", "rgba(5,151,154,1)", "rgba(211,214,207,1)", "rgba(84,86,82,1)", "rgba(239,40,40,1)",
-		 "rgba(137,226,52,1)", "rgba(251,232,79,1)", "rgba(114,158,207,1)", "rgba(172,126,168,1)", "rgba(52,226,226,1)",
-		 "rgba(237,237,235,1)"},
-		{"rgba(0,0,0,1)", "rgba(170,0,0,1)", "rgba(0,170,0,1)", "rgba(170,84,0,1)", "rgba(0,0,170,1)", "rgba(170,0,170,1)",
-		 "rgba(0,170,170,1)", "rgba(170,170,170,1)", "rgba(84,84,84,1)", "rgba(255,84,84,1)", "rgba(84,255,84,1)",
-		 "rgba(255,255,84,1)", "rgba(84,84,255,1)", "rgba(255,84,255,1)", "rgba(84,255,255,1)", "rgba(255,255,255,1)"},
-		{"rgba(7,54,66,1)", "rgba(219,49,47,1)", "rgba(133,153,0,1)", "rgba(181,137,0,1)", "rgba(38,138,209,1)",
-		 "rgba(211,54,130,1)", "rgba(42,161,151,1)", "rgba(237,232,212,1)", "rgba(0,42,54,1)", "rgba(202,75,22,1)",
-		 "rgba(87,110,117,1)", "rgba(100,123,130,1)", "rgba(130,147,149,1)", "rgba(107,112,195,1)", "rgba(147,161,161,1)",
-		 "rgba(253,246,226,1)"},
-		{"rgba(237,232,212,1)", "rgba(219,49,47,1)", "rgba(133,153,0,1)", "rgba(181,137,0,1)", "rgba(38,138,209,1)",
-		 "rgba(211,54,130,1)", "rgba(42,161,151,1)", "rgba(7,54,66,1)", "rgba(253,246,226,1)", "rgba(202,75,22,1)",
-		 "rgba(147,161,161,1)", "rgba(130,147,149,1)", "rgba(100,123,130,1)", "rgba(107,112,195,1)", "rgba(87,110,117,1)",
-		 "rgba(0,42,54,1)"},
-		{"rgba(0,0,0,1)", "rgba(205,0,0,1)", "rgba(0,205,0,1)", "rgba(205,205,0,1)", "rgba(29,144,255,1)",
-		 "rgba(205,0,205,1)", "rgba(0,205,205,1)", "rgba(228,228,228,1)", "rgba(75,75,75,1)", "rgba(255,0,0,1)",
-		 "rgba(0,255,0,1)", "rgba(255,255,0,1)", "rgba(70,130,179,1)", "rgba(255,0,255,1)", "rgba(0,255,255,1)",
-		 "rgba(255,255,255,1)"}};
+static constexpr GdkRGBA DEFAULT_PALETTES[NUM_COLORSETS][PALETTE_SIZE] = {
+		{palette_rgb(33, 33, 33), palette_rgb(221, 50, 90), palette_rgb(69, 123, 36), palette_rgb(255, 172, 120),
+		 palette_rgb(19, 78, 178), palette_rgb(86, 0, 136), palette_rgb(14, 113, 124), palette_rgb(239, 239, 239),
+		 palette_rgb(125, 125, 125), palette_rgb(232, 59, 63), palette_rgb(122, 186, 58), palette_rgb(255, 133, 55),
+		 palette_rgb(84, 164, 243), palette_rgb(170, 77, 188), palette_rgb(38, 187, 209), palette_rgb(217, 217, 217)},
+		{palette_rgb(0, 0, 0), palette_rgb(204, 0, 0), palette_rgb(77, 154, 5), palette_rgb(195, 160, 0),
+		 palette_rgb(52, 100, 163), palette_rgb(117, 79, 123), palette_rgb(5, 151, 154), palette_rgb(211, 214, 207),
+		 palette_rgb(84, 86, 82), palette_rgb(239, 40, 40), palette_rgb(137, 226, 52), palette_rgb(251, 232, 79),
+		 palette_rgb(114, 158, 207), palette_rgb(172, 126, 168), palette_rgb(52, 226, 226), palette_rgb(237, 237, 235)},
+		{palette_rgb(0, 0, 0), palette_rgb(170, 0, 0), palette_rgb(0, 170, 0), palette_rgb(170, 84, 0),
+		 palette_rgb(0, 0, 170), palette_rgb(170, 0, 170), palette_rgb(0, 170, 170), palette_rgb(170, 170, 170),
+		 palette_rgb(84, 84, 84), palette_rgb(255, 84, 84), palette_rgb(84, 255, 84), palette_rgb(255, 255, 84),
+		 palette_rgb(84, 84, 255), palette_rgb(255, 84, 255), palette_rgb(84, 255, 255), palette_rgb(255, 255, 255)},
+		{palette_rgb(7, 54, 66), palette_rgb(219, 49, 47), palette_rgb(133, 153, 0), palette_rgb(181, 137, 0),
+		 palette_rgb(38, 138, 209), palette_rgb(211, 54, 130), palette_rgb(42, 161, 151), palette_rgb(237, 232, 212),
+		 palette_rgb(0, 42, 54), palette_rgb(202, 75, 22), palette_rgb(87, 110, 117), palette_rgb(100, 123, 130),
+		 palette_rgb(130, 147, 149), palette_rgb(107, 112, 195), palette_rgb(147, 161, 161), palette_rgb(253, 246, 226)},
+		{palette_rgb(237, 232, 212), palette_rgb(219, 49, 47), palette_rgb(133, 153, 0), palette_rgb(181, 137, 0),
+		 palette_rgb(38, 138, 209), palette_rgb(211, 54, 130), palette_rgb(42, 161, 151), palette_rgb(7, 54, 66),
+		 palette_rgb(253, 246, 226), palette_rgb(202, 75, 22), palette_rgb(147, 161, 161), palette_rgb(130, 147, 149),
+		 palette_rgb(100, 123, 130), palette_rgb(107, 112, 195), palette_rgb(87, 110, 117), palette_rgb(0, 42, 54)},
+		{palette_rgb(0, 0, 0), palette_rgb(205, 0, 0), palette_rgb(0, 205, 0), palette_rgb(205, 205, 0),
+		 palette_rgb(29, 144, 255), palette_rgb(205, 0, 205), palette_rgb(0, 205, 205), palette_rgb(228, 228, 228),
+		 palette_rgb(75, 75, 75), palette_rgb(255, 0, 0), palette_rgb(0, 255, 0), palette_rgb(255, 255, 0),
+		 palette_rgb(70, 130, 179), palette_rgb(255, 0, 255), palette_rgb(0, 255, 255), palette_rgb(255, 255, 255)}};
+
+/* Control socket and stats dumps, both live in $XDG_RUNTIME_DIR/ume */
+static constexpr const char *CTL_DIR = "ume";
+static constexpr const char *CTL_SOCKET_FORMAT = "ume-%d.sock";
+static constexpr const char *STATS_DUMP_FORMAT = "ume-%d.stats.json";
+static constexpr int CTL_MAX_REQUEST = 4096;
+
+/* PTY reading. ume reads the master side itself and feeds VTE */
+static constexpr int PTY_READ_SIZE = 16 * 1024;
+/* Max bytes read per main loop dispatch */
+static constexpr int PTY_READ_BUDGET = 64 * 1024;
+/* Max bytes fed to VTE before it reports progress, reading pauses after that */
+static constexpr int PTY_MAX_PENDING = 1024 * 1024;
+static constexpr int PTY_THROTTLE_MS = 16;
+/* Tabs rendering fast (see ume_term_apply_render) read in bigger chunks */
+static constexpr int FAST_RENDER_READ_SIZE = 64 * 1024;
+static constexpr int FAST_RENDER_READ_BUDGET = 256 * 1024;
+/* Estimated per row bytes VTE keeps on top of the text itself */
+static constexpr int SCROLLBACK_ROW_OVERHEAD = 16;
+
+/* Accessibility is only offered while the AT-SPI registry reports an assistive technology. Asked
+ * once at startup, off the main thread */
+static constexpr const char *A11Y_BUS_NAME = "org.a11y.Bus";
+static constexpr const char *A11Y_BUS_PATH = "/org/a11y/bus";
+static constexpr const char *A11Y_STATUS_INTERFACE = "org.a11y.Status";
+static constexpr int A11Y_DBUS_TIMEOUT_MS = 500;
+
+/* Terminals take the new size of the window once it stopped changing for this long, see UmeVte */
+static constexpr int RESIZE_SETTLE_MS = 100;
+
+/* Main loop iterations busier than this are logged as stalls */
+static constexpr int STALL_THRESHOLD_MS = 50;
+/* Frames further apart than this are a restart after idle, not missed frames */
+static constexpr int FRAME_IDLE_GAP_MS = 250;
+
+/* Streaming paste. Bytes written per PTY writable event */
+static constexpr int PASTE_CHUNK_SIZE = 4096;
+/* Pastes larger than this show their progress on the tab */
+static constexpr int PASTE_PROGRESS_MIN = 64 * 1024;
+static constexpr int PASTE_PROGRESS_INTERVAL_MS = 100;
+/* Bracketed paste markers */
+static constexpr const char *PASTE_START = "\033[200~";
+static constexpr const char *PASTE_END = "\033[201~";
+
+/* Longest escape sequence ume keeps while scanning the output, longer ones are cut */
+static constexpr int SCAN_SEQ_MAX = 32;
+/* Commands remembered per tab, the oldest quarter goes when full */
+static constexpr guint PROMPT_MARKS_MAX = 4096;
+
+/* Copying and exporting ranges of the scrollback. Rows read per idle slice */
+static constexpr int ROW_READER_SLICE = 500;
+/* Copies of ranges stop growing past this, the rest is left out */
+static constexpr gsize COPY_MAX_BYTES = 64 * 1024 * 1024;
+
+/* Output logging */
+static constexpr int DEFAULT_LOG_MAX_SIZE = 64;
+static constexpr int DEFAULT_LOG_ROTATE_MINUTES = 60;
+/* Per tab buffer between the PTY reader and the log writer thread, output past it is dropped */
+static constexpr gsize LOG_RING_SIZE = 4 * 1024 * 1024;
+/* How long exiting waits for log writers to flush */
+static constexpr int LOG_EXIT_WAIT_MS = 2000;
+
+/* Journal of runtime state (colorset, font zoom) in $XDG_STATE_HOME/ume, see state_journal_t */
+static constexpr const char *STATE_FILE = "state";
+
+/* Session checkpoints, see ume_session_save */
+static constexpr int DEFAULT_SESSION_SAVE_INTERVAL = 60;
+static constexpr int DEFAULT_SESSION_SCROLLBACK_LINES = 10000;
+
+/* Session holder of persistent tabs, its socket lives next to the control sockets */
+static constexpr const char *HOLDER_SOCKET = "holder.sock";
+/* How long a new holder gets to start listening, and a request to be answered */
+static constexpr int HOLDER_START_WAIT_MS = 2000;
+static constexpr int HOLDER_TIMEOUT_MS = 2000;
+/* Connecting to a holder that was just started is retried this often */
+static constexpr int HOLDER_RETRY_MS = 10;
+
+/* --dropdown. A running drop-down instance listens on this socket too, next to its control socket */
+static constexpr const char *DROPDOWN_SOCKET = "dropdown.sock";
+/* Percent of the monitor's work area the window is high */
+static constexpr int DEFAULT_DROPDOWN_HEIGHT = 40;
+
+/* tmux control mode (--tmux). Session attached to when none is given */
+static constexpr const char *TMUX_DEFAULT_SESSION = "ume";
+/* What ume asks tmux about each window, parsed by ume_tmux_windows_listed */
+static constexpr const char *TMUX_WINDOW_FORMAT = "#{window_id} #{pane_id} #{window_active} #{window_name}";
+/* Input bytes per send-keys command */
+static constexpr gsize TMUX_SEND_KEYS_CHUNK = 256;
@@ -0,0 +1,534 @@
+#pragma once
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* Session holder. `ume --holder` owns the PTYs of persistent tabs, so their shells outlive the GUI.
+ *
+ * Every attached tab has a connection of its own. The holder sends the PTY master over it with
+ * SCM_RIGHTS, and the GUI writes input and resizes through that fd directly. Output keeps going
+ * through the holder: it replays what it kept of the recent output, then relays the rest live.
+ * Closing the connection detaches, sending KILL first ends the session.
+ *
+ * Requests are one line of tab separated, g_strescape'd fields:
+ *   spawn <rows> <columns> <cwd> <number of env entries> <env...> <file> <argv...>
+ *   attach <id>
+ *   list          replies "<id>\t<pid>\t<attached>\n" per session, then closes
+ * spawn and attach are answered with a holder_reply_t carrying the master fd. */
+struct holder_reply_t {
+	gint32 ok;
+	guint32 id;
+	gint32 pid;
+	char message[116];
+};
+
+/* Sends len bytes with fd attached (fd < 0 for none) */
+static inline bool holder_send_fd(int sock, const void *buf, gsize len, int fd) {
+	struct iovec iov = {(void *)buf, len};
+	struct msghdr msg = {};
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (gssize)len;
+}
+
+/* Receives exactly len bytes, *fd is the attached fd or -1 */
+static inline bool holder_recv_fd(int sock, void *buf, gsize len, int *fd) {
+	struct iovec iov = {buf, len};
+	struct msghdr msg = {};
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	gssize got = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return got == (gssize)len;
+}
+
+struct holder_session_t {
+	guint32 id;
+	GPid pid;
+	int master;
+	int client; /* -1 while detached */
+	guint master_watch, client_watch, out_watch, child_watch;
+	GByteArray *pending; /* Output the client didn't take yet */
+	guint8 *ring;				 /* The last RING_SIZE bytes of output */
+	guint64 ring_head;
+};
+
+/* A connection that hasn't sent its whole request yet */
+struct holder_client_t {
+	int fd;
+	guint watch;
+	GString *request;
+};
+
+struct holder_t {
+	static constexpr gsize RING_SIZE = 256 * 1024;
+	static constexpr gsize READ_SIZE = 64 * 1024;
+	/* Reading a session pauses while its client is this far behind */
+	static constexpr gsize MAX_PENDING = 1024 * 1024;
+	static constexpr gsize MAX_REQUEST = 16 * 1024;
+	static constexpr char KILL = 'k';
+	/* Exit after this long without sessions */
+	static constexpr int IDLE_EXIT_S = 30;
+
+	static holder_t &get() {
+		static holder_t holder;
+		return holder;
+	}
+
+	GMainLoop *loop;
+	GHashTable *sessions; /* id to holder_session_t */
+	gint64 idle_since_us;
+
+	static void ring_append(holder_session_t *session, const guint8 *buf, gsize len) {
+		if (len > RING_SIZE) {
+			session->ring_head += len - RING_SIZE;
+			buf += len - RING_SIZE;
+			len = RING_SIZE;
+		}
+		gsize at = session->ring_head % RING_SIZE;
+		gsize first = MIN(len, RING_SIZE - at);
+		memcpy(session->ring + at, buf, first);
+		memcpy(session->ring, buf + first, len - first);
+		session->ring_head += len;
+	}
+
+	/* Kept output, from the first full line once the ring has wrapped */
+	static GByteArray *ring_contents(holder_session_t *session) {
+		gsize len = MIN(session->ring_head, RING_SIZE);
+		gsize at = (session->ring_head - len) % RING_SIZE;
+		gsize first = MIN(len, RING_SIZE - at);
+		GByteArray *out = g_byte_array_sized_new(len);
+		g_byte_array_append(out, session->ring + at, first);
+		g_byte_array_append(out, session->ring, len - first);
+		if (session->ring_head > RING_SIZE) {
+			guint8 *newline = (guint8 *)memchr(out->data, '\n', out->len);
+			if (newline)
+				g_byte_array_remove_range(out, 0, newline + 1 - out->data);
+		}
+		return out;
+	}
+
+	static void detach(holder_session_t *session) {
+		if (session->client < 0)
+			return;
+		if (session->client_watch)
+			g_source_remove(session->client_watch);
+		if (session->out_watch)
+			g_source_remove(session->out_watch);
+		session->client_watch = session->out_watch = 0;
+		close(session->client);
+		session->client = -1;
+		g_byte_array_set_size(session->pending, 0);
+		resume(session);
+	}
+
+	static void end(holder_session_t *session) {
+		detach(session);
+		if (session->master_watch)
+			g_source_remove(session->master_watch);
+		session->master_watch = 0;
+		if (session->master >= 0)
+			close(session->master);
+		session->master = -1;
+		/* The child watch frees the session once the shell is gone */
+		if (session->pid > 0)
+			kill(-session->pid, SIGHUP);
+	}
+
+	static void resume(holder_session_t *session) {
+		if (!session->master_watch && session->master >= 0)
+			session->master_watch = g_unix_fd_add(session->master, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR),
+																						master_readable, session);
+	}
+
+	static void send_output(holder_session_t *session, const guint8 *buf, gsize len) {
+		if (session->pending->len == 0) {
+			gssize sent = send(session->client, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+				detach(session);
+				return;
+			}
+			sent = MAX(sent, 0);
+			buf += sent;
+			len -= sent;
+		}
+		if (len == 0)
+			return;
+
+		g_byte_array_append(session->pending, buf, len);
+		if (!session->out_watch)
+			session->out_watch = g_unix_fd_add(session->client, G_IO_OUT, client_writable, session);
+		if (session->pending->len >= MAX_PENDING && session->master_watch) {
+			g_source_remove(session->master_watch);
+			session->master_watch = 0;
+		}
+	}
+
+	static gboolean client_writable(gint fd, GIOCondition condition, gpointer data) {
+		holder_session_t *session = (holder_session_t *)data;
+		gssize sent = send(fd, session->pending->data, session->pending->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+			session->out_watch = 0;
+			detach(session);
+			return G_SOURCE_REMOVE;
+		}
+		if (sent > 0)
+			g_byte_array_remove_range(session->pending, 0, sent);
+		if (session->pending->len < MAX_PENDING)
+			resume(session);
+		if (session->pending->len == 0) {
+			session->out_watch = 0;
+			return G_SOURCE_REMOVE;
+		}
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* Returns false once the shell and everything it started closed the slave (EOF or EIO) */
+	static bool read_output(holder_session_t *session, gssize *got) {
+		guint8 buf[READ_SIZE];
+
+		*got = read(session->master, buf, sizeof(buf));
+		if (*got < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+		if (*got <= 0)
+			return false;
+
+		ring_append(session, buf, *got);
+		if (session->client >= 0)
+			send_output(session, buf, *got);
+		return true;
+	}
+
+	static gboolean master_readable(gint fd, GIOCondition condition, gpointer data) {
+		holder_session_t *session = (holder_session_t *)data;
+		gssize got;
+
+		if (!read_output(session, &got)) {
+			session->master_watch = 0;
+			end(session);
+			return G_SOURCE_REMOVE;
+		}
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* Once attached the client only ever sends KILL, or closes */
+	static gboolean client_readable(gint fd, GIOCondition condition, gpointer data) {
+		holder_session_t *session = (holder_session_t *)data;
+		char buf[64];
+
+		gssize len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return G_SOURCE_CONTINUE;
+		session->client_watch = 0;
+		if (len > 0 && memchr(buf, KILL, len))
+			end(session);
+		else
+			detach(session);
+		return G_SOURCE_REMOVE;
+	}
+
+	static void child_exited(GPid pid, gint status, gpointer data) {
+		holder_session_t *session = (holder_session_t *)data;
+		g_spawn_close_pid(pid);
+		session->child_watch = 0;
+		session->pid = 0;
+
+		/* Pass on whatever the shell printed last before the client sees EOF */
+		gssize got = 1;
+		while (session->master >= 0 && got > 0 && session->pending->len == 0) {
+			if (!read_output(session, &got))
+				break;
+		}
+		end(session);
+		g_hash_table_remove(get().sessions, GUINT_TO_POINTER(session->id));
+	}
+
+	static void session_free(holder_session_t *session) {
+		g_byte_array_unref(session->pending);
+		g_free(session->ring);
+		g_free(session);
+	}
+
+	static void reply(int fd, bool ok, holder_session_t *session, const char *message) {
+		holder_reply_t answer = {};
+		answer.ok = ok;
+		if (session) {
+			answer.id = session->id;
+			answer.pid = session->pid;
+		}
+		g_strlcpy(answer.message, message ? message : "", sizeof(answer.message));
+		holder_send_fd(fd, &answer, sizeof(answer), ok ? session->master : -1);
+	}
+
+	/* Hands the session to the connection, replacing any client it had */
+	static void attach(holder_session_t *session, int fd) {
+		detach(session);
+		reply(fd, true, session, NULL);
+		session->client = fd;
+		session->client_watch = g_unix_fd_add(fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), client_readable, session);
+
+		GByteArray *replay = ring_contents(session);
+		send_output(session, replay->data, replay->len);
+		g_byte_array_unref(replay);
+	}
+
+	static holder_session_t *spawn(gchar **fields, gint nfields, GError **error) {
+		/* spawn rows columns cwd envc env... file argv... */
+		if (nfields < 6) {
+			g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Malformed spawn request");
+			return NULL;
+		}
+		struct winsize size = {};
+		size.ws_row = atoi(fields[1]);
+		size.ws_col = atoi(fields[2]);
+		const char *cwd = fields[3];
+		gint envc = atoi(fields[4]);
+		/* Compared before adding to it, a huge count would overflow */
+		if (envc < 0 || envc > nfields - 7) {
+			g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Malformed spawn request");
+			return NULL;
+		}
+		gchar **envv = fields + 5;
+		const char *file = fields[5 + envc];
+		gchar **argv = fields + 5 + envc + 1;
+
+		int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot open a pty: %s", g_strerror(errno));
+			if (master >= 0)
+				close(master);
+			return NULL;
+		}
+		gchar *slave_name = g_strdup(ptsname(master));
+		ioctl(master, TIOCSWINSZ, &size);
+
+		/* Everything that allocates is done before forking, the child only makes system calls */
+		const gchar *home = g_get_home_dir();
+		gchar **envp = g_get_environ();
+		for (gint i = 0; i < envc; ++i) {
+			const char *equals = strchr(envv[i], '=');
+			if (!equals)
+				continue;
+			gchar *name = g_strndup(envv[i], equals - envv[i]);
+			envp = g_environ_setenv(envp, name, equals + 1, true);
+			g_free(name);
+		}
+
+		GPid pid = fork();
+		if (pid == 0) {
+			setsid();
+			int slave = open(slave_name, O_RDWR);
+			if (slave < 0 || ioctl(slave, TIOCSCTTY, 0) < 0)
+				_exit(127);
+			dup2(slave, 0);
+			dup2(slave, 1);
+			dup2(slave, 2);
+			if (slave > 2)
+				close(slave);
+			signal(SIGHUP, SIG_DFL);
+			signal(SIGPIPE, SIG_DFL);
+			signal(SIGUSR1, SIG_DFL);
+			signal(SIGUSR2, SIG_DFL);
+			if (*cwd && chdir(cwd) < 0 && chdir(home) < 0)
+				_exit(127);
+			execvpe(file, argv, envp);
+			_exit(127);
+		}
+		g_free(slave_name);
+		g_strfreev(envp);
+		if (pid < 0) {
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot fork: %s", g_strerror(errno));
+			close(master);
+			return NULL;
+		}
+
+		g_unix_set_fd_nonblocking(master, true, NULL);
+		holder_session_t *session = g_new0(holder_session_t, 1);
+		do {
+			session->id = g_random_int();
+		} while (session->id == 0 || g_hash_table_contains(get().sessions, GUINT_TO_POINTER(session->id)));
+		session->pid = pid;
+		session->master = master;
+		session->client = -1;
+		session->pending = g_byte_array_new();
+		session->ring = (guint8 *)g_malloc(RING_SIZE);
+		session->child_watch = g_child_watch_add(pid, child_exited, session);
+		g_hash_table_insert(get().sessions, GUINT_TO_POINTER(session->id), session);
+		resume(session);
+		return session;
+	}
+
+	static void list(int fd) {
+		GString *out = g_string_new(NULL);
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, get().sessions);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			holder_session_t *session = (holder_session_t *)value;
+			if (session->master >= 0)
+				g_string_append_printf(out, "%u\t%d\t%d\n", session->id, session->pid, session->client >= 0);
+		}
+		send(fd, out->str, out->len, MSG_NOSIGNAL);
+		g_string_free(out, true);
+	}
+
+	/* Returns true if the connection now belongs to a session */
+	static bool handle(int fd, const char *request) {
+		gchar **fields = g_strsplit(request, "\t", -1);
+		gint nfields = g_strv_length(fields);
+		for (gint i = 0; i < nfields; ++i) {
+			gchar *raw = fields[i];
+			fields[i] = g_strcompress(raw);
+			g_free(raw);
+		}
+
+		bool owned = false;
+		if (nfields >= 1 && strcmp(fields[0], "spawn") == 0) {
+			GError *error = NULL;
+			holder_session_t *session = spawn(fields, nfields, &error);
+			if (session) {
+				attach(session, fd);
+				owned = true;
+			} else {
+				reply(fd, false, NULL, error->message);
+				g_error_free(error);
+			}
+		} else if (nfields == 2 && strcmp(fields[0], "attach") == 0) {
+			guint32 id = strtoul(fields[1], NULL, 10);
+			holder_session_t *session = (holder_session_t *)g_hash_table_lookup(get().sessions, GUINT_TO_POINTER(id));
+			if (session && session->master >= 0) {
+				attach(session, fd);
+				owned = true;
+			} else {
+				reply(fd, false, NULL, "No such session");
+			}
+		} else if (nfields == 1 && strcmp(fields[0], "list") == 0) {
+			list(fd);
+		}
+		g_strfreev(fields);
+		return owned;
+	}
+
+	static gboolean request_readable(gint fd, GIOCondition condition, gpointer data) {
+		holder_client_t *client = (holder_client_t *)data;
+		char buf[1024];
+
+		gssize len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return G_SOURCE_CONTINUE;
+		if (len > 0)
+			g_string_append_len(client->request, buf, len);
+
+		char *newline = (char *)memchr(client->request->str, '\n', client->request->len);
+		if (!newline && len > 0 && client->request->len < MAX_REQUEST)
+			return G_SOURCE_CONTINUE;
+
+		bool owned = false;
+		if (newline) {
+			*newline = '\0';
+			owned = handle(fd, client->request->str);
+		}
+		if (!owned)
+			close(fd);
+		g_string_free(client->request, true);
+		g_free(client);
+		return G_SOURCE_REMOVE;
+	}
+
+	static gboolean accept_ready(gint fd, GIOCondition condition, gpointer data) {
+		int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (client_fd >= 0) {
+			holder_client_t *client = g_new0(holder_client_t, 1);
+			client->fd = client_fd;
+			client->request = g_string_new(NULL);
+			client->watch =
+					g_unix_fd_add(client_fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), request_readable, client);
+		}
+		return G_SOURCE_CONTINUE;
+	}
+
+	static gboolean idle_check(gpointer data) {
+		holder_t &holder = get();
+		gint64 now = g_get_monotonic_time();
+		if (g_hash_table_size(holder.sessions) > 0)
+			holder.idle_since_us = now;
+		else if (now - holder.idle_since_us >= (gint64)IDLE_EXIT_S * G_USEC_PER_SEC)
+			g_main_loop_quit(holder.loop);
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* Listens on path until no session is left for IDLE_EXIT_S. Returns the exit status */
+	static int run(const char *path) {
+		holder_t &holder = get();
+		struct sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return 1;
+		strcpy(addr.sun_path, path);
+
+		setsid();
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGPIPE, SIG_IGN);
+		/* The holder is also called ume, `killall -USR1 ume` reloading the instances must not end it */
+		signal(SIGUSR1, SIG_IGN);
+		signal(SIGUSR2, SIG_IGN);
+
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (fd < 0)
+			return 1;
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			/* Either another holder is running, or a dead one left its socket behind */
+			int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			bool alive = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+			close(probe);
+			if (alive || unlink(path) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+				close(fd);
+				return alive ? 0 : 1;
+			}
+		}
+		if (listen(fd, 16) < 0) {
+			close(fd);
+			return 1;
+		}
+
+		holder.loop = g_main_loop_new(NULL, false);
+		holder.sessions = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)session_free);
+		holder.idle_since_us = g_get_monotonic_time();
+		g_unix_fd_add(fd, G_IO_IN, accept_ready, NULL);
+		g_timeout_add_seconds(1, idle_check, NULL);
+		g_main_loop_run(holder.loop);
+
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+};
@@ -0,0 +1,190 @@
+#pragma once
+#include <gio/gio.h>
+#include <glib.h>
+
+#include <string.h>
+
+/* Saved session: a header, one fixed size record per tab and then the variable length data
+ * (cwd, label and gzipped scrollback text) each record points into. The file is mapped on
+ * restore and records are read in place, scrollback stays a slice of the mapping until the
+ * tab is first viewed. Written in host byte order, a file from another machine is rejected. */
+struct session_file_header_t {
+	char magic[8];
+	guint32 version;
+	guint32 tabs;
+	guint32 current; /* Tab that was in front */
+	guint32 reserved;
+};
+
+struct session_file_tab_t {
+	guint64 data_offset; /* cwd, then label, then scrollback */
+	guint64 scrollback_len;
+	guint32 cwd_len;
+	guint32 label_len;
+	guint32 colorset;
+	guint32 flags;
+	guint32 held_id; /* Holder session of a persistent tab, 0 for none */
+	guint32 reserved;
+};
+
+/* One tab as it is saved or restored. Strings may be NULL */
+struct session_tab_t {
+	gchar *cwd;
+	gchar *label;
+	guint32 colorset;
+	guint32 flags;
+	guint32 held_id;
+	GBytes *scrollback; /* gzipped text, NULL when there's none */
+
+	static constexpr guint32 LABEL_SET_BYUSER = 1;
+	static constexpr guint32 FAST_RENDER = 2;
+	/* Set by session_file_t::read only, tabs made up to restore something else lack it */
+	static constexpr guint32 FROM_SESSION = 1u << 31;
+
+	static void free(session_tab_t *tab) {
+		g_free(tab->cwd);
+		g_free(tab->label);
+		if (tab->scrollback)
+			g_bytes_unref(tab->scrollback);
+		g_free(tab);
+	}
+};
+
+struct session_file_t {
+	static constexpr char MAGIC[8] = {'U', 'M', 'E', 'S', 'E', 'S', 'S', '\0'};
+	static constexpr guint32 FORMAT_VERSION = 2;
+
+	/* Runs a whole buffer through a zlib converter */
+	static GBytes *convert(GConverter *converter, const void *data, gsize len) {
+		GByteArray *out = g_byte_array_sized_new(len / 2 + 64);
+		const guint8 *in = (const guint8 *)data;
+		guint8 buf[16 * 1024];
+		GConverterResult result;
+
+		do {
+			gsize read = 0, written = 0;
+			GError *error = NULL;
+			result = g_converter_convert(converter, in, len, buf, sizeof(buf), G_CONVERTER_INPUT_AT_END, &read, &written,
+																	 &error);
+			if (result == G_CONVERTER_ERROR) {
+				g_warning("Session scrollback: %s", error->message);
+				g_error_free(error);
+				break;
+			}
+			g_byte_array_append(out, buf, written);
+			in += read;
+			len -= read;
+		} while (result != G_CONVERTER_FINISHED);
+
+		return g_byte_array_free_to_bytes(out);
+	}
+
+	static GBytes *deflate(const char *text, gsize len) {
+		GZlibCompressor *compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+		GBytes *bytes = convert(G_CONVERTER(compressor), text, len);
+		g_object_unref(compressor);
+		return bytes;
+	}
+
+	static GBytes *inflate(GBytes *compressed) {
+		gsize len;
+		const void *data = g_bytes_get_data(compressed, &len);
+		GZlibDecompressor *decompressor = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+		GBytes *bytes = convert(G_CONVERTER(decompressor), data, len);
+		g_object_unref(decompressor);
+		return bytes;
+	}
+
+	/* Safe to call from any thread */
+	static bool write(const char *path, GPtrArray *tabs, guint32 current, GError **error) {
+		GByteArray *out = g_byte_array_new();
+		session_file_header_t header = {};
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = FORMAT_VERSION;
+		header.tabs = tabs->len;
+		header.current = current;
+		g_byte_array_append(out, (const guint8 *)&header, sizeof(header));
+
+		guint64 offset = sizeof(header) + (guint64)tabs->len * sizeof(session_file_tab_t);
+		for (guint i = 0; i < tabs->len; ++i) {
+			session_tab_t *tab = (session_tab_t *)g_ptr_array_index(tabs, i);
+			session_file_tab_t record = {};
+			record.data_offset = offset;
+			record.cwd_len = tab->cwd ? strlen(tab->cwd) : 0;
+			record.label_len = tab->label ? strlen(tab->label) : 0;
+			if (tab->scrollback)
+				record.scrollback_len = g_bytes_get_size(tab->scrollback);
+			record.colorset = tab->colorset;
+			record.flags = tab->flags;
+			record.held_id = tab->held_id;
+			g_byte_array_append(out, (const guint8 *)&record, sizeof(record));
+			offset += record.cwd_len + record.label_len + record.scrollback_len;
+		}
+
+		for (guint i = 0; i < tabs->len; ++i) {
+			session_tab_t *tab = (session_tab_t *)g_ptr_array_index(tabs, i);
+			if (tab->cwd)
+				g_byte_array_append(out, (const guint8 *)tab->cwd, strlen(tab->cwd));
+			if (tab->label)
+				g_byte_array_append(out, (const guint8 *)tab->label, strlen(tab->label));
+			if (tab->scrollback)
+				g_byte_array_append(out, (const guint8 *)g_bytes_get_data(tab->scrollback, NULL),
+														g_bytes_get_size(tab->scrollback));
+		}
+
+		/* Scrollback is private, and the file is replaced atomically so a mapping of the old one stays valid */
+		bool ok = g_file_set_contents_full(path, (const gchar *)out->data, out->len, G_FILE_SET_CONTENTS_CONSISTENT, 0600,
+																			 error);
+		g_byte_array_unref(out);
+		return ok;
+	}
+
+	/* Array of session_tab_t, NULL if there's no usable session. Scrollback references the mapping */
+	static GPtrArray *read(const char *path, guint32 *current) {
+		GMappedFile *mapped = g_mapped_file_new(path, false, NULL);
+		if (!mapped)
+			return NULL;
+
+		GBytes *bytes = g_mapped_file_get_bytes(mapped);
+		g_mapped_file_unref(mapped);
+
+		gsize size;
+		const guint8 *data = (const guint8 *)g_bytes_get_data(bytes, &size);
+		const session_file_header_t *header = (const session_file_header_t *)data;
+		if (size < sizeof(*header) || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != FORMAT_VERSION ||
+				(size - sizeof(*header)) / sizeof(session_file_tab_t) < header->tabs) {
+			g_bytes_unref(bytes);
+			return NULL;
+		}
+
+		GPtrArray *tabs = g_ptr_array_new_with_free_func((GDestroyNotify)session_tab_t::free);
+		const session_file_tab_t *records = (const session_file_tab_t *)(data + sizeof(*header));
+		for (guint32 i = 0; i < header->tabs; ++i) {
+			const session_file_tab_t *record = &records[i];
+			guint64 len = (guint64)record->cwd_len + record->label_len + record->scrollback_len;
+			if (record->data_offset > size || len > size - record->data_offset) {
+				g_ptr_array_unref(tabs);
+				g_bytes_unref(bytes);
+				return NULL;
+			}
+
+			const char *at = (const char *)data + record->data_offset;
+			session_tab_t *tab = g_new0(session_tab_t, 1);
+			if (record->cwd_len)
+				tab->cwd = g_strndup(at, record->cwd_len);
+			if (record->label_len)
+				tab->label = g_strndup(at + record->cwd_len, record->label_len);
+			if (record->scrollback_len)
+				tab->scrollback =
+						g_bytes_new_from_bytes(bytes, record->data_offset + record->cwd_len + record->label_len, record->scrollback_len);
+			tab->colorset = record->colorset;
+			tab->flags = record->flags | session_tab_t::FROM_SESSION;
+			tab->held_id = record->held_id;
+			g_ptr_array_add(tabs, tab);
+		}
+
+		*current = MIN(header->current, header->tabs ? header->tabs - 1 : 0);
+		g_bytes_unref(bytes);
+		return tabs;
+	}
+};
@@ -0,0 +1,258 @@
+#pragma once
+#include <gio/gio.h>
+#include <glib.h>
+
+#include <atomic>
+#include <string.h>
+#include <time.h>
+
+/* Single producer, single consumer byte ring. The producer (main thread) never waits: a chunk
+ * that doesn't fit is dropped whole and counted. Capacity must be a power of two. */
+struct spsc_ring_t {
+	guint8 *data;
+	gsize capacity;
+	std::atomic<gsize> head; /* Total bytes pushed, only written by the producer */
+	std::atomic<gsize> tail; /* Total bytes popped, only written by the consumer */
+	std::atomic<guint64> dropped;
+
+	explicit spsc_ring_t(gsize size) : data((guint8 *)g_malloc(size)), capacity(size), head(0), tail(0), dropped(0) {}
+	~spsc_ring_t() {
+		g_free(data);
+	}
+
+	bool push(const char *buf, gsize len) {
+		gsize h = head.load(std::memory_order_relaxed);
+		gsize t = tail.load(std::memory_order_acquire);
+		if (capacity - (h - t) < len) {
+			dropped.fetch_add(len, std::memory_order_relaxed);
+			return false;
+		}
+		gsize at = h & (capacity - 1);
+		gsize first = MIN(len, capacity - at);
+		memcpy(data + at, buf, first);
+		memcpy(data, buf + first, len - first);
+		head.store(h + len, std::memory_order_release);
+		return true;
+	}
+
+	gsize pop(guint8 *buf, gsize len) {
+		gsize t = tail.load(std::memory_order_relaxed);
+		gsize h = head.load(std::memory_order_acquire);
+		len = MIN(len, h - t);
+		gsize at = t & (capacity - 1);
+		gsize first = MIN(len, capacity - at);
+		memcpy(buf, data + at, first);
+		memcpy(buf + first, data, len - first);
+		tail.store(t + len, std::memory_order_release);
+		return len;
+	}
+};
+
+/* Everything a tab prints, written to rotating and optionally gzipped files by a writer thread
+ * of its own. The main thread only pushes into the ring, and takes the lock just to wake the
+ * writer when it sleeps on an empty ring. Stopping hands the object over to the thread, which
+ * drains what's left, closes the file and frees it. */
+struct session_log_t {
+	static constexpr gsize WRITE_CHUNK = 64 * 1024;
+	/* A log that can't be opened or written is tried again after this long, its output is dropped meanwhile */
+	static constexpr gint64 RETRY_US = 60 * G_USEC_PER_SEC;
+
+	spsc_ring_t ring;
+	gchar *base_path; /* Files are base_path-YYYYmmdd-HHMMSS.log[.gz] */
+	bool compress;
+	gsize max_size;				/* Rotate after this many bytes of output, 0 for never */
+	gint64 max_age_us;		/* Rotate after this long, 0 for never */
+	std::atomic<bool> stopping;
+	std::atomic<guint64> written;
+	std::atomic<bool> failing; /* The file can't be opened or written, warned about once */
+	std::atomic<bool> sleeping; /* The writer is waiting on wake, or about to */
+	GMutex lock;
+	GCond wake;
+
+	/* Writer thread state */
+	GOutputStream *out;
+	gsize file_size;
+	gint64 file_opened_us;
+	gint64 retry_us; /* No new file before this while failing */
+	guint64 dropped_reported;
+
+	static std::atomic<int> &writers() {
+		static std::atomic<int> count(0);
+		return count;
+	}
+
+	session_log_t(const gchar *base, bool gzip, gsize ring_size, gsize rotate_size, gint64 rotate_us)
+			: ring(ring_size), base_path(g_strdup(base)), compress(gzip), max_size(rotate_size), max_age_us(rotate_us),
+				stopping(false), written(0), failing(false), sleeping(false), out(NULL), file_size(0), file_opened_us(0),
+				retry_us(0), dropped_reported(0) {
+		g_mutex_init(&lock);
+		g_cond_init(&wake);
+	}
+	~session_log_t() {
+		g_mutex_clear(&lock);
+		g_cond_clear(&wake);
+		g_free(base_path);
+	}
+
+	static session_log_t *start(const gchar *base, bool gzip, gsize ring_size, gsize rotate_size, gint64 rotate_us) {
+		session_log_t *log = new session_log_t(base, gzip, ring_size, rotate_size, rotate_us);
+		writers()++;
+		g_thread_unref(g_thread_new("ume-log", thread_main, log));
+		return log;
+	}
+
+	/* The caller must not touch log afterwards */
+	static void stop(session_log_t *log) {
+		g_mutex_lock(&log->lock);
+		log->stopping.store(true, std::memory_order_release);
+		g_cond_signal(&log->wake);
+		g_mutex_unlock(&log->lock);
+	}
+
+	/* Main thread. Output that doesn't fit in the ring is dropped, see spsc_ring_t */
+	void push(const char *buf, gsize len) {
+		ring.push(buf, len);
+		/* Pairs with the fence in wait(): either the writer sees the data or we see it sleeping */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed)) {
+			g_mutex_lock(&lock);
+			g_cond_signal(&wake);
+			g_mutex_unlock(&lock);
+		}
+	}
+
+	bool empty() {
+		return ring.head.load(std::memory_order_acquire) == ring.tail.load(std::memory_order_relaxed);
+	}
+
+	/* Writer thread. Sleeps until there's output or a stop, or until the file is due to rotate */
+	void wait() {
+		g_mutex_lock(&lock);
+		sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (empty() && !stopping.load(std::memory_order_acquire)) {
+			if (max_age_us && out) {
+				if (!g_cond_wait_until(&wake, &lock, file_opened_us + max_age_us))
+					break;
+			} else {
+				g_cond_wait(&wake, &lock);
+			}
+		}
+		sleeping.store(false, std::memory_order_relaxed);
+		g_mutex_unlock(&lock);
+	}
+
+	void open_file() {
+		GError *error = NULL;
+		gchar stamp[32];
+		time_t now = time(NULL);
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+		gchar *path = g_strdup_printf("%s-%s.log%s", base_path, stamp, compress ? ".gz" : "");
+		GFile *file = g_file_new_for_path(path);
+		GFileOutputStream *file_out = g_file_append_to(file, G_FILE_CREATE_PRIVATE, NULL, &error);
+		g_object_unref(file);
+
+		if (!file_out) {
+			gchar *message = g_strdup_printf("Cannot open log %s: %s", path, error->message);
+			fail(message);
+			g_free(message);
+			g_error_free(error);
+		} else if (compress) {
+			GZlibCompressor *compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+			out = g_converter_output_stream_new(G_OUTPUT_STREAM(file_out), G_CONVERTER(compressor));
+			g_object_unref(compressor);
+			g_object_unref(file_out);
+		} else {
+			out = G_OUTPUT_STREAM(file_out);
+		}
+		g_free(path);
+
+		file_size = 0;
+		file_opened_us = g_get_monotonic_time();
+		if (out)
+			failing.store(false, std::memory_order_relaxed);
+	}
+
+	/* Warns on the first failure only, and holds off the next attempt */
+	void fail(const gchar *message) {
+		if (!failing.exchange(true, std::memory_order_relaxed))
+			g_warning("%s", message);
+		retry_us = g_get_monotonic_time() + RETRY_US;
+	}
+
+	void close_file() {
+		if (out) {
+			g_output_stream_close(out, NULL, NULL);
+			g_object_unref(out);
+			out = NULL;
+		}
+	}
+
+	void write(const void *buf, gsize len) {
+		if (!out && g_get_monotonic_time() >= retry_us)
+			open_file();
+		/* A failing log keeps draining the ring, the tab must not notice */
+		if (!out)
+			return;
+		GError *error = NULL;
+		if (!g_output_stream_write_all(out, buf, len, NULL, NULL, &error)) {
+			gchar *message = g_strdup_printf("Cannot write log %s, closing it: %s", base_path, error->message);
+			fail(message);
+			g_free(message);
+			g_error_free(error);
+			close_file();
+			return;
+		}
+		file_size += len;
+		written.fetch_add(len, std::memory_order_relaxed);
+	}
+
+	void maybe_rotate() {
+		bool too_big = max_size && file_size >= max_size;
+		bool too_old = max_age_us && out && g_get_monotonic_time() - file_opened_us >= max_age_us;
+		if (too_big || too_old)
+			close_file();
+	}
+
+	void report_dropped() {
+		guint64 dropped = ring.dropped.load(std::memory_order_relaxed);
+		if (dropped != dropped_reported) {
+			gchar *note = g_strdup_printf("\r\n[ume: %" G_GUINT64_FORMAT " bytes of output not logged, the log fell behind]\r\n",
+																		dropped - dropped_reported);
+			write(note, strlen(note));
+			g_free(note);
+			dropped_reported = dropped;
+		}
+	}
+
+	static gpointer thread_main(gpointer data) {
+		session_log_t *log = (session_log_t *)data;
+		guint8 *buf = (guint8 *)g_malloc(WRITE_CHUNK);
+
+		for (;;) {
+			/* Read the flag first, so nothing pushed before stop() can be missed */
+			bool stopping = log->stopping.load(std::memory_order_acquire);
+			gsize len = log->ring.pop(buf, WRITE_CHUNK);
+
+			log->report_dropped();
+			if (len > 0) {
+				log->write(buf, len);
+			} else if (stopping) {
+				break;
+			} else {
+				log->wait();
+			}
+			log->maybe_rotate();
+		}
+
+		log->close_file();
+		g_free(buf);
+		/* stop() may still hold the lock it set the flag under */
+		g_mutex_lock(&log->lock);
+		g_mutex_unlock(&log->lock);
+		delete log;
+		writers()--;
+		return NULL;
+	}
+};
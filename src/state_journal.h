@@ -0,0 +1,73 @@
+#pragma once
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Runtime state (colorset, zoom) kept out of the user's config file. A change is one "key value\n"
+ * record appended with a single write, later records win. Instances share the file and O_APPEND
+ * keeps their records whole. Past COMPACT_SIZE it is replaced by the latest value of each key; a
+ * record another instance appends during that can be lost, which is fine for state like this. */
+struct state_journal_t {
+	static constexpr gsize COMPACT_SIZE = 4096;
+
+	/* Latest value of each key, NULL without a journal. A torn last record is skipped */
+	static GHashTable *read(const char *path) {
+		gchar *contents;
+		gsize len;
+		if (!g_file_get_contents(path, &contents, &len, NULL))
+			return NULL;
+
+		GHashTable *state = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		gchar *line = contents;
+		for (gchar *end; (end = (gchar *)memchr(line, '\n', contents + len - line)); line = end + 1) {
+			*end = '\0';
+			gchar *space = strchr(line, ' ');
+			if (!space || space == line)
+				continue;
+			g_hash_table_replace(state, g_strndup(line, space - line), g_strdup(space + 1));
+		}
+		g_free(contents);
+		return state;
+	}
+
+	static void compact(const char *path) {
+		GHashTable *state = read(path);
+		if (!state)
+			return;
+
+		GString *out = g_string_new(NULL);
+		GHashTableIter iter;
+		gpointer key, value;
+		g_hash_table_iter_init(&iter, state);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			g_string_append_printf(out, "%s %s\n", (const char *)key, (const char *)value);
+		g_file_set_contents_full(path, out->str, out->len, G_FILE_SET_CONTENTS_CONSISTENT, 0600, NULL);
+		g_string_free(out, true);
+		g_hash_table_unref(state);
+	}
+
+	static bool append(const char *path, const char *key, const char *value) {
+		gchar *record = g_strdup_printf("%s %s\n", key, value);
+		gsize len = strlen(record);
+		bool ok = false;
+		struct stat st;
+
+		int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+		if (fd >= 0) {
+			ok = write(fd, record, len) == (gssize)len;
+			if (ok && fstat(fd, &st) == 0 && (gsize)st.st_size > COMPACT_SIZE) {
+				close(fd);
+				fd = -1;
+				compact(path);
+			}
+			if (fd >= 0)
+				close(fd);
+		}
+		g_free(record);
+		return ok;
+	}
+};
@@ -0,0 +1,168 @@
+#pragma once
+#include <glib.h>
+
+#include <array>
+#include <math.h>
+
+/* HDR style latency histogram in microseconds. Values below SUB_BUCKETS get a bucket each,
+ * above that every power of two is split in SUB_BUCKETS linear sub buckets, so any recorded
+ * value is off by at most 1/SUB_BUCKETS (12.5%) while the whole table is 264 counters, 2112 bytes. */
+struct latency_histogram_t {
+	static constexpr int SUB_BUCKET_BITS = 3;
+	static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static constexpr int MAGNITUDES = 32; /* Last magnitude starts at ~2^34us, about 4.7 hours */
+	static constexpr int NUM_BUCKETS = SUB_BUCKETS + MAGNITUDES * SUB_BUCKETS;
+	std::array<guint64, NUM_BUCKETS> buckets;
+	guint64 count;
+	gint64 total_us;
+	gint64 max_us;
+
+	static int bucket_of(gint64 us) {
+		if (us < SUB_BUCKETS)
+			return us < 0 ? 0 : (int)us;
+		int magnitude = 63 - __builtin_clzll((guint64)us) - SUB_BUCKET_BITS;
+		if (magnitude >= MAGNITUDES)
+			return NUM_BUCKETS - 1;
+		int sub = (int)(us >> magnitude) - SUB_BUCKETS;
+		return SUB_BUCKETS + magnitude * SUB_BUCKETS + sub;
+	}
+
+	/* Smallest value that lands in the bucket after this one */
+	static gint64 bucket_end(int bucket) {
+		if (bucket < SUB_BUCKETS)
+			return bucket + 1;
+		int magnitude = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+		int sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+		return (gint64)(SUB_BUCKETS + sub + 1) << magnitude;
+	}
+
+	void record(gint64 us) {
+		if (us < 0)
+			us = 0;
+		++buckets[bucket_of(us)];
+		++count;
+		total_us += us;
+		if (us > max_us)
+			max_us = us;
+	}
+
+	/* Upper bound of the bucket holding the p-th percentile (0 < p <= 1) */
+	gint64 percentile(double p) const {
+		if (count == 0)
+			return 0;
+		guint64 wanted = (guint64)ceil(p * count);
+		guint64 seen = 0;
+		for (int i = 0; i < NUM_BUCKETS; ++i) {
+			seen += buckets[i];
+			if (seen >= wanted)
+				return MIN(bucket_end(i), max_us);
+		}
+		return max_us;
+	}
+
+	gint64 mean() const {
+		return count ? total_us / (gint64)count : 0;
+	}
+};
+
+/* Exponentially decaying event counter, cheap enough to bump on every PTY read */
+struct decaying_rate_t {
+	static constexpr double TAU_SECONDS = 5.0;
+	double value;
+	gint64 last_us;
+
+	double decayed(gint64 now_us) const {
+		if (last_us == 0)
+			return 0;
+		return value * exp(-(double)(now_us - last_us) / (TAU_SECONDS * G_USEC_PER_SEC));
+	}
+
+	void add(double amount, gint64 now_us) {
+		value = decayed(now_us) + amount;
+		last_us = now_us;
+	}
+
+	/* Events per second over roughly the last TAU_SECONDS */
+	double per_second(gint64 now_us) const {
+		return decayed(now_us) / TAU_SECONDS;
+	}
+};
+
+/* Measures the lifetime of a scope into a histogram */
+struct latency_scope_t {
+	latency_histogram_t &histogram;
+	gint64 start_us;
+
+	explicit latency_scope_t(latency_histogram_t &h) : histogram(h), start_us(g_get_monotonic_time()) {}
+	~latency_scope_t() {
+		histogram.record(g_get_monotonic_time() - start_us);
+	}
+};
+
+/* Per tab counters. Lives inside the g_new0'd struct terminal, so it must stay valid when zero filled */
+struct term_stats_t {
+	guint64 bytes_read;
+	guint64 bytes_written;
+	decaying_rate_t output_rate;
+	decaying_rate_t title_rate;
+	guint title_changes;
+	guint bells;
+	gint64 created_us;
+	gint64 last_output_us;
+};
+
+/* Main loop stall accounting. Handlers worth blaming are wrapped in a handler_scope_t, which
+ * keeps the innermost running label in current and the slowest finished one per iteration. */
+struct stall_event_t {
+	gint64 at_us;
+	gint64 duration_us;
+	const char *handler; /* Always a string literal */
+};
+
+struct stall_tracker_t {
+	static constexpr int LOG_SIZE = 32;
+	const char *current;
+	const char *slowest;
+	gint64 slowest_us;
+	guint64 count;
+	latency_histogram_t durations;
+	std::array<stall_event_t, LOG_SIZE> log;
+	guint log_next;
+
+	void handler_done(const char *label, gint64 us) {
+		if (us > slowest_us) {
+			slowest = label;
+			slowest_us = us;
+		}
+	}
+
+	/* Called once per main loop iteration with the time it spent dispatching */
+	void iteration_done(gint64 now_us, gint64 us, gint64 threshold_us) {
+		if (us >= threshold_us) {
+			/* Blame the slowest handler that finished, else whatever is still running
+			 * around us (a nested loop inside gtk_dialog_run for instance) */
+			const char *handler = slowest ? slowest : current ? current : "unknown";
+			log[log_next++ % LOG_SIZE] = {now_us, us, handler};
+			durations.record(us);
+			++count;
+		}
+		slowest = NULL;
+		slowest_us = 0;
+	}
+};
+
+struct handler_scope_t {
+	stall_tracker_t &tracker;
+	const char *label;
+	const char *previous;
+	gint64 start_us;
+
+	handler_scope_t(stall_tracker_t &t, const char *l)
+			: tracker(t), label(l), previous(t.current), start_us(g_get_monotonic_time()) {
+		tracker.current = label;
+	}
+	~handler_scope_t() {
+		tracker.current = previous;
+		tracker.handler_done(label, g_get_monotonic_time() - start_us);
+	}
+};
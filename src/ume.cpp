@@ -17,9 +17,11 @@
  *
  *****************************************************************************/
 
+#include <errno.h>
 #include <fcntl.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
+#include <glib-unix.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
@@ -33,8 +35,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <vte/vte.h>
@@ -45,7 +49,13 @@
 #include <string>
 
 #include "config.h"
+#include "config_cache.h"
 #include "defaults.h"
+#include "holder.h"
+#include "session_file.h"
+#include "session_log.h"
+#include "state_journal.h"
+#include "stats.h"
 
 #define _(String) gettext(String)
 #define N_(String) (String)
@@ -67,24 +77,6 @@ template <class... Args> inline void say_impl(size_t line, const char *caller, c
 
 #define SAY(format, ...) say_impl(__LINE__, __FUNCTION__, format, ##__VA_ARGS__)
 
-#define HIG_DIALOG_CSS                                                                                                 \
-	"* {\n"                                                                                                              \
-	"-GtkDialog-action-area-border : 12;\n"                                                                              \
-	"-GtkDialog-button-spacing : 12;\n"                                                                                  \
-	"}"
-
-#define NOTEBOOK_CSS                                                                                                   \
-	"* {\n"                                                                                                              \
-	"color : rgba(0,0,0,1.0);\n"                                                                                         \
-	"background-color : rgba(0,0,0,1.0);\n"                                                                              \
-	"border-color : rgba(0,0,0,1.0);\n"                                                                                  \
-	"}"
-
-#define TAB_TITLE_CSS                                                                                                  \
-	"* {\n"                                                                                                              \
-	"padding : 0px;\n"                                                                                                   \
-	"}"
-
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
@@ -102,6 +94,20 @@ struct g_object_unref_deleter {
 };
 template <class T> using unique_g_object_ptr = std::unique_ptr<T, g_object_unref_deleter>;
 
+/* One rule of the [matches] group */
+struct match_rule_t {
+	gchar *name;
+	gchar *action; /* open, mail, copy or a command line */
+	GRegex *regex; /* The rule on its own, tells which rule a match under the pointer came from */
+
+	static void free(match_rule_t *rule) {
+		g_free(rule->name);
+		g_free(rule->action);
+		g_regex_unref(rule->regex);
+		g_free(rule);
+	}
+};
+
 static struct {
 	GtkWidget *main_window;
 	GtkWidget *notebook;
@@ -111,8 +117,19 @@ static struct {
 	GtkWidget *item_open_link;
 	GtkWidget *item_open_mail;
 	GtkWidget *open_link_separator;
+	GtkWidget *item_cancel_paste;
+	GtkWidget *item_log_output; /* Reflects the current tab */
+	GtkWidget *item_fast_render; /* Same */
+
+	/* Dialogs, built on first use and only hidden afterwards */
+	GtkWidget *font_dialog;
+	GtkWidget *color_dialog;
+	GtkWidget *name_dialog;
+	GtkWidget *search_dialog;
+	GtkWidget *title_dialog;
 
 	char *current_match;
+	const match_rule_t *current_rule; /* Rule of current_match, NULL if none matches it alone */
 	char *configfile;
 
 	bool fullscreen;
@@ -123,6 +140,9 @@ static struct {
 	bool config_modified;			/* Configuration has been modified */
 	bool externally_modified; /* Configuration file has been modified by another process */
 	bool resized;
+	bool accessible; /* Terminals give assistive technologies their real accessible, see UmeVte */
+	gint configured_width, configured_height; /* Window size of the last configure event */
+	guint resize_settle;											/* Running while the window is being resized */
 
 	GKeyFile *cfg_file;
 
@@ -140,8 +160,86 @@ static struct {
 
 	const GdkRGBA *palette;
 	char *argv[3];
+	struct terminal *early_term; /* First tab, its shell started before the window. See ume_spawn_early */
+
+	/* Control socket */
+	int ctl_fd;
+	gchar *ctl_path;
+
+	/* --dropdown: the window is only ever hidden, `ume --dropdown` toggles it through this socket */
+	struct {
+		int fd;
+		gchar *path;
+		gint64 shown_us; /* Shown and waiting for its first frame, 0 otherwise */
+	} dropdown;
+
+	/* Session checkpoints */
+	guint session_timer;
+	bool session_saving; /* A periodic checkpoint is still reading or writing */
+	bool session_saved;	 /* The exit checkpoint is done, closing the remaining tabs must not overwrite it */
+	bool detaching;			 /* Closing the window, persistent tabs are detached rather than ended */
+	bool destroyed;			 /* ume_destroy ran, it only does so once */
+
+	/* tmux control mode, see ume_tmux_start */
+	struct {
+		bool active;
+		GPid pid;
+		int in_fd, out_fd; /* stdin and stdout of tmux */
+		guint read_watch, write_watch;
+		GByteArray *outgoing; /* Commands tmux didn't take yet */
+		GString *line;				/* Partial line of output */
+		GString *reply;				/* Output of the command being answered, NULL outside %begin/%end */
+		gchar *guard;					/* Arguments of that %begin, repeated by the %end closing it */
+		GQueue *pending;			/* tmux_pending_t of the commands sent, oldest first */
+		GHashTable *panes;		/* Pane id to the tab showing it */
+		gint select_window;		/* Window opened from ume, shown as soon as its tab exists */
+		glong rows, columns;	/* Client size last sent */
+		bool shown;						/* Some window got a tab */
+	} tmux;
+
+	struct {
+		gint64 started_us;
+		guint config_reloads;
+		latency_histogram_t main_loop;			 /* Busy time of each main loop iteration */
+		latency_histogram_t frames;					 /* Time from frame start to the end of painting */
+		latency_histogram_t frame_intervals; /* Time between consecutive frames while animating */
+		latency_histogram_t key_dispatch;		 /* Time spent matching ume keybinds */
+		latency_histogram_t config_load;		 /* Loading the config file, at startup and on reloads */
+		latency_histogram_t summons;				 /* Showing the --dropdown window until its first frame */
+		latency_histogram_t hover;					 /* Terminal motion events, matching the rules under the pointer */
+		bool config_cached;									 /* The last load came from the config cache */
+		/* Startup milestones, microseconds after main() began. 0 until reached */
+		gint64 config_ready_us, shell_spawned_us, first_output_us, first_frame_us;
+		gint64 last_frame_us;
+		guint64 frames_missed;
+		stall_tracker_t stalls;
+	} stats;
+
+	/* The [matches] rules joined into one regex, which every tab shares. See ume_matches_compile */
+	struct {
+		GPtrArray *rules; /* match_rule_t */
+		VteRegex *regex;	/* NULL without usable rules */
+	} matches;
 } ume;
 
+/* A command as reported by the shell with OSC 133. Rows are absolute VTE rows, they're placed once
+ * VTE has caught up with the output holding the mark (see ume_term_place_marks) */
+enum { MARK_PROMPT, MARK_COMMAND, MARK_OUTPUT, MARK_END, NUM_MARKS };
+struct command_mark_t {
+	glong rows[NUM_MARKS];
+	guint64 newlines[NUM_MARKS]; /* Newlines in the output before each mark */
+	guint8 seen, placed;				 /* Bit per mark */
+	gint64 started_us, finished_us;
+	gint exit_status; /* -1 when the shell didn't say */
+};
+
+/* A command sent to tmux, waiting for its reply. ok is false for %error */
+typedef void (*tmux_reply_func_t)(const gchar *reply, bool ok, gpointer data);
+struct tmux_pending_t {
+	tmux_reply_func_t func; /* NULL when the reply doesn't matter */
+	gpointer data;
+};
+
 struct terminal {
 	GtkWidget *hbox;
 	GtkWidget *vte; /* Reference to VTE terminal */
@@ -150,14 +248,66 @@ struct terminal {
 	GtkWidget *label;
 	gchar *label_text;
 	bool label_set_byuser;
+	gchar *cwd; /* Local directory last reported by the shell with OSC 7, NULL if it never did */
 	GtkBorder padding; /* inner-property data */
 	int colorset;
+	gdouble font_scale; /* Zoom of this tab, applied with vte_terminal_set_font_scale */
+
+	/* ume owns the PTY, VTE is only fed what is read from it */
+	VtePty *pty;
+	int pty_fd;
+	int read_fd; /* Output comes from here: pty_fd, or the holder connection of a persistent tab */
+	guint32 held_id; /* Holder session of a persistent tab */
+	struct holder_open_t *holder_open; /* Spawn or attach the holder didn't answer yet */
+	bool pty_eof;
+	GCancellable *spawn_cancellable;
+	guint pty_watch;		 /* Reads the master side */
+	guint write_watch;	 /* Flushes outgoing when the master is writable again */
+	guint throttle_id;	 /* Restarts reading after VTE fell behind */
+	bool pacing;				 /* throttle_id is the fast_render_interval, VTE's progress doesn't end it */
+	bool fast_render;		 /* Throughput over fidelity, see ume_term_apply_render */
+	guint child_watch;	 /* Reaps the child */
+	gsize fed_pending;	 /* Bytes fed to VTE since it last reported progress */
+	GByteArray *outgoing; /* Input not yet written to the PTY */
+	glong pty_rows, pty_columns;
+
+	/* Streaming paste, see ume_term_paste_pump */
+	GByteArray *paste;					/* Filtered clipboard text with its brackets, NULL when not pasting */
+	gsize paste_offset;					/* Bytes of paste already handed to the PTY */
+	gint64 paste_progress_us;		/* Last progress update */
+	GByteArray *held_input;			/* Keyboard input typed while pasting, sent afterwards */
+	GtkWidget *paste_progress;	/* Percentage shown on the tab */
+	bool paste_bracketed;				/* Child enabled bracketed paste (DECSET 2004) */
+
+	/* Escape sequences ume follows in the output, see ume_term_scan_output */
+	guint8 scan_state;
+	guint8 scan_len;
+	char scan_seq[SCAN_SEQ_MAX];
+	guint64 newlines;
+
+	/* Shell integration */
+	GArray *commands; /* command_mark_t, oldest first. NULL until the shell sends a mark */
+	gint nav_index;		/* Command last jumped to, and the scroll position it left */
+	gdouble nav_value;
+
+	bool has_mark;
+	glong mark_row; /* Set with "Set mark", exports can start there */
+
+	session_log_t *log; /* Output logging, NULL when off */
+
+	/* Sessions. A restored tab starts its shell and gets its saved scrollback back on first view */
+	bool spawn_pending;
+	GBytes *session_scrollback; /* Last saved scrollback, gzipped. Reused while no output came since */
+	guint64 session_bytes_read; /* bytes_read when it was taken */
+
+	/* tmux control mode: window and active pane shown by the tab, -1 for ordinary tabs */
+	gint tmux_window, tmux_pane;
+	bool tmux_live;				/* Captured on first view, %output is fed from then on */
+	gchar *tmux_capture;	/* Captured pane waiting for the cursor position */
+
+	term_stats_t stats;
 };
 
-/* make this an array instead of #defines to get a compile time
- * error instead of a runtime if NUM_COLORSETS changes */
-static int cs_keys[NUM_COLORSETS] = {GDK_KEY_F1, GDK_KEY_F2, GDK_KEY_F3, GDK_KEY_F4, GDK_KEY_F5, GDK_KEY_F6};
-
 static constexpr unsigned ERROR_BUFFER_LENGTH = 256;
 const char cfg_group[] = "ume";
 
@@ -171,64 +321,242 @@ static inline struct terminal *ume_get_page_term(decltype(ume) &term, int page_i
 	return (struct terminal *)g_object_get_qdata(obj, term_data_id);
 }
 
+static void ume_term_free(struct terminal *term);
 #define ume_set_page_term(ume, page_idx, term)                                                                         \
 	g_object_set_qdata_full(G_OBJECT(gtk_notebook_get_nth_page((GtkNotebook *)ume.notebook, page_idx)), term_data_id,    \
-													term, (GDestroyNotify)g_free);
+													term, (GDestroyNotify)ume_term_free);
+static GKeyFile *ume_config_keyfile();
+
 // Config setters
 template <class T> inline void ume_set_config(const gchar *group, const gchar *key, T value);
 template <> inline void ume_set_config<gint>(const gchar *group, const gchar *key, gint value) {
-	g_key_file_set_integer(ume.cfg_file, group, key, value);
+	g_key_file_set_integer(ume_config_keyfile(), group, key, value);
 	ume.config_modified = true;
 }
 template <> inline void ume_set_config<guint>(const gchar *group, const gchar *key, guint value) {
-	g_key_file_set_integer(ume.cfg_file, group, key, value);
+	g_key_file_set_integer(ume_config_keyfile(), group, key, value);
 	ume.config_modified = true;
 }
 template <> inline void ume_set_config<const gchar *>(const gchar *group, const gchar *key, const gchar *value) {
-	g_key_file_set_string(ume.cfg_file, group, key, value);
+	g_key_file_set_string(ume_config_keyfile(), group, key, value);
 	ume.config_modified = true;
 }
 template <> inline void ume_set_config<bool>(const char *group, const char *key, bool value) {
-	g_key_file_set_boolean(ume.cfg_file, group, key, value);
+	g_key_file_set_boolean(ume_config_keyfile(), group, key, value);
 	ume.config_modified = true;
 }
 
-// Config getters
-template <class T> inline T ume_config_get(const gchar *group, const gchar *key) {
-	return g_key_file_get_value(ume.cfg_file, group, key, nullptr);
+// Config schema, see CONFIG_SCHEMA
+static GHashTable *ume_config_index() {
+	static GHashTable *index = NULL;
+	if (!index) {
+		index = g_hash_table_new(g_str_hash, g_str_equal);
+		for (const config_entry_t &entry : CONFIG_SCHEMA)
+			g_hash_table_insert(index, (gpointer)entry.key, (gpointer)&entry);
+	}
+	return index;
+}
+
+static const char *ume_cursor_name(VteCursorShape shape) {
+	switch (shape) {
+	case VTE_CURSOR_SHAPE_UNDERLINE:
+		return "underline";
+	case VTE_CURSOR_SHAPE_IBEAM:
+		return "ibeam";
+	default:
+		return "block";
+	}
+}
+
+static VteCursorShape ume_cursor_from_name(const char *name) {
+	if (g_strcmp0(name, "underline") == 0)
+		return VTE_CURSOR_SHAPE_UNDERLINE;
+	if (g_strcmp0(name, "ibeam") == 0)
+		return VTE_CURSOR_SHAPE_IBEAM;
+	return VTE_CURSOR_SHAPE_BLOCK;
+}
+
+/* Key names, or the integer keyvals of older config files. Empty is unbound */
+static guint ume_keybind_from_string(const gchar *value) {
+	if (value[0] == '\0')
+		return GDK_KEY_VoidSymbol;
+	guint keyval = gdk_keyval_from_name(value);
+	if (keyval == GDK_KEY_VoidSymbol || keyval == 0)
+		keyval = (guint)g_ascii_strtoull(value, NULL, 10);
+
+	/* Always use uppercase value as keyval */
+	return gdk_keyval_to_upper(keyval);
 }
-template <> inline gint ume_config_get<gint>(const gchar *group, const gchar *key) {
-	return g_key_file_get_integer(ume.cfg_file, group, key, nullptr);
+
+static void ume_config_set_default(const config_entry_t &entry, config_t &config) {
+	switch (entry.type) {
+	case config_type_t::INT:
+		config.*entry.member.integer = entry.int_default;
+		break;
+	case config_type_t::BOOL:
+	case config_type_t::YES_NO:
+		config.*entry.member.boolean = entry.int_default != 0;
+		break;
+	case config_type_t::STRING:
+		config.*entry.member.string = g_strdup(entry.string_default);
+		break;
+	case config_type_t::MODIFIER:
+		config.*entry.member.uinteger = entry.int_default;
+		break;
+	case config_type_t::KEY:
+		config_keyval(entry, config) = entry.int_default;
+		break;
+	case config_type_t::FONT:
+		config.*entry.member.font = pango_font_description_from_string(entry.string_default);
+		break;
+	case config_type_t::CURSOR:
+		config.*entry.member.cursor = (VteCursorShape)entry.int_default;
+		break;
+	}
 }
-template <> inline guint ume_config_get<guint>(const gchar *group, const gchar *key) {
-	return g_key_file_get_integer(ume.cfg_file, group, key, nullptr);
+
+/* Reads a key the file has into config, false if its value is unusable */
+static bool ume_config_read(const config_entry_t &entry, config_t &config) {
+	GError *error = NULL;
+
+	if (entry.type == config_type_t::INT || entry.type == config_type_t::MODIFIER) {
+		gint value = g_key_file_get_integer(ume.cfg_file, cfg_group, entry.key, &error);
+		if (error) {
+			g_error_free(error);
+			return false;
+		}
+		if (entry.type == config_type_t::INT)
+			config.*entry.member.integer = value;
+		else
+			config.*entry.member.uinteger = value;
+		return true;
+	}
+	if (entry.type == config_type_t::BOOL) {
+		gboolean value = g_key_file_get_boolean(ume.cfg_file, cfg_group, entry.key, &error);
+		if (error) {
+			g_error_free(error);
+			return false;
+		}
+		config.*entry.member.boolean = value;
+		return true;
+	}
+
+	gchar *value = g_key_file_get_string(ume.cfg_file, cfg_group, entry.key, NULL);
+	if (!value)
+		return false;
+	switch (entry.type) {
+	case config_type_t::YES_NO:
+		config.*entry.member.boolean = strcmp(value, "Yes") == 0;
+		break;
+	case config_type_t::STRING:
+		config.*entry.member.string = value;
+		return true; /* config owns it now */
+	case config_type_t::KEY:
+		config_keyval(entry, config) = ume_keybind_from_string(value);
+		break;
+	case config_type_t::FONT:
+		config.*entry.member.font = pango_font_description_from_string(value);
+		break;
+	case config_type_t::CURSOR:
+		config.*entry.member.cursor = ume_cursor_from_name(value);
+		break;
+	default:
+		break;
+	}
+	g_free(value);
+	return true;
 }
-template <> inline bool ume_config_get<bool>(const gchar *group, const gchar *key) {
-	return g_key_file_get_boolean(ume.cfg_file, group, key, nullptr);
+
+static void ume_config_write(const config_entry_t &entry, config_t &config) {
+	GKeyFile *file = ume_config_keyfile();
+
+	switch (entry.type) {
+	case config_type_t::INT:
+		g_key_file_set_integer(file, cfg_group, entry.key, config.*entry.member.integer);
+		break;
+	case config_type_t::BOOL:
+		g_key_file_set_boolean(file, cfg_group, entry.key, config.*entry.member.boolean);
+		break;
+	case config_type_t::YES_NO:
+		g_key_file_set_string(file, cfg_group, entry.key, config.*entry.member.boolean ? "Yes" : "No");
+		break;
+	case config_type_t::STRING:
+		/* Optional keys stay out of the file until set */
+		if (!(config.*entry.member.string))
+			return;
+		g_key_file_set_string(file, cfg_group, entry.key, config.*entry.member.string);
+		break;
+	case config_type_t::MODIFIER:
+		g_key_file_set_integer(file, cfg_group, entry.key, config.*entry.member.uinteger);
+		break;
+	case config_type_t::KEY: {
+		const gchar *name = gdk_keyval_name(config_keyval(entry, config));
+		g_key_file_set_string(file, cfg_group, entry.key, name ? name : "");
+		break;
+	}
+	case config_type_t::FONT: {
+		gchar *descriptor = pango_font_description_to_string(config.*entry.member.font);
+		g_key_file_set_string(file, cfg_group, entry.key, descriptor);
+		g_free(descriptor);
+		break;
+	}
+	case config_type_t::CURSOR:
+		g_key_file_set_string(file, cfg_group, entry.key, ume_cursor_name(config.*entry.member.cursor));
+		break;
+	}
+	ume.config_modified = true;
 }
-template <> inline gchar *ume_config_get<gchar *>(const gchar *group, const gchar *key) {
-	return g_key_file_get_string(ume.cfg_file, group, key, nullptr);
+
+static bool ume_config_equal(const config_entry_t &entry, config_t &a, config_t &b) {
+	switch (entry.type) {
+	case config_type_t::INT:
+		return a.*entry.member.integer == b.*entry.member.integer;
+	case config_type_t::BOOL:
+	case config_type_t::YES_NO:
+		return a.*entry.member.boolean == b.*entry.member.boolean;
+	case config_type_t::STRING:
+		return g_strcmp0(a.*entry.member.string, b.*entry.member.string) == 0;
+	case config_type_t::MODIFIER:
+		return a.*entry.member.uinteger == b.*entry.member.uinteger;
+	case config_type_t::KEY:
+		return config_keyval(entry, a) == config_keyval(entry, b);
+	case config_type_t::FONT:
+		return pango_font_description_equal(a.*entry.member.font, b.*entry.member.font);
+	case config_type_t::CURSOR:
+		return a.*entry.member.cursor == b.*entry.member.cursor;
+	}
+	return false;
 }
-template <> inline const gchar *ume_config_get<const gchar *>(const gchar *group, const gchar *key) {
-	return g_key_file_get_string(ume.cfg_file, group, key, nullptr);
+
+/* Frees what config owns for entry */
+static void ume_config_clear(const config_entry_t &entry, config_t &config) {
+	if (entry.type == config_type_t::STRING) {
+		g_free((gpointer)(config.*entry.member.string));
+		config.*entry.member.string = NULL;
+	} else if (entry.type == config_type_t::FONT && config.*entry.member.font) {
+		pango_font_description_free(config.*entry.member.font);
+		config.*entry.member.font = NULL;
+	}
 }
 
-template <class T> inline T ume_load_config_or(const gchar *group, const gchar *key, T default_value) {
-	if (!g_key_file_has_key(ume.cfg_file, group, key, NULL))
-		ume_set_config<T>(group, key, default_value);
-	return ume_config_get<T>(group, key);
+/* Writes the current value of a [ume] key to the file, for settings changed from the menus */
+static void ume_config_save(const char *key) {
+	const config_entry_t *entry = (const config_entry_t *)g_hash_table_lookup(ume_config_index(), key);
+	g_assert(entry != NULL);
+	ume_config_write(*entry, ume.config);
 }
 
 /* Spawn callback */
-void ume_spawm_callback(VteTerminal *, GPid, GError, gpointer); // TODO spelling error?
+void ume_spawn_callback(GObject *, GAsyncResult *, gpointer);
 /* Callbacks */
 static gboolean ume_key_press(GtkWidget *, GdkEventKey *, gpointer);
 static gboolean ume_button_press(GtkWidget *, GdkEventButton *, gpointer);
 static void ume_beep(GtkWidget *, void *);
 static void ume_increase_font(GtkWidget *, void *);
 static void ume_decrease_font(GtkWidget *, void *);
+static void ume_reset_font(GtkWidget *, void *);
 static void ume_child_exited(GtkWidget *, void *);
-static void ume_eof(GtkWidget *, void *);
+static void ume_tab_exited(GtkWidget *);
 static void ume_title_changed(GtkWidget *, void *);
 static gboolean ume_delete_event(GtkWidget *, void *);
 static void ume_destroy_window(GtkWidget *, void *);
@@ -251,8 +579,17 @@ static void ume_new_tab(GtkWidget *, void *);
 static void ume_close_tab_callback(GtkWidget *, void *);
 static void ume_fullscreen(GtkWidget *, void *);
 static void ume_open_url(GtkWidget *, void *);
+static void ume_match_open(GtkWidget *, void *);
 static void ume_copy(GtkWidget *, void *);
 static void ume_paste(GtkWidget *, void *);
+static void ume_cancel_paste(GtkWidget *, void *);
+static void ume_copy_scrollback(GtkWidget *, void *);
+static void ume_copy_last_lines(GtkWidget *, void *);
+static void ume_copy_last_output(GtkWidget *, void *);
+static void ume_set_mark(GtkWidget *, void *);
+static void ume_save_scrollback_dialog(GtkWidget *, void *);
+static void ume_log_output(GtkWidget *, void *);
+static void ume_term_log_start(struct terminal *);
 static void ume_show_first_tab(GtkWidget *widget, void *data);
 static void ume_tabs_on_bottom(GtkWidget *widget, void *data);
 static void ume_less_questions(GtkWidget *widget, void *data);
@@ -264,21 +601,32 @@ static void ume_setname_entry_changed(GtkWidget *, void *);
 
 /* Misc */
 static void ume_error(const char *, ...);
+static gint ume_dialog_run(GtkWidget *, const char *);
 
 /* Functions */
 static void ume_init();
 static void ume_init_popup();
+static void ume_popup_refresh();
 static void ume_destroy();
-static void ume_add_tab();
+static struct terminal *ume_add_tab(const session_tab_t *restore = NULL);
+static void ume_page_switched(GtkNotebook *, GtkWidget *, guint, gpointer);
+static void ume_session_save(bool);
+static void ume_holder_spawn(struct terminal *, const char *, char **, char **, GSpawnFlags);
+static void ume_term_spawn_local(struct terminal *, const char *, char **, char **, GSpawnFlags);
+static void ume_term_start_local(struct terminal *);
+static gchar *ume_ctl_dir();
 static void ume_del_tab(gint);
 static void ume_move_tab(gint);
 static gint ume_find_tab(VteTerminal *);
 static void ume_set_font();
 static void ume_set_tab_label_text(const gchar *, gint page);
 static void ume_set_size(void);
-static void ume_set_keybind(const gchar *, guint);
-static guint ume_get_keybind(const gchar *);
-static guint ume_load_keybind_or(const gchar *, const gchar *, guint);
+static void ume_config_save(const char *);
+static void ume_state_set(const char *, gint);
+static void ume_config_apply(guint);
+static void ume_term_apply_config(struct terminal *);
+static void ume_term_set_fast_render(struct terminal *, bool);
+static bool ume_colorset_fast_render(int);
 static void ume_config_done(bool);
 static void ume_set_colorset(int);
 static void ume_set_colors(void);
@@ -286,6 +634,51 @@ static guint ume_tokeycode(guint key);
 static void ume_fade_in(void);
 static void ume_fade_out(void);
 static void ume_reload_config_file();
+static void ume_matches_compile();
+static const match_rule_t *ume_match_rule_of(const char *);
+static void ume_match_activate();
+static void ume_term_apply_render(struct terminal *);
+
+/* PTY handling */
+static void ume_term_spawn(struct terminal *, const char *, char **, char **, GSpawnFlags);
+static void ume_term_write(struct terminal *, const char *, gsize);
+static void ume_term_send(struct terminal *, const char *, gsize);
+static void ume_term_paste_pump(struct terminal *);
+static void ume_term_paste_cancel(struct terminal *);
+static GByteArray *ume_paste_prepare(const gchar *, bool);
+static void ume_term_scan_output(struct terminal *, const char *, gsize);
+static void ume_term_command_finished(struct terminal *, struct command_mark_t *);
+static void ume_term_jump_command(struct terminal *, int);
+static bool ume_term_last_output(struct terminal *, glong *, glong *);
+static void ume_term_copy_rows(struct terminal *, glong, glong);
+static void ume_term_sync_pty_size(struct terminal *);
+static void ume_term_materialize(struct terminal *);
+static struct terminal *ume_term_new();
+static void ume_term_set_colors(struct terminal *);
+static pid_t ume_term_foreground_pgid(struct terminal *);
+static gboolean ume_pty_readable(gint, GIOCondition, gpointer);
+static gboolean ume_pty_writable(gint, GIOCondition, gpointer);
+static void ume_term_commit(VteTerminal *, gchar *, guint, gpointer);
+static void ume_term_contents_changed(VteTerminal *, gpointer);
+static void ume_term_size_allocate(GtkWidget *, GdkRectangle *, gpointer);
+static void ume_child_watch(GPid, gint, gpointer);
+static void ume_term_output(struct terminal *, const char *, gsize);
+
+/* tmux control mode */
+static void ume_tmux_command(tmux_reply_func_t, gpointer, const char *, ...) G_GNUC_PRINTF(3, 4);
+static void ume_tmux_new_window();
+static void ume_tmux_close_window(struct terminal *);
+static void ume_tmux_capture(struct terminal *);
+static void ume_tmux_sync_size(struct terminal *);
+static void ume_tmux_send_keys(gint, const char *, gsize, tmux_reply_func_t = NULL);
+
+/* Control socket and stats */
+static void ume_ctl_init();
+static void ume_ctl_done();
+static void ume_dropdown_show();
+static int ume_ctl_client(const char *, gint);
+static void ume_stats_init();
+static void ume_stats_json(GString *);
 
 /* Globals for command line parameters */
 static const char *option_font;
@@ -303,8 +696,24 @@ static gboolean option_hold = false;
 static char *option_config_file;
 static gboolean option_fullscreen;
 static gboolean option_maximize;
+static gboolean option_log_output;
+static gboolean option_restore;
+static gboolean option_holder;
+static gboolean option_config_docs;
+static gboolean option_dropdown;
+static gboolean option_no_a11y;
+static const char *option_tmux;
 static gint option_colorset;
 static gint option_change_colorset = INT_MIN;
+static const char *option_ctl;
+static gint option_ctl_pid;
+
+static gboolean ume_option_tmux(const gchar *name, const gchar *value, gpointer data, GError **error) {
+	option_tmux = TMUX_DEFAULT_SESSION;
+	if (value)
+		option_tmux = g_strdup(value);
+	return true;
+}
 
 static GOptionEntry entries[] = { // Command line flags
 		{"version", 'v', 0, G_OPTION_ARG_NONE, &option_version, N_("Print version number"), NULL},
@@ -323,11 +732,25 @@ static GOptionEntry entries[] = { // Command line flags
 		{"rows", 'r', 0, G_OPTION_ARG_INT, &option_rows, N_("Set rows number"), NULL},
 		{"hold", 'h', 0, G_OPTION_ARG_NONE, &option_hold, N_("Hold window after execute command"), NULL},
 		{"maximize", 'm', 0, G_OPTION_ARG_NONE, &option_maximize, N_("Maximize window"), NULL},
+		{"log-output", 0, 0, G_OPTION_ARG_NONE, &option_log_output, N_("Log the output of every tab"), NULL},
+		{"restore", 0, 0, G_OPTION_ARG_NONE, &option_restore, N_("Restore the tabs of the last session"), NULL},
+		{"holder", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &option_holder, NULL, NULL},
+		{"config-docs", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &option_config_docs, NULL, NULL},
+		{"tmux", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, (gpointer)ume_option_tmux,
+		 N_("Show the windows of a tmux session (\"ume\" by default) as tabs"), N_("SESSION")},
 		{"fullscreen", 's', 0, G_OPTION_ARG_NONE, &option_fullscreen, N_("Fullscreen mode"), NULL},
+		{"no-accessibility", 0, 0, G_OPTION_ARG_NONE, &option_no_a11y,
+		 N_("Don't expose the terminals to assistive technologies"), NULL},
+		{"dropdown", 0, 0, G_OPTION_ARG_NONE, &option_dropdown,
+		 N_("Stay running with the window hidden, later runs with --dropdown show or hide it"), NULL},
 		{"config-file", 0, 0, G_OPTION_ARG_FILENAME, &option_config_file, N_("Use alternate configuration file"), NULL},
 		{"colorset", 0, 0, G_OPTION_ARG_INT, &option_colorset, N_("Select initial colorset"), NULL},
 		{"change-colorset", 0, 0, G_OPTION_ARG_INT, &option_change_colorset,
 		 N_("Change the colorset of all open ume instances"), NULL},
+		{"ctl", 0, 0, G_OPTION_ARG_STRING, &option_ctl, N_("Send a control command (e.g. \"stats\") to running ume instances"),
+		 NULL},
+		{"ctl-pid", 0, 0, G_OPTION_ARG_INT, &option_ctl_pid, N_("Only send the control command to the instance with this pid"),
+		 NULL},
 		{NULL}};
 
 static guint ume_tokeycode(guint key) {
@@ -374,6 +797,8 @@ static gboolean ume_key_press(GtkWidget *widget, GdkEventKey *event, gpointer us
 	if (event->type != GDK_KEY_PRESS)
 		return false;
 
+	latency_scope_t dispatch_timer(ume.stats.key_dispatch);
+	handler_scope_t scope(ume.stats.stalls, "ume_key_press");
 	gint topage = 0;
 	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
 
@@ -444,6 +869,15 @@ static gboolean ume_key_press(GtkWidget *widget, GdkEventKey *event, gpointer us
 		}
 	}
 
+	/* Escape stops a paste that is still streaming */
+	if (event->keyval == GDK_KEY_Escape) {
+		struct terminal *term = ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+		if (term->paste) {
+			ume_term_paste_cancel(term);
+			return true;
+		}
+	}
+
 	/* Copy/paste keybinding pressed */
 	if ((event->state & ume.config.copy_modifier) == ume.config.copy_modifier) {
 		if (keycode == ume_tokeycode(ume.config.copy_key)) {
@@ -452,6 +886,9 @@ static gboolean ume_key_press(GtkWidget *widget, GdkEventKey *event, gpointer us
 		} else if (keycode == ume_tokeycode(ume.config.paste_key)) {
 			ume_paste(NULL, NULL);
 			return true;
+		} else if (keycode == ume_tokeycode(ume.config.copy_output_key)) {
+			ume_copy_last_output(NULL, NULL);
+			return true;
 		}
 	}
 
@@ -487,6 +924,9 @@ static gboolean ume_key_press(GtkWidget *widget, GdkEventKey *event, gpointer us
 		} else if (keycode == ume_tokeycode(ume.config.decrease_font_size_key)) {
 			ume_decrease_font(NULL, NULL);
 			return true;
+		} else if (keycode == ume_tokeycode(ume.config.reset_font_size_key)) {
+			ume_reset_font(NULL, NULL);
+			return true;
 		}
 	}
 
@@ -496,6 +936,15 @@ static gboolean ume_key_press(GtkWidget *widget, GdkEventKey *event, gpointer us
 		struct terminal *term = ume_get_page_term(ume, page);
 		VteTerminal *vte = (VteTerminal *)term->vte;
 
+		/* Jump between prompts marked by the shell */
+		if (keycode == ume_tokeycode(ume.config.prev_prompt_key)) {
+			ume_term_jump_command(term, BACKWARDS);
+			return true;
+		} else if (keycode == ume_tokeycode(ume.config.next_prompt_key)) {
+			ume_term_jump_command(term, FORWARD);
+			return true;
+		}
+
 		const int scroll_amount = [](guint keycode, VteTerminal *vte) {
 			gint rows = (gint)vte_terminal_get_row_count(vte);
 			if (keycode == ume_tokeycode(ume.config.scroll_up_key))
@@ -524,6 +973,7 @@ static gboolean ume_key_press(GtkWidget *widget, GdkEventKey *event, gpointer us
 
 	if ((event->state & ume.config.reload_modifier) == ume.config.reload_modifier) {
 		if (keycode == ume_tokeycode(ume.config.reload_key)) {
+			ume.stats.config_reloads++;
 			ume_reload_config_file();
 			ume_set_colorset(ume.config.last_colorset - 1);
 			return true;
@@ -554,28 +1004,31 @@ static gboolean ume_button_press(GtkWidget *widget, GdkEventButton *button_event
 	term = ume_get_page_term(ume, page);
 
 	/* Find out if cursor it's over a matched expression...*/
+	g_free(ume.current_match);
 	ume.current_match = vte_terminal_match_check_event(VTE_TERMINAL(term->vte), (GdkEvent *)button_event, &tag);
+	ume.current_rule = ume_match_rule_of(ume.current_match);
 
 	/* Left button with modifier: open the URL if any */
 	if (button_event->button == 1 &&
 			((button_event->state & ume.config.open_url_modifier) == ume.config.open_url_modifier) && ume.current_match) {
 
-		ume_open_url(NULL, NULL);
+		ume_match_activate();
 		return true;
 	}
 
 	/* Right button: show the popup menu */
 	if (button_event->button == 3) { // TODO break this out somewhere, its showing the right click menu
-		GtkMenu *menu;
-		menu = GTK_MENU(widget);
+		if (!ume.menu)
+			ume_init_popup();
+		else
+			ume_popup_refresh();
+		GtkMenu *menu = GTK_MENU(ume.menu);
 
 		if (ume.current_match) {
 			/* Show the extra options in the menu */
 
-			char *matches;
 			/* Is it a mail address? */
-			if (vte_terminal_event_check_regex_simple(VTE_TERMINAL(term->vte), (GdkEvent *)button_event,
-																								&ume.config.mail_vteregexp, 1, 0, &matches)) {
+			if (ume.current_rule && strcmp(ume.current_rule->action, "mail") == 0) {
 				gtk_widget_show(ume.item_open_mail);
 				gtk_widget_hide(ume.item_open_link);
 			} else {
@@ -584,8 +1037,6 @@ static gboolean ume_button_press(GtkWidget *widget, GdkEventButton *button_event
 			}
 			gtk_widget_show(ume.item_copy_link);
 			gtk_widget_show(ume.open_link_separator);
-
-			g_free(matches);
 		} else {
 			/* Hide all the options */
 			gtk_widget_hide(ume.item_open_mail);
@@ -593,6 +1044,9 @@ static gboolean ume_button_press(GtkWidget *widget, GdkEventButton *button_event
 			gtk_widget_hide(ume.item_copy_link);
 			gtk_widget_hide(ume.open_link_separator);
 		}
+		gtk_widget_set_visible(ume.item_cancel_paste, term->paste != NULL);
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(ume.item_log_output), term->log != NULL);
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(ume.item_fast_render), term->fast_render);
 
 		gtk_menu_popup_at_pointer(menu, (GdkEvent *)button_event);
 
@@ -681,6 +1135,9 @@ static void ume_page_removed(GtkWidget *widget, void *data) {
 }
 
 static void ume_beep(GtkWidget *widget, void *data) {
+	struct terminal *term = (struct terminal *)data;
+	term->stats.bells++;
+
 	// Remove the urgency hint. This is necessary to signal the window manager
 	// that a new urgent event happened when the urgent hint is set after this.
 	gtk_window_set_urgency_hint(GTK_WINDOW(ume.main_window), false);
@@ -690,39 +1147,52 @@ static void ume_beep(GtkWidget *widget, void *data) {
 	}
 }
 
-static void ume_increase_font(GtkWidget *widget, void *data) {
-	gint new_size;
+/* Zoom only rescales the one terminal, other tabs keep their fonts and glyph caches and the window
+ * keeps its size. Not saved anywhere */
+static void ume_term_zoom(struct terminal *term, gdouble scale) {
+	/* Set a minimal size */
+	scale = CLAMP(scale, FONT_SCALE_MIN, FONT_SCALE_MAX);
+	if (pango_font_description_get_size(ume.config.font) * scale < FONT_MINIMAL_SIZE)
+		return;
 
-	/* Increment font size one unit */
-	new_size = pango_font_description_get_size(ume.config.font) + PANGO_SCALE;
+	term->font_scale = scale;
+	if (term->vte)
+		vte_terminal_set_font_scale(VTE_TERMINAL(term->vte), scale);
+}
 
-	pango_font_description_set_size(ume.config.font, new_size);
-	ume_set_font();
-	ume_set_size();
-	const char *descriptor = pango_font_description_to_string(ume.config.font);
-	ume_set_config(cfg_group, "font", descriptor);
-	g_free((void *)descriptor);
+/* data is the tab when VTE asks, NULL for the current one */
+static struct terminal *ume_zoom_term(void *data) {
+	struct terminal *term = (struct terminal *)data;
+	if (!term)
+		term = ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+	return term;
 }
 
-static void ume_decrease_font(GtkWidget *widget, void *data) {
-	gint new_size;
+static void ume_increase_font(GtkWidget *widget, void *data) {
+	struct terminal *term = ume_zoom_term(data);
+	if (term)
+		ume_term_zoom(term, term->font_scale * FONT_SCALE_STEP);
+}
 
-	/* Decrement font size one unit */
-	new_size = pango_font_description_get_size(ume.config.font) - PANGO_SCALE;
+static void ume_decrease_font(GtkWidget *widget, void *data) {
+	struct terminal *term = ume_zoom_term(data);
+	if (term)
+		ume_term_zoom(term, term->font_scale / FONT_SCALE_STEP);
+}
 
-	/* Set a minimal size */
-	if (new_size >= FONT_MINIMAL_SIZE) {
-		pango_font_description_set_size(ume.config.font, new_size);
-		ume_set_font();
-		ume_set_size();
-		const char *descriptor = pango_font_description_to_string(ume.config.font);
-		ume_set_config(cfg_group, "font", descriptor);
-		g_free((void *)descriptor);
-	}
+static void ume_reset_font(GtkWidget *widget, void *data) {
+	struct terminal *term = ume_zoom_term(data);
+	if (term)
+		ume_term_zoom(term, 1.0);
 }
 
 static void ume_child_exited(GtkWidget *widget, void *data) {
-	gint page = gtk_notebook_page_num(GTK_NOTEBOOK(ume.notebook), gtk_widget_get_parent(widget));
+	ume_tab_exited(gtk_widget_get_parent(widget));
+}
+
+/* The tab on page hbox is done, its child or tmux window is gone */
+static void ume_tab_exited(GtkWidget *hbox) {
+	gint page = gtk_notebook_page_num(GTK_NOTEBOOK(ume.notebook), hbox);
 	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
 
 	SAY("Fetching page term:");
@@ -744,7 +1214,7 @@ static void ume_child_exited(GtkWidget *widget, void *data) {
 		return;
 	}
 
-	/* Child should be automatically reaped because we don't use G_SPAWN_DO_NOT_REAP_CHILD flag */
+	/* Child has already been reaped by the child watch in ume_child_watch */
 	SAY("Closing term->pid");
 	g_spawn_close_pid(term->pid);
 
@@ -758,41 +1228,6 @@ static void ume_child_exited(GtkWidget *widget, void *data) {
 	SAY("Finished!");
 }
 
-static void ume_eof(GtkWidget *widget, void *data) {
-	SAY("Got EOF signal");
-
-	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
-
-	/* Only write configuration to disk if it's the last tab */
-	if (npages == 1) {
-		ume_config_done(false);
-	}
-
-	/* Workaround for libvte strange behaviour. There is not child-exited signal for
-		 the last terminal, so we need to kill it here.  Check with libvte authors about
-		 child-exited/eof signals */
-	if (gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)) == 0) {
-		struct terminal *term = ume_get_page_term(ume, 0);
-
-		if (option_hold == true) {
-			SAY("hold option has been activated");
-			return;
-		}
-
-		// SAY("waiting for terminal pid (in eof) %d", term->pid);
-		// waitpid(term->pid, &status, WNOHANG);
-		/* TODO: check wait return */
-		/* Child should be automatically reaped because we don't use G_SPAWN_DO_NOT_REAP_CHILD flag */
-		g_spawn_close_pid(term->pid);
-
-		ume_del_tab(0);
-
-		npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
-		if (npages == 0)
-			ume_destroy();
-	}
-}
-
 /* This handler is called when window title changes, and is used to change window and notebook pages titles */
 static void ume_title_changed(GtkWidget *widget, void *data) {
 	VteTerminal *vte_term = (VteTerminal *)widget;
@@ -801,6 +1236,8 @@ static void ume_title_changed(GtkWidget *widget, void *data) {
 	struct terminal *term = ume_get_page_term(ume, modified_page);
 
 	const char *title = vte_terminal_get_window_title(VTE_TERMINAL(term->vte));
+	term->stats.title_changes++;
+	term->stats.title_rate.add(1, g_get_monotonic_time());
 
 	/* User set values overrides any other one, but title should be changed */
 	if (!term->label_set_byuser)
@@ -822,14 +1259,14 @@ static void ume_config_done(bool forceWrite) {
 	GError *gerror = NULL;
 	gsize len = 0;
 
-	gchar *cfgdata = g_key_file_to_data(ume.cfg_file, &len, &gerror);
-	if (!cfgdata) {
-		fprintf(stderr, "%s\n", gerror->message);
-		exit(EXIT_FAILURE);
-	}
-
-	/* Write to file IF there's been changes */
+	/* Write to file IF there's been changes. Without any a config from the cache never loads the file */
 	if (ume.config_modified) {
+		gchar *cfgdata = g_key_file_to_data(ume.cfg_file, &len, &gerror);
+		if (!cfgdata) {
+			fprintf(stderr, "%s\n", gerror->message);
+			exit(EXIT_FAILURE);
+		}
+
 		bool overwrite = true;
 		if (ume.externally_modified && !ume.config.ignore_overwrite) { // TODO break this into a confirmation function
 			GtkWidget *dialog;
@@ -839,7 +1276,7 @@ static void ume_config_done(bool forceWrite) {
 																			GTK_BUTTONS_YES_NO,
 																			_("Configuration has been modified by another process. Overwrite?"));
 
-			response = gtk_dialog_run(GTK_DIALOG(dialog));
+			response = ume_dialog_run(dialog, "ume_config_done:overwrite_dialog");
 			gtk_widget_destroy(dialog);
 
 			if (response == GTK_RESPONSE_YES)
@@ -849,6 +1286,7 @@ static void ume_config_done(bool forceWrite) {
 		}
 
 		if (overwrite || forceWrite) {
+			handler_scope_t scope(ume.stats.stalls, "ume_config_done:write");
 			GIOChannel *cfgfile = g_io_channel_new_file(ume.configfile, "w", &gerror);
 			if (!cfgfile) {
 				fprintf(stderr, "%s\n", gerror->message);
@@ -868,18 +1306,32 @@ static void ume_config_done(bool forceWrite) {
 			g_io_channel_shutdown(cfgfile, true, &gerror);
 			g_io_channel_unref(cfgfile);
 		}
+		g_free(cfgdata);
 	}
 }
 
 static gboolean ume_delete_event(GtkWidget *widget, void *data) {
+	/* Kept for the next summon, with all its tabs */
+	if (option_dropdown) {
+		gtk_widget_hide(ume.main_window);
+		return true;
+	}
+
+	/* Before the tabs are closed one by one below */
+	if (ume.config.save_session)
+		ume_session_save(true);
+
+	ume.detaching = true;
 	if (!ume.config.less_questions) {
 		while (gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook)) > 0) {
 			if (!ume_close_tab(0)) {
+				ume.detaching = false;
 				return true;
 			}
 		}
 	}
 
+	ume.session_saved = true;
 	ume_config_done(false);
 	return false;
 }
@@ -894,80 +1346,100 @@ static void ume_window_show_event(GtkWidget *widget, gpointer data) {
 }
 
 static void ume_font_dialog(GtkWidget *widget, void *data) {
-	GtkWidget *font_dialog = gtk_font_chooser_dialog_new(_("Select font"), GTK_WINDOW(ume.main_window));
+	if (!ume.font_dialog)
+		ume.font_dialog = gtk_font_chooser_dialog_new(_("Select font"), GTK_WINDOW(ume.main_window));
+	GtkWidget *font_dialog = ume.font_dialog;
 	gtk_font_chooser_set_font_desc(GTK_FONT_CHOOSER(font_dialog), ume.config.font);
 
-	gint response = gtk_dialog_run(GTK_DIALOG(font_dialog));
+	gint response = ume_dialog_run(font_dialog, "ume_font_dialog");
 
 	if (response == GTK_RESPONSE_OK) {
 		pango_font_description_free(ume.config.font);
 		ume.config.font = gtk_font_chooser_get_font_desc(GTK_FONT_CHOOSER(font_dialog));
 		ume_set_font();
 		ume_set_size();
-		const char *descriptor = pango_font_description_to_string(ume.config.font);
-		ume_set_config(cfg_group, "font", descriptor);
-		g_free((void *)descriptor);
+		ume_config_save("font");
 	}
 
-	gtk_widget_destroy(font_dialog);
+	gtk_widget_hide(font_dialog);
 }
 
-static void ume_set_name_dialog(GtkWidget *widget, void *data) { // TODO break this up a bit
-	GtkWidget *input_dialog, *input_header;
+/* Header bar dialog with a labelled entry, for the tab name, search and window title. The entry is
+ * kept as "entry" on the dialog */
+static GtkWidget *ume_entry_dialog_new(const gchar *title, const gchar *text) {
+	GtkWidget *dialog, *header;
 	GtkWidget *entry, *label;
-	GtkWidget *name_hbox; /* We need this for correct spacing */
-	gint response;
-	gint page;
-	struct terminal *term;
-	const gchar *text;
-
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
-	term = ume_get_page_term(ume, page);
+	GtkWidget *hbox; /* We need this for correct spacing */
 
-	input_dialog = gtk_dialog_new_with_buttons(_("Set tab name"), GTK_WINDOW(ume.main_window),
-																						 (GtkDialogFlags)(GTK_DIALOG_MODAL | GTK_DIALOG_USE_HEADER_BAR),
-																						 _("_Cancel"), GTK_RESPONSE_CANCEL, _("_Apply"), GTK_RESPONSE_ACCEPT, NULL);
+	dialog = gtk_dialog_new_with_buttons(title, GTK_WINDOW(ume.main_window),
+																			 (GtkDialogFlags)(GTK_DIALOG_MODAL | GTK_DIALOG_USE_HEADER_BAR), _("_Cancel"),
+																			 GTK_RESPONSE_CANCEL, _("_Apply"), GTK_RESPONSE_ACCEPT, NULL);
 
 	/* Configure the new gtk header bar*/
-	input_header = gtk_dialog_get_header_bar(GTK_DIALOG(input_dialog));
-	gtk_header_bar_set_show_close_button(GTK_HEADER_BAR(input_header), false);
-	gtk_dialog_set_default_response(GTK_DIALOG(input_dialog), GTK_RESPONSE_ACCEPT);
+	header = gtk_dialog_get_header_bar(GTK_DIALOG(dialog));
+	gtk_header_bar_set_show_close_button(GTK_HEADER_BAR(header), false);
+	gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
 
 	/* Set style */
-	gchar *css = g_strdup_printf(HIG_DIALOG_CSS);
-	gtk_css_provider_load_from_data(ume.provider, css, -1, NULL);
-	GtkStyleContext *context = gtk_widget_get_style_context(input_dialog);
-	gtk_style_context_add_provider(context, GTK_STYLE_PROVIDER(ume.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-	g_free(css);
+	gtk_style_context_add_class(gtk_widget_get_style_context(dialog), "ume-dialog");
 
-	name_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+	hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	entry = gtk_entry_new();
-	label = gtk_label_new(_("New text"));
-	/* Set tab label as entry default text (when first tab is not displayed, get_tab_label_text
-		 returns a null value, so check accordingly */
-	text = gtk_notebook_get_tab_label_text(GTK_NOTEBOOK(ume.notebook), term->hbox);
-	if (text) {
-		gtk_entry_set_text(GTK_ENTRY(entry), text);
-	}
+	label = gtk_label_new(text);
 	gtk_entry_set_activates_default(GTK_ENTRY(entry), true);
-	gtk_box_pack_start(GTK_BOX(name_hbox), label, true, true, 12);
-	gtk_box_pack_start(GTK_BOX(name_hbox), entry, true, true, 12);
-	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(input_dialog))), name_hbox, false, false, 12);
+	gtk_box_pack_start(GTK_BOX(hbox), label, true, true, 12);
+	gtk_box_pack_start(GTK_BOX(hbox), entry, true, true, 12);
+	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), hbox, false, false, 12);
+
+	/* Disable accept button while there's no text */
+	g_signal_connect(G_OBJECT(entry), "changed", G_CALLBACK(ume_setname_entry_changed), dialog);
+	g_object_set_data(G_OBJECT(dialog), "entry", entry);
+
+	gtk_widget_show_all(hbox);
+	return dialog;
+}
+
+/* Runs an entry dialog starting out with text, or with what was last typed when text is NULL. The
+ * dialog is hidden afterwards, the entry text stays readable until the next run */
+static gint ume_entry_dialog_run(GtkWidget *dialog, const gchar *text, const char *handler) {
+	GtkWidget *entry = (GtkWidget *)g_object_get_data(G_OBJECT(dialog), "entry");
+	if (text)
+		gtk_entry_set_text(GTK_ENTRY(entry), text);
+	ume_setname_entry_changed(entry, dialog);
+	gtk_widget_grab_focus(entry);
+	gtk_editable_select_region(GTK_EDITABLE(entry), 0, -1);
+
+	gint response = ume_dialog_run(dialog, handler);
+	gtk_widget_hide(dialog);
+	return response;
+}
 
-	/* Disable accept button until some text is entered */
-	g_signal_connect(G_OBJECT(entry), "changed", G_CALLBACK(ume_setname_entry_changed), input_dialog);
-	gtk_dialog_set_response_sensitive(GTK_DIALOG(input_dialog), GTK_RESPONSE_ACCEPT, false);
+static void ume_set_name_dialog(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
 
-	gtk_widget_show_all(name_hbox);
+	if (!ume.name_dialog)
+		ume.name_dialog = ume_entry_dialog_new(_("Set tab name"), _("New text"));
 
-	response = gtk_dialog_run(GTK_DIALOG(input_dialog));
+	/* Set tab label as entry default text (when first tab is not displayed, get_tab_label_text
+		 returns a null value, so check accordingly */
+	const gchar *text = gtk_notebook_get_tab_label_text(GTK_NOTEBOOK(ume.notebook), term->hbox);
+	gint response = ume_entry_dialog_run(ume.name_dialog, text ? text : "", "ume_set_name_dialog");
 
 	if (response == GTK_RESPONSE_ACCEPT) {
-		ume_set_tab_label_text(gtk_entry_get_text(GTK_ENTRY(entry)), page);
+		GtkWidget *entry = (GtkWidget *)g_object_get_data(G_OBJECT(ume.name_dialog), "entry");
+		const gchar *name = gtk_entry_get_text(GTK_ENTRY(entry));
+		ume_set_tab_label_text(name, page);
+		g_free(term->label_text);
+		term->label_text = g_strdup(name);
 		term->label_set_byuser = true;
-	}
 
-	gtk_widget_destroy(input_dialog);
+		if (term->tmux_window >= 0) {
+			gchar *quoted = g_shell_quote(name);
+			ume_tmux_command(NULL, NULL, "rename-window -t @%d %s", term->tmux_window, quoted);
+			g_free(quoted);
+		}
+	}
 }
 
 static void ume_set_colorset(int cs) {
@@ -976,39 +1448,100 @@ static void ume_set_colorset(int cs) {
 
 	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
 	struct terminal *term = ume_get_page_term(ume, page);
+	/* Moving into or out of a fast rendering colorset, a tab toggled by hand keeps its choice otherwise */
+	if (ume_colorset_fast_render(cs) != ume_colorset_fast_render(term->colorset))
+		ume_term_set_fast_render(term, ume_colorset_fast_render(cs));
 	term->colorset = cs;
 	ume.palette = ume.config.colors.palettes[cs].data();
 
-	ume_set_config(cfg_group, "last_colorset", term->colorset + 1);
+	/* Reloads and the color dialog set the same colorset over and over, only a change is journaled */
+	if (ume.config.last_colorset != cs + 1) {
+		ume.config.last_colorset = cs + 1;
+		ume_state_set("last_colorset", ume.config.last_colorset);
+	}
 	ume_set_colors();
 }
 
+static void ume_term_set_colors(struct terminal *term) {
+	/* Placeholders get theirs once materialized */
+	if (!term->vte)
+		return;
+	SAY("Setting colorset %d", term->colorset + 1);
+
+	vte_terminal_set_colors(VTE_TERMINAL(term->vte), &ume.config.colors.forecolors[term->colorset],
+													&ume.config.colors.backcolors[term->colorset], ume.palette, PALETTE_SIZE);
+
+	if (ume.config.colors.curscolors[term->colorset].alpha == 0) {
+		vte_terminal_set_color_cursor((VteTerminal *)term->vte, nullptr);
+		vte_terminal_set_color_cursor_foreground((VteTerminal *)term->vte, nullptr);
+	} else {
+		vte_terminal_set_color_cursor(VTE_TERMINAL(term->vte), &ume.config.colors.curscolors[term->colorset]);
+	}
+}
+
+/* A translucent background is drawn by VTE alone, the window and the notebook behind it stay
+ * unpainted rather than the whole window being composited with an opacity. Follows the tab in front */
+static void ume_set_translucent(struct terminal *term) {
+	GtkStyleContext *context = gtk_widget_get_style_context(ume.main_window);
+	if (ume.config.colors.backcolors[term->colorset].alpha < 1.0)
+		gtk_style_context_add_class(context, "translucent");
+	else
+		gtk_style_context_remove_class(context, "translucent");
+}
+
 /* Set the terminal colors for all notebook tabs */
 static void ume_set_colors() {
+	handler_scope_t scope(ume.stats.stalls, "ume_set_colors");
 	int n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
 	struct terminal *term;
 	for (int i = (n_pages - 1); i >= 0; i--) {
 		term = ume_get_page_term(ume, i);
-		SAY("Setting colorset %d", term->colorset + 1);
+		ume_term_set_colors(term);
+	}
 
-		vte_terminal_set_colors(VTE_TERMINAL(term->vte), &ume.config.colors.forecolors[term->colorset],
-														&ume.config.colors.backcolors[term->colorset], ume.palette, PALETTE_SIZE);
+	if (n_pages > 0)
+		ume_set_translucent(ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook))));
+}
 
-		if (ume.config.colors.curscolors[term->colorset].alpha == 0) {
-			vte_terminal_set_color_cursor((VteTerminal *)term->vte, nullptr);
-			vte_terminal_set_color_cursor_foreground((VteTerminal *)term->vte, nullptr);
-		} else {
-			vte_terminal_set_color_cursor(VTE_TERMINAL(term->vte), &ume.config.colors.curscolors[term->colorset]);
-		}
+/* Whether some colorset has a background that isn't opaque */
+static bool ume_colors_translucent() {
+	for (int i = 0; i < NUM_COLORSETS; ++i) {
+		if (ume.config.colors.backcolors[i].alpha < 1.0)
+			return true;
 	}
-
-	/* Main window opacity must be set. Otherwise vte widget will remain opaque */
-	gtk_widget_set_opacity(ume.main_window, ume.config.colors.backcolors[term->colorset].alpha);
+	return false;
 }
 
 /* Callback from the color change dialog. Updates the contents of that
  * dialog, passed as 'data' from user input. */
 #define COLOR_BUTTON_ID "color_button%d"
+static void ume_color_dialog_changed(GtkWidget *, void *);
+
+/* Shows colorset cs in the dialog. Nothing is stored, the opacity spin doesn't report the change */
+static void ume_color_dialog_load(GtkWidget *dialog, int cs) {
+	GtkColorButton *fore_button = (GtkColorButton *)g_object_get_data(G_OBJECT(dialog), "fg_button");
+	GtkColorButton *back_button = (GtkColorButton *)g_object_get_data(G_OBJECT(dialog), "bg_button");
+	GtkColorButton *curs_button = (GtkColorButton *)g_object_get_data(G_OBJECT(dialog), "curs_button");
+	GtkSpinButton *opacity_spin = (GtkSpinButton *)g_object_get_data(G_OBJECT(dialog), "opacity_spin");
+
+	gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(fore_button), &ume.config.colors.forecolors[cs]);
+	gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(back_button), &ume.config.colors.backcolors[cs]);
+	gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(curs_button), &ume.config.colors.curscolors[cs]);
+	for (int i = 0; i < PALETTE_SIZE; ++i) {
+		char temp[64];
+		sprintf(temp, COLOR_BUTTON_ID, i);
+		GtkWidget *button = (GtkWidget *)g_object_get_data(G_OBJECT(dialog), temp);
+		gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(button), &(ume.config.colors.palettes[cs][i]));
+	}
+
+	/* Spin opacity is a percentage, convert it*/
+	g_signal_handlers_block_matched(opacity_spin, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, (gpointer)ume_color_dialog_changed,
+																	NULL);
+	gtk_spin_button_set_value(opacity_spin, (int)(ume.config.colors.backcolors[cs].alpha * 100));
+	g_signal_handlers_unblock_matched(opacity_spin, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, (gpointer)ume_color_dialog_changed,
+																		NULL);
+}
+
 static void ume_color_dialog_changed(GtkWidget *widget, void *data) {
 	GtkDialog *dialog = (GtkDialog *)data;
 	GtkColorButton *fore_button = (GtkColorButton *)g_object_get_data(G_OBJECT(dialog), "fg_button");
@@ -1030,15 +1563,7 @@ static void ume_color_dialog_changed(GtkWidget *widget, void *data) {
 	 * Else, the colorselect buttons or opacity spin have gotten a new
 	 * value, store that. */
 	if ((GtkWidget *)set == widget) {
-		/* Spin opacity is a percentage, convert it*/
-		gint new_opacity = (int)(ume.config.colors.backcolors[selected].alpha * 100);
-		gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(fore_button), &ume.config.colors.forecolors[selected]);
-		gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(back_button), &ume.config.colors.backcolors[selected]);
-		gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(curs_button), &ume.config.colors.curscolors[selected]);
-		for (int i = 0; i < PALETTE_SIZE; ++i)
-			gtk_color_chooser_set_rgba(GTK_COLOR_CHOOSER(color_buttons[i]), &(ume.config.colors.palettes[selected][i]));
-
-		gtk_spin_button_set_value(opacity_spin, new_opacity);
+		ume_color_dialog_load(GTK_WIDGET(dialog), selected);
 	} else {
 		gtk_color_chooser_get_rgba(GTK_COLOR_CHOOSER(fore_button), &ume.config.colors.forecolors[selected]);
 		gtk_color_chooser_get_rgba(GTK_COLOR_CHOOSER(back_button), &ume.config.colors.backcolors[selected]);
@@ -1050,7 +1575,6 @@ static void ume_color_dialog_changed(GtkWidget *widget, void *data) {
 		ume.config.colors.backcolors[selected].alpha = gtk_spin_button_get_value(opacity_spin) / 100;
 	}
 
-	ume.config.last_colorset = selected + 1;
 	ume_set_colorset(selected);
 }
 
@@ -1100,11 +1624,7 @@ static GtkWidget *ume_create_color_dialog(GtkWidget *widget, void *data) {
 	gtk_dialog_set_default_response(GTK_DIALOG(color_dialog), GTK_RESPONSE_ACCEPT);
 
 	/* Set style */
-	gchar *css = g_strdup_printf(HIG_DIALOG_CSS);
-	gtk_css_provider_load_from_data(ume.provider, css, -1, NULL);
-	GtkStyleContext *context = gtk_widget_get_style_context(color_dialog);
-	gtk_style_context_add_provider(context, GTK_STYLE_PROVIDER(ume.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-	g_free(css);
+	gtk_style_context_add_class(gtk_widget_get_style_context(color_dialog), "ume-dialog");
 
 	/* Add the drop-down combobox that selects current colorset to edit. */
 	GtkWidget *hbox_sets = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 12);
@@ -1165,8 +1685,19 @@ static void ume_color_dialog(GtkWidget *widget, void *data) {
 	struct term_colors_t temp_colors = ume.config.colors;
 	int prev_colorset = ume.config.last_colorset - 1;
 
-	GtkWidget *color_dialog = ume_create_color_dialog(widget, data);
-	gint response = gtk_dialog_run(GTK_DIALOG(color_dialog)); // Loop on and update the dialog menu
+	/* A dialog kept from an earlier run is brought up to date with the current tab and config */
+	if (!ume.color_dialog) {
+		ume.color_dialog = ume_create_color_dialog(widget, data);
+	} else {
+		struct terminal *term = ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+		GtkComboBox *set = (GtkComboBox *)g_object_get_data(G_OBJECT(ume.color_dialog), "set_combo");
+		g_signal_handlers_block_matched(set, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, (gpointer)ume_color_dialog_changed, NULL);
+		gtk_combo_box_set_active(set, term->colorset);
+		g_signal_handlers_unblock_matched(set, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, (gpointer)ume_color_dialog_changed, NULL);
+		ume_color_dialog_load(ume.color_dialog, term->colorset);
+	}
+	GtkWidget *color_dialog = ume.color_dialog;
+	gint response = ume_dialog_run(color_dialog, "ume_color_dialog"); // Loop on and update the dialog menu
 
 	if (response != GTK_RESPONSE_ACCEPT) {
 		ume.config.colors = temp_colors;
@@ -1202,7 +1733,7 @@ static void ume_color_dialog(GtkWidget *widget, void *data) {
 		 * hopefully will not mind. */
 		ume_set_colorset(ume.config.last_colorset - 1);
 	}
-	gtk_widget_destroy(color_dialog);
+	gtk_widget_hide(color_dialog);
 }
 
 // Fading
@@ -1244,97 +1775,33 @@ static void ume_fade_in() { // NOTE: maybe we can make this fade between color s
 }
 
 static void ume_search_dialog(GtkWidget *widget, void *data) { // TODO: (low) inline into terminal itself? clean up
-	GtkWidget *title_dialog, *title_header;
-	GtkWidget *entry, *label;
-	GtkWidget *title_hbox;
-	gint response;
-
-	title_dialog = gtk_dialog_new_with_buttons(_("Search"), GTK_WINDOW(ume.main_window),
-																						 (GtkDialogFlags)(GTK_DIALOG_MODAL | GTK_DIALOG_USE_HEADER_BAR),
-																						 _("_Cancel"), GTK_RESPONSE_CANCEL, _("_Apply"), GTK_RESPONSE_ACCEPT, NULL);
-
-	/* Configure the new gtk header bar*/
-	title_header = gtk_dialog_get_header_bar(GTK_DIALOG(title_dialog));
-	gtk_header_bar_set_show_close_button(GTK_HEADER_BAR(title_header), false);
-	gtk_dialog_set_default_response(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT);
-
-	/* Set style */
-	gchar *css = g_strdup_printf(HIG_DIALOG_CSS);
-	gtk_css_provider_load_from_data(ume.provider, css, -1, NULL);
-	GtkStyleContext *context = gtk_widget_get_style_context(title_dialog);
-	gtk_style_context_add_provider(context, GTK_STYLE_PROVIDER(ume.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-	g_free(css);
-
-	entry = gtk_entry_new();
-	label = gtk_label_new(_("Search"));
-	title_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-	gtk_entry_set_activates_default(GTK_ENTRY(entry), true);
-	gtk_box_pack_start(GTK_BOX(title_hbox), label, true, true, 12);
-	gtk_box_pack_start(GTK_BOX(title_hbox), entry, true, true, 12);
-	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(title_dialog))), title_hbox, false, false, 12);
-
-	/* Disable accept button until some text is entered */
-	g_signal_connect(G_OBJECT(entry), "changed", G_CALLBACK(ume_setname_entry_changed), title_dialog);
-	gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, false);
-
-	gtk_widget_show_all(title_hbox);
+	if (!ume.search_dialog)
+		ume.search_dialog = ume_entry_dialog_new(_("Search"), _("Search"));
 
-	response = gtk_dialog_run(GTK_DIALOG(title_dialog));
+	/* The last search is offered again */
+	gint response = ume_entry_dialog_run(ume.search_dialog, NULL, "ume_search_dialog");
 	if (response == GTK_RESPONSE_ACCEPT) {
 		gint page;
 		struct terminal *term;
 		page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
 		term = ume_get_page_term(ume, page);
+		GtkWidget *entry = (GtkWidget *)g_object_get_data(G_OBJECT(ume.search_dialog), "entry");
 		search(VTE_TERMINAL(term->vte), gtk_entry_get_text(GTK_ENTRY(entry)), 0);
 	}
-	gtk_widget_destroy(title_dialog);
 }
 
-// TODO clean up
 static void ume_set_title_dialog(GtkWidget *widget, void *data) {
-	GtkWidget *title_dialog, *title_header;
-	GtkWidget *entry, *label;
-	GtkWidget *title_hbox;
-	gint response;
-
-	title_dialog = gtk_dialog_new_with_buttons(_("Set window title"), GTK_WINDOW(ume.main_window),
-																						 (GtkDialogFlags)(GTK_DIALOG_MODAL | GTK_DIALOG_USE_HEADER_BAR),
-																						 _("_Cancel"), GTK_RESPONSE_CANCEL, _("_Apply"), GTK_RESPONSE_ACCEPT, NULL);
-
-	/* Configure the new gtk header bar*/
-	title_header = gtk_dialog_get_header_bar(GTK_DIALOG(title_dialog));
-	gtk_header_bar_set_show_close_button(GTK_HEADER_BAR(title_header), false);
-	gtk_dialog_set_default_response(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT);
+	if (!ume.title_dialog)
+		ume.title_dialog = ume_entry_dialog_new(_("Set window title"), _("New window title"));
 
-	/* Set style */
-	gchar *css = g_strdup_printf(HIG_DIALOG_CSS);
-	gtk_css_provider_load_from_data(ume.provider, css, -1, NULL);
-	GtkStyleContext *context = gtk_widget_get_style_context(title_dialog);
-	gtk_style_context_add_provider(context, GTK_STYLE_PROVIDER(ume.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-	g_free(css);
-
-	entry = gtk_entry_new();
-	label = gtk_label_new(_("New window title"));
-	title_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	/* Set window label as entry default text */
-	gtk_entry_set_text(GTK_ENTRY(entry), gtk_window_get_title(GTK_WINDOW(ume.main_window)));
-	gtk_entry_set_activates_default(GTK_ENTRY(entry), true);
-	gtk_box_pack_start(GTK_BOX(title_hbox), label, true, true, 12);
-	gtk_box_pack_start(GTK_BOX(title_hbox), entry, true, true, 12);
-	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(title_dialog))), title_hbox, false, false, 12);
-
-	/* Disable accept button until some text is entered */
-	g_signal_connect(G_OBJECT(entry), "changed", G_CALLBACK(ume_setname_entry_changed), title_dialog);
-	gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, false);
-
-	gtk_widget_show_all(title_hbox);
-
-	response = gtk_dialog_run(GTK_DIALOG(title_dialog));
+	gint response =
+			ume_entry_dialog_run(ume.title_dialog, gtk_window_get_title(GTK_WINDOW(ume.main_window)), "ume_set_title_dialog");
 	if (response == GTK_RESPONSE_ACCEPT) {
+		GtkWidget *entry = (GtkWidget *)g_object_get_data(G_OBJECT(ume.title_dialog), "entry");
 		/* Bug #257391 shadow reachs here too... */
 		gtk_window_set_title(GTK_WINDOW(ume.main_window), gtk_entry_get_text(GTK_ENTRY(entry)));
 	}
-	gtk_widget_destroy(title_dialog);
 }
 
 static void ume_copy_url(GtkWidget *widget, void *data) {
@@ -1381,84 +1848,215 @@ static void ume_open_mail(GtkWidget *widget, void *data) {
 	}
 }
 
+/******* Match rules ********/
+/* The first count patterns as one alternation, NULL if that doesn't compile */
+static VteRegex *ume_matches_join(GPtrArray *patterns, guint count, GError **error) {
+	GString *pattern = g_string_new(NULL);
+	for (guint i = 0; i < count; ++i) {
+		if (pattern->len)
+			g_string_append_c(pattern, '|');
+		g_string_append_printf(pattern, "(?:%s)", (const gchar *)g_ptr_array_index(patterns, i));
+	}
+	VteRegex *regex = vte_regex_new_for_match(pattern->str, pattern->len, PCRE2_MULTILINE, error);
+	g_string_free(pattern, true);
+	return regex;
+}
+
+/* Every rule of config_t::match_rules is checked on its own, one that doesn't compile is left out.
+ * The rest are joined into a single alternation that's JIT compiled, so hovering runs one pass over
+ * the text under the pointer however many rules there are. Which rule matched is only worked out
+ * on a click, see ume_match_rule_of */
+static void ume_matches_compile() {
+	if (ume.matches.regex)
+		vte_regex_unref(ume.matches.regex);
+	ume.matches.regex = NULL;
+	if (ume.matches.rules)
+		g_ptr_array_unref(ume.matches.rules);
+	ume.matches.rules = g_ptr_array_new_with_free_func((GDestroyNotify)match_rule_t::free);
+	ume.current_rule = NULL;
+
+	GPtrArray *patterns = g_ptr_array_new_with_free_func(g_free);
+	const char rule_separator[] = {MATCH_RULE_SEPARATOR, '\0'};
+	const char field_separator[] = {MATCH_FIELD_SEPARATOR, '\0'};
+	gchar **records = g_strsplit(ume.config.match_rules ? ume.config.match_rules : "", rule_separator, -1);
+	for (gchar **record = records; *record; ++record) {
+		gchar **fields = g_strsplit(*record, field_separator, 3);
+		if (g_strv_length(fields) != 3) {
+			g_strfreev(fields);
+			continue;
+		}
+
+		GError *error = NULL;
+		GRegex *regex = g_regex_new(fields[1], G_REGEX_OPTIMIZE, (GRegexMatchFlags)0, &error);
+		if (!regex) {
+			SAY("Match rule %s: %s", fields[0], error->message);
+			g_error_free(error);
+			g_strfreev(fields);
+			continue;
+		}
+		match_rule_t *rule = g_new0(match_rule_t, 1);
+		rule->name = g_strdup(fields[0]);
+		rule->action = g_strdup(fields[2]);
+		rule->regex = regex;
+		g_ptr_array_add(ume.matches.rules, rule);
+		g_ptr_array_add(patterns, g_strdup(fields[1]));
+		g_strfreev(fields);
+	}
+	g_strfreev(records);
+
+	if (patterns->len) {
+		GError *error = NULL;
+		ume.matches.regex = ume_matches_join(patterns, patterns->len, &error);
+		/* Rules fine on their own can break the alternation, e.g. two with the same named group. The
+		 * rules are then joined one at a time, and each one that breaks it is left out */
+		if (!ume.matches.regex) {
+			SAY("Match rules: %s", error->message);
+			g_clear_error(&error);
+			for (guint i = 0; i < patterns->len;) {
+				VteRegex *regex = ume_matches_join(patterns, i + 1, &error);
+				if (regex) {
+					vte_regex_unref(regex);
+					++i;
+					continue;
+				}
+				SAY("Match rule %s left out: %s", ((match_rule_t *)g_ptr_array_index(ume.matches.rules, i))->name,
+						error->message);
+				g_clear_error(&error);
+				g_ptr_array_remove_index(ume.matches.rules, i);
+				g_ptr_array_remove_index(patterns, i);
+			}
+			if (patterns->len)
+				ume.matches.regex = ume_matches_join(patterns, patterns->len, NULL);
+		}
+		if (ume.matches.regex && !vte_regex_jit(ume.matches.regex, PCRE2_JIT_COMPLETE, &error)) {
+			/* Still usable, only slower */
+			SAY("Match rules aren't JIT compiled: %s", error->message);
+			g_error_free(error);
+		}
+	}
+	SAY("%u match rules", ume.matches.rules->len);
+	g_ptr_array_unref(patterns);
+}
+
+/* The rule that matches all of text, or else the first that matches part of it */
+static const match_rule_t *ume_match_rule_of(const char *text) {
+	if (!text || !ume.matches.rules)
+		return NULL;
+
+	const match_rule_t *partial = NULL;
+	gsize len = strlen(text);
+	for (guint i = 0; i < ume.matches.rules->len; ++i) {
+		const match_rule_t *rule = (const match_rule_t *)g_ptr_array_index(ume.matches.rules, i);
+		GMatchInfo *info;
+		if (g_regex_match(rule->regex, text, (GRegexMatchFlags)0, &info)) {
+			gint start, end;
+			g_match_info_fetch_pos(info, 0, &start, &end);
+			if (start == 0 && (gsize)end == len) {
+				g_match_info_free(info);
+				return rule;
+			}
+			if (!partial)
+				partial = rule;
+		}
+		g_match_info_free(info);
+	}
+	return partial;
+}
+
+/* A command line action. %s in its arguments is the match, without any the match is added last */
+static void ume_match_run(const char *command) {
+	GError *error = NULL;
+	gchar **argv;
+	if (!g_shell_parse_argv(command, NULL, &argv, &error)) {
+		ume_error("Bad match action \"%s\": %s", command, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	bool substituted = false;
+	for (gchar **arg = argv; *arg; ++arg) {
+		if (!strstr(*arg, "%s"))
+			continue;
+		gchar **parts = g_strsplit(*arg, "%s", -1);
+		g_free(*arg);
+		*arg = g_strjoinv(ume.current_match, parts);
+		g_strfreev(parts);
+		substituted = true;
+	}
+	if (!substituted) {
+		guint argc = g_strv_length(argv);
+		argv = g_renew(gchar *, argv, argc + 2);
+		argv[argc] = g_strdup(ume.current_match);
+		argv[argc + 1] = NULL;
+	}
+
+	if (!g_spawn_async(".", argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, &error)) {
+		ume_error("Couldn't exec \"%s\": %s", command, error->message);
+		g_error_free(error);
+	}
+	g_strfreev(argv);
+}
+
+/* Does what the rule of current_match says, a match no rule claims is opened */
+static void ume_match_activate() {
+	const char *action = ume.current_rule ? ume.current_rule->action : MATCH_DEFAULT_ACTION;
+	if (strcmp(action, "open") == 0)
+		ume_open_url(NULL, NULL);
+	else if (strcmp(action, "mail") == 0)
+		ume_open_mail(NULL, NULL);
+	else if (strcmp(action, "copy") == 0)
+		ume_copy_url(NULL, NULL);
+	else
+		ume_match_run(action);
+}
+
+static void ume_match_open(GtkWidget *widget, void *data) {
+	ume_match_activate();
+}
+
 static void ume_show_first_tab(GtkWidget *widget, void *data) {
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
 		gtk_notebook_set_show_tabs(GTK_NOTEBOOK(ume.notebook), true);
-		ume_set_config(cfg_group, "show_always_first_tab", "Yes");
 		ume.config.first_tab = true;
 	} else {
 		/* Only hide tabs if the notebook has one page */
 		if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook)) == 1) {
 			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(ume.notebook), false);
 		}
-		ume_set_config(cfg_group, "show_always_first_tab", "No");
 		ume.config.first_tab = false;
 	}
+	ume_config_save("show_always_first_tab");
 	ume_set_size();
 }
 
-// TODO these are just config setters, maybe we can just use lambdas or something
 static void ume_tabs_on_bottom(GtkWidget *widget, void *data) {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(ume.notebook), GTK_POS_BOTTOM);
-		ume_set_config(cfg_group, "tabs_on_bottom", true);
-	} else {
-		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(ume.notebook), GTK_POS_TOP);
-		ume_set_config(cfg_group, "tabs_on_bottom", false);
-	}
+	ume.config.tabs_on_bottom = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	ume_config_save("tabs_on_bottom");
+	ume_config_apply(APPLY_TABS);
 }
 
 static void ume_less_questions(GtkWidget *widget, void *data) {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		ume.config.less_questions = true;
-		ume_set_config(cfg_group, "less_questions", true);
-	} else {
-		ume.config.less_questions = false;
-		ume_set_config(cfg_group, "less_questions", false);
-	}
+	ume.config.less_questions = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	ume_config_save("less_questions");
 }
 
 static void ume_show_close_button(GtkWidget *widget, void *data) {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		ume_set_config(cfg_group, "closebutton", true);
-	} else {
-		ume_set_config(cfg_group, "closebutton", false);
-	}
+	ume.config.show_closebutton = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	ume_config_save("closebutton");
 }
 
 static void ume_show_scrollbar(GtkWidget *widget, void *data) {
 	ume.config.keep_fc = 1;
 
-	gint n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
-	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
-	struct terminal *term = ume_get_page_term(ume, page);
-
-	if (!g_key_file_get_boolean(ume.cfg_file, cfg_group, "scrollbar", NULL)) {
-		ume.config.show_scrollbar = true;
-		ume_set_config(cfg_group, "scrollbar", true);
-	} else {
-		ume.config.show_scrollbar = false;
-		ume_set_config(cfg_group, "scrollbar", false);
-	}
-
 	/* Toggle/Untoggle the scrollbar for all tabs */
-	for (int i = (n_pages - 1); i >= 0; i--) {
-		term = ume_get_page_term(ume, i);
-		if (!ume.config.show_scrollbar)
-			gtk_widget_hide(term->scrollbar);
-		else
-			gtk_widget_show(term->scrollbar);
-	}
-	ume_set_size();
+	ume.config.show_scrollbar = !ume.config.show_scrollbar;
+	ume_config_save("scrollbar");
+	ume_config_apply(APPLY_TERMINALS);
 }
 
 static void ume_urgent_bell(GtkWidget *widget, void *data) {
 	ume.config.urgent_bell = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
-	if (ume.config.urgent_bell) {
-		ume_set_config(cfg_group, "urgent_bell", "Yes");
-	} else {
-		ume_set_config(cfg_group, "urgent_bell", "No");
-	}
+	ume_config_save("urgent_bell");
 }
 
 static void ume_audible_bell(GtkWidget *widget, void *data) {
@@ -1470,11 +2068,12 @@ static void ume_audible_bell(GtkWidget *widget, void *data) {
 
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
 		vte_terminal_set_audible_bell(VTE_TERMINAL(term->vte), true);
-		ume_set_config(cfg_group, "audible_bell", "Yes");
+		ume.config.audible_bell = true;
 	} else {
 		vte_terminal_set_audible_bell(VTE_TERMINAL(term->vte), false);
-		ume_set_config(cfg_group, "audible_bell", "No");
+		ume.config.audible_bell = false;
 	}
+	ume_config_save("audible_bell");
 }
 
 static void ume_blinking_cursor(GtkWidget *widget, void *data) {
@@ -1486,11 +2085,12 @@ static void ume_blinking_cursor(GtkWidget *widget, void *data) {
 
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
 		vte_terminal_set_cursor_blink_mode(VTE_TERMINAL(term->vte), VTE_CURSOR_BLINK_ON);
-		ume_set_config(cfg_group, "blinking_cursor", "Yes");
+		ume.config.blinking_cursor = true;
 	} else {
 		vte_terminal_set_cursor_blink_mode(VTE_TERMINAL(term->vte), VTE_CURSOR_BLINK_OFF);
-		ume_set_config(cfg_group, "blinking_cursor", "No");
+		ume.config.blinking_cursor = false;
 	}
+	ume_config_save("blinking_cursor");
 }
 
 static void ume_allow_bold(GtkWidget *widget, void *data) {
@@ -1499,21 +2099,17 @@ static void ume_allow_bold(GtkWidget *widget, void *data) {
 
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
 		vte_terminal_set_allow_bold(VTE_TERMINAL(term->vte), true);
-		ume_set_config(cfg_group, "allow_bold", "Yes");
+		ume.config.allow_bold = true;
 	} else {
 		vte_terminal_set_allow_bold(VTE_TERMINAL(term->vte), false);
-		ume_set_config(cfg_group, "allow_bold", "No");
+		ume.config.allow_bold = false;
 	}
+	ume_config_save("allow_bold");
 }
 
 static void ume_stop_tab_cycling_at_end_tabs(GtkWidget *widget, void *data) {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		ume_set_config(cfg_group, "stop_tab_cycling_at_end_tabs", "Yes");
-		ume.config.stop_tab_cycling_at_end_tabs = true;
-	} else {
-		ume_set_config(cfg_group, "stop_tab_cycling_at_end_tabs", "No");
-		ume.config.stop_tab_cycling_at_end_tabs = false;
-	}
+	ume.config.stop_tab_cycling_at_end_tabs = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	ume_config_save("stop_tab_cycling_at_end_tabs");
 }
 
 static void ume_set_cursor(GtkWidget *widget, void *data) {
@@ -1522,88 +2118,1847 @@ static void ume_set_cursor(GtkWidget *widget, void *data) {
 	int n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
 
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		if (strcmp(cursor_string, "block") == 0) {
-			ume.config.cursor_type = VTE_CURSOR_SHAPE_BLOCK;
-			ume_set_config(cfg_group, "cursor_type", "block");
-		} else if (strcmp(cursor_string, "underline") == 0) {
-			ume.config.cursor_type = VTE_CURSOR_SHAPE_UNDERLINE;
-			ume_set_config(cfg_group, "cursor_type", "underline");
-		} else if (strcmp(cursor_string, "ibeam") == 0) {
-			ume.config.cursor_type = VTE_CURSOR_SHAPE_IBEAM;
-			ume_set_config(cfg_group, "cursor_type", "ibeam");
-		}
+		ume.config.cursor_type = ume_cursor_from_name(cursor_string);
+		ume_config_save("cursor_type");
 
 		for (int i = (n_pages - 1); i >= 0; i--) {
 			struct terminal *term = ume_get_page_term(ume, i);
-			vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte), ume.config.cursor_type);
+			if (term->vte)
+				vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte), ume.config.cursor_type);
 		}
 	}
 }
 
-/* Retrieve the cwd of the specified term page.
- * Original function was from terminal-screen.c of gnome-terminal, copyright (C) 2001 Havoc Pennington
+/* Keeps the directory the shell reports with OSC 7, so new tabs don't have to ask /proc. Reports
+ * from other hosts (ssh, containers with their own hostname) don't name a local directory. */
+static void ume_term_directory_changed(VteTerminal *vte, gpointer data) {
+	struct terminal *term = (struct terminal *)data;
+	const char *uri = vte_terminal_get_current_directory_uri(vte);
+	gchar *hostname = NULL, *path = NULL;
+
+	if (uri)
+		path = g_filename_from_uri(uri, &hostname, NULL);
+
+	g_free(term->cwd);
+	term->cwd = NULL;
+	if (path && (!hostname || !*hostname || strcmp(hostname, "localhost") == 0 ||
+							 strcmp(hostname, g_get_host_name()) == 0)) {
+		term->cwd = path;
+		path = NULL;
+	}
+	SAY("Tab directory is now %s", term->cwd ? term->cwd : "unknown");
+	g_free(hostname);
+	g_free(path);
+}
+
+/* Directory of a process from /proc, NULL if it can't be read */
+static char *ume_get_pid_cwd(pid_t pid) {
+	if (pid <= 0)
+		return NULL;
+
+	char *file = g_strdup_printf("/proc/%d/cwd", pid);
+	char *cwd = g_file_read_link(file, NULL);
+	g_free(file);
+
+	if (cwd && cwd[0] != '/') {
+		g_free(cwd);
+		cwd = NULL;
+	}
+	return cwd;
+}
+
+/* Retrieve the cwd of the specified term page, as reported by the shell or else from /proc.
+ * The /proc fallback follows the foreground job rather than the shell when there is one, and
+ * falls back to the shell when the job's leader is gone or not ours to read.
+ * Original function was from terminal-screen.c of gnome-terminal, copyright (C) 2001 Havoc Pennington
  * Adapted by Hong Jen Yee, non-linux shit removed by David Gómez */
 static char *ume_get_term_cwd(struct terminal *term) {
-	char *cwd = NULL;
+	if (term->cwd)
+		return g_strdup(term->cwd);
+
+	pid_t pgid = ume_term_foreground_pgid(term);
+	char *cwd = pgid != term->pid ? ume_get_pid_cwd(pgid) : NULL;
+	if (!cwd)
+		cwd = ume_get_pid_cwd(term->pid);
+	return cwd;
+}
+
+/******* Deferred rewrap ********/
+/* VteTerminal that holds off changes to its size, each of which rewraps the whole scrollback. A tab
+ * in the background takes its size when it's switched to, and while the window is being resized the
+ * current tab only takes the size the window ends up with */
+struct UmeVte {
+	VteTerminal parent;
+	bool allocated;				/* Had a size applied, the first one never waits */
+	bool pending;					/* A size change is held off */
+	AtkObject *no_op_accessible; /* Handed out instead of VTE's when ume.accessible is false */
+	bool typing;								 /* Inside a key press, what VTE commits now is typed input */
+};
+
+struct UmeVteClass {
+	VteTerminalClass parent_class;
+};
+
+G_DEFINE_TYPE(UmeVte, ume_vte, VTE_TYPE_TERMINAL)
+
+static void ume_vte_size_allocate(GtkWidget *widget, GtkAllocation *allocation) {
+	UmeVte *self = (UmeVte *)widget;
+	GtkAllocation current;
+	gtk_widget_get_allocation(widget, &current);
+
+	bool resized = current.width != allocation->width || current.height != allocation->height;
+	if (self->allocated && resized && (!gtk_widget_get_mapped(widget) || ume.resize_settle)) {
+		/* The allocation isn't recorded, so GTK hands the same one over again once it's queued */
+		self->pending = true;
+		return;
+	}
+	self->allocated = true;
+	self->pending = false;
+	GTK_WIDGET_CLASS(ume_vte_parent_class)->size_allocate(widget, allocation);
+}
+
+static void ume_vte_map(GtkWidget *widget) {
+	GTK_WIDGET_CLASS(ume_vte_parent_class)->map(widget);
+	if (((UmeVte *)widget)->pending)
+		gtk_widget_queue_allocate(widget);
+}
+
+/* VTE's accessible reports every change of the text once it exists. Nobody would listen to it without
+ * an assistive technology, an object that does nothing is handed out then */
+static AtkObject *ume_vte_get_accessible(GtkWidget *widget) {
+	UmeVte *self = (UmeVte *)widget;
+	if (ume.accessible)
+		return GTK_WIDGET_CLASS(ume_vte_parent_class)->get_accessible(widget);
+	if (!self->no_op_accessible)
+		self->no_op_accessible = atk_no_op_object_new(G_OBJECT(widget));
+	return self->no_op_accessible;
+}
+
+/* VTE looks for a match under the pointer on every motion, the time that takes is in stats as the hover cost */
+static gboolean ume_vte_motion_notify(GtkWidget *widget, GdkEventMotion *event) {
+	latency_scope_t scope(ume.stats.hover);
+	return GTK_WIDGET_CLASS(ume_vte_parent_class)->motion_notify_event(widget, event);
+}
+
+/* VTE commits typed input and its own replies to queries (DA, CPR, DSR) the same way. What it
+ * commits while handling a key press is typed, see ume_term_commit */
+static gboolean ume_vte_key_press(GtkWidget *widget, GdkEventKey *event) {
+	UmeVte *self = (UmeVte *)widget;
+	self->typing = true;
+	gboolean handled = GTK_WIDGET_CLASS(ume_vte_parent_class)->key_press_event(widget, event);
+	self->typing = false;
+	return handled;
+}
+
+static void ume_vte_dispose(GObject *object) {
+	g_clear_object(&((UmeVte *)object)->no_op_accessible);
+	G_OBJECT_CLASS(ume_vte_parent_class)->dispose(object);
+}
+
+static void ume_vte_class_init(UmeVteClass *klass) {
+	G_OBJECT_CLASS(klass)->dispose = ume_vte_dispose;
+	GTK_WIDGET_CLASS(klass)->size_allocate = ume_vte_size_allocate;
+	GTK_WIDGET_CLASS(klass)->map = ume_vte_map;
+	GTK_WIDGET_CLASS(klass)->get_accessible = ume_vte_get_accessible;
+	GTK_WIDGET_CLASS(klass)->motion_notify_event = ume_vte_motion_notify;
+	GTK_WIDGET_CLASS(klass)->key_press_event = ume_vte_key_press;
+}
+
+static void ume_vte_init(UmeVte *self) {}
+
+static gboolean ume_resize_settled(gpointer data) {
+	ume.resize_settle = 0;
+	struct terminal *term = ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+	if (term && term->vte && ((UmeVte *)term->vte)->pending)
+		gtk_widget_queue_allocate(term->vte);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean ume_resized_window(GtkWidget *widget, GdkEventConfigure *event, void *data) {
+	if ((guint)event->width != ume.width || (guint)event->height != ume.height) { // NOTE: configure events are?
+		// SAY("Configure event received. Current w %d h %d ConfigureEvent w %d h %d",
+		// ume.width, ume.height, event->width, event->height);
+		ume.resized = true;
+	}
+
+	/* Dragging the window edge sends a stream of these, restart the wait on every new size */
+	if (event->width != ume.configured_width || event->height != ume.configured_height) {
+		ume.configured_width = event->width;
+		ume.configured_height = event->height;
+		if (ume.resize_settle)
+			g_source_remove(ume.resize_settle);
+		ume.resize_settle = g_timeout_add(RESIZE_SETTLE_MS, ume_resize_settled, NULL);
+	}
+	return false;
+}
+
+static void ume_setname_entry_changed(GtkWidget *widget, void *data) {
+	GtkDialog *title_dialog = (GtkDialog *)data;
+
+	if (strcmp(gtk_entry_get_text(GTK_ENTRY(widget)), "") == 0) {
+		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, false);
+	} else {
+		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, true);
+	}
+}
+
+/* Parameters are never used */
+static void ume_copy(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+
+	vte_terminal_copy_clipboard_format(VTE_TERMINAL(term->vte), VTE_FORMAT_TEXT);
+}
+
+/******* Row reader ********/
+/* Reads a range of rows out of a tab in slices from an idle callback, so even a full
+ * scrollback never stalls the window. consume gets each slice, returning false stops the
+ * reader early. done is called exactly once, after which the reader is freed. */
+struct row_reader_t {
+	GtkWidget *hbox; /* Referenced, keeps the tab's widgets alive while reading */
+	glong next_row, end_row;
+	GArray *attributes; /* VteCharAttributes of each slice, NULL when only text is wanted */
+	guint idle_id;
+	bool (*consume)(row_reader_t *, const char *text, gsize len);
+	void (*done)(row_reader_t *, bool complete);
+	gpointer data;
+};
+
+/* Rows currently held by a tab, scrollback included: [*first, *end). Either may be NULL */
+static void ume_term_row_bounds(struct terminal *term, glong *first, glong *end) {
+	GtkAdjustment *adjust = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+	if (first)
+		*first = (glong)gtk_adjustment_get_lower(adjust);
+	if (end)
+		*end = (glong)gtk_adjustment_get_upper(adjust);
+}
+
+static void ume_row_reader_free(row_reader_t *reader, bool complete) {
+	if (reader->idle_id)
+		g_source_remove(reader->idle_id);
+	reader->idle_id = 0;
+	reader->done(reader, complete);
+
+	if (reader->attributes)
+		g_array_unref(reader->attributes);
+	g_object_unref(reader->hbox);
+	g_free(reader);
+}
+
+/* Reads one slice. Returns false once there's nothing more to read */
+static bool ume_row_reader_step(row_reader_t *reader, bool *complete) {
+	struct terminal *term = (struct terminal *)g_object_get_qdata(G_OBJECT(reader->hbox), term_data_id);
+	*complete = reader->next_row >= reader->end_row;
+	if (*complete)
+		return false;
+	if (!term || !gtk_widget_get_parent(reader->hbox)) /* Tab closed meanwhile */
+		return false;
+
+	VteTerminal *vte = VTE_TERMINAL(term->vte);
+	glong last_row = MIN(reader->next_row + ROW_READER_SLICE, reader->end_row) - 1;
+	if (reader->attributes)
+		g_array_set_size(reader->attributes, 0);
+
+	char *text = vte_terminal_get_text_range(vte, reader->next_row, 0, last_row, vte_terminal_get_column_count(vte),
+																					 NULL, NULL, reader->attributes);
+	reader->next_row = last_row + 1;
+	bool more = reader->consume(reader, text ? text : "", text ? strlen(text) : 0);
+	g_free(text);
+
+	*complete = reader->next_row >= reader->end_row;
+	return more && !*complete;
+}
+
+static gboolean ume_row_reader_idle(gpointer data) {
+	row_reader_t *reader = (row_reader_t *)data;
+	bool complete;
+
+	if (ume_row_reader_step(reader, &complete))
+		return G_SOURCE_CONTINUE;
+
+	reader->idle_id = 0;
+	ume_row_reader_free(reader, complete);
+	return G_SOURCE_REMOVE;
+}
+
+static row_reader_t *ume_row_reader_new(struct terminal *term, glong first_row, glong end_row, bool with_attributes,
+																				bool (*consume)(row_reader_t *, const char *, gsize),
+																				void (*done)(row_reader_t *, bool), gpointer data) {
+	row_reader_t *reader = g_new0(row_reader_t, 1);
+	reader->hbox = GTK_WIDGET(g_object_ref(term->hbox));
+	reader->next_row = first_row;
+	reader->end_row = end_row;
+	if (with_attributes)
+		reader->attributes = g_array_new(false, false, sizeof(VteCharAttributes));
+	reader->consume = consume;
+	reader->done = done;
+	reader->data = data;
+	return reader;
+}
+
+/* Reads everything from an idle callback. Readers not started are driven with ume_row_reader_step */
+static void ume_row_reader_start(row_reader_t *reader) {
+	reader->idle_id = g_idle_add(ume_row_reader_idle, reader);
+}
+
+/* Reads whatever is left right now, for callers that can't wait */
+static void ume_row_reader_finish(row_reader_t *reader) {
+	bool complete;
+	while (ume_row_reader_step(reader, &complete))
+		;
+	ume_row_reader_free(reader, complete);
+}
+
+static void ume_row_reader_cancel(row_reader_t *reader) {
+	ume_row_reader_free(reader, false);
+}
+
+/******* Range copy ********/
+/* A range copy owns the clipboard from the moment it's requested. The text is gathered by a
+ * row reader in the background and only handed out when another client asks for it. */
+struct range_copy_t {
+	row_reader_t *reader; /* NULL once all the text is in */
+	GString *text;
+	bool truncated;
+};
+
+static bool ume_range_copy_consume(row_reader_t *reader, const char *text, gsize len) {
+	range_copy_t *copy = (range_copy_t *)reader->data;
+
+	if (copy->text->len + len > COPY_MAX_BYTES) {
+		const char *cut = text + (COPY_MAX_BYTES - copy->text->len);
+		/* Don't leave half a character behind */
+		if (cut > text && (*cut & 0xC0) == 0x80)
+			cut = g_utf8_find_prev_char(text, cut);
+		g_string_append_len(copy->text, text, cut ? cut - text : 0);
+		copy->truncated = true;
+		return false;
+	}
+	g_string_append_len(copy->text, text, len);
+	return true;
+}
+
+static void ume_range_copy_done(row_reader_t *reader, bool complete) {
+	range_copy_t *copy = (range_copy_t *)reader->data;
+	copy->reader = NULL;
+	if (copy->truncated)
+		SAY("Copy truncated to %" G_GSIZE_FORMAT " bytes", copy->text->len);
+}
+
+static void ume_range_copy_get(GtkClipboard *clipboard, GtkSelectionData *selection, guint info, gpointer data) {
+	range_copy_t *copy = (range_copy_t *)data;
+
+	/* Requested before the reader got through it all, nothing to do but finish here */
+	if (copy->reader)
+		ume_row_reader_finish(copy->reader);
+	gtk_selection_data_set_text(selection, copy->text->str, copy->text->len);
+}
+
+/* Someone else owns the clipboard now, drop the text */
+static void ume_range_copy_clear(GtkClipboard *clipboard, gpointer data) {
+	range_copy_t *copy = (range_copy_t *)data;
+
+	if (copy->reader)
+		ume_row_reader_cancel(copy->reader);
+	g_string_free(copy->text, true);
+	g_free(copy);
+}
+
+static void ume_term_copy_rows(struct terminal *term, glong first_row, glong end_row) {
+	GtkClipboard *clipboard = gtk_widget_get_clipboard(term->vte, GDK_SELECTION_CLIPBOARD);
+	GtkTargetList *list = gtk_target_list_new(NULL, 0);
+	gint n_targets;
+
+	gtk_target_list_add_text_targets(list, 0);
+	GtkTargetEntry *targets = gtk_target_table_new_from_list(list, &n_targets);
+
+	range_copy_t *copy = g_new0(range_copy_t, 1);
+	copy->text = g_string_new(NULL);
+	if (gtk_clipboard_set_with_data(clipboard, targets, n_targets, ume_range_copy_get, ume_range_copy_clear, copy)) {
+		copy->reader = ume_row_reader_new(term, first_row, end_row, false, ume_range_copy_consume, ume_range_copy_done, copy);
+		ume_row_reader_start(copy->reader);
+	} else {
+		g_string_free(copy->text, true);
+		g_free(copy);
+	}
+
+	gtk_target_table_free(targets, n_targets);
+	gtk_target_list_unref(list);
+}
+
+static void ume_copy_scrollback(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+	glong first, end;
+
+	ume_term_row_bounds(term, &first, &end);
+	ume_term_copy_rows(term, first, end);
+}
+
+static void ume_copy_last_output(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+	glong first, end;
+
+	if (!ume_term_last_output(term, &first, &end)) {
+		gtk_widget_error_bell(term->vte);
+		return;
+	}
+	ume_term_copy_rows(term, first, end);
+}
+
+static void ume_copy_last_lines(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+	glong first, end;
+
+	ume_term_row_bounds(term, &first, &end);
+	ume_term_copy_rows(term, MAX(first, end - ume.config.copy_last_lines), end);
+}
+
+/******* Scrollback export ********/
+/* Streams a range of rows to a file, one slice at a time: the next slice is only read once
+ * the previous one has been written, so neither the text nor the disk holds up the window */
+struct scrollback_export_t {
+	row_reader_t *reader; /* NULL once all rows have been read */
+	GOutputStream *out;
+	GString *chunk; /* Slice being written, converted to HTML if needed */
+	gchar *path;
+	bool html;
+	bool interactive; /* Started from the UI, errors get a dialog */
+
+	/* Attributes of the open HTML span */
+	bool span_open;
+	VteCharAttributes span;
+};
+
+static void ume_export_next(scrollback_export_t *);
+
+static bool ume_export_same_attributes(const VteCharAttributes *a, const VteCharAttributes *b) {
+	return a->fore.red == b->fore.red && a->fore.green == b->fore.green && a->fore.blue == b->fore.blue &&
+				 a->back.red == b->back.red && a->back.green == b->back.green && a->back.blue == b->back.blue &&
+				 a->underline == b->underline && a->strikethrough == b->strikethrough;
+}
+
+/* VTE gives one VteCharAttributes per byte of text */
+static void ume_export_html_slice(scrollback_export_t *exp, const char *text, gsize len, GArray *attributes) {
+	for (const char *c = text; c < text + len; c = g_utf8_next_char(c)) {
+		gsize offset = c - text;
+		if (offset < attributes->len && *c != '\n') {
+			const VteCharAttributes *attr = &g_array_index(attributes, VteCharAttributes, offset);
+			if (!exp->span_open || !ume_export_same_attributes(attr, &exp->span)) {
+				if (exp->span_open)
+					g_string_append(exp->chunk, "</span>");
+				g_string_append_printf(exp->chunk, "<span style=\"color:#%02x%02x%02x;background-color:#%02x%02x%02x",
+															 attr->fore.red >> 8, attr->fore.green >> 8, attr->fore.blue >> 8, attr->back.red >> 8,
+															 attr->back.green >> 8, attr->back.blue >> 8);
+				if (attr->underline || attr->strikethrough)
+					g_string_append_printf(exp->chunk, ";text-decoration:%s%s", attr->underline ? "underline " : "",
+																 attr->strikethrough ? "line-through" : "");
+				g_string_append(exp->chunk, "\">");
+				exp->span = *attr;
+				exp->span_open = true;
+			}
+		}
+
+		switch (*c) {
+			case '<':
+				g_string_append(exp->chunk, "&lt;");
+				break;
+			case '>':
+				g_string_append(exp->chunk, "&gt;");
+				break;
+			case '&':
+				g_string_append(exp->chunk, "&amp;");
+				break;
+			default:
+				g_string_append_len(exp->chunk, c, g_utf8_next_char(c) - c);
+		}
+	}
+}
+
+static bool ume_export_consume(row_reader_t *reader, const char *text, gsize len) {
+	scrollback_export_t *exp = (scrollback_export_t *)reader->data;
+
+	if (exp->html)
+		ume_export_html_slice(exp, text, len, reader->attributes);
+	else
+		g_string_append_len(exp->chunk, text, len);
+	return true;
+}
+
+static void ume_export_read_done(row_reader_t *reader, bool complete) {
+	scrollback_export_t *exp = (scrollback_export_t *)reader->data;
+	exp->reader = NULL;
+
+	if (exp->html)
+		g_string_append_printf(exp->chunk, "%s</pre></body></html>\n", exp->span_open ? "</span>" : "");
+}
+
+static void ume_export_free(scrollback_export_t *exp) {
+	if (exp->reader)
+		ume_row_reader_cancel(exp->reader);
+	g_object_unref(exp->out);
+	g_string_free(exp->chunk, true);
+	g_free(exp->path);
+	g_free(exp);
+}
+
+static void ume_export_failed(scrollback_export_t *exp, GError *error) {
+	if (exp->interactive)
+		ume_error(_("Cannot save scrollback to %s: %s"), exp->path, error->message);
+	else
+		SAY("Cannot save scrollback to %s: %s", exp->path, error->message);
+	g_error_free(error);
+	ume_export_free(exp);
+}
+
+static void ume_export_closed(GObject *source, GAsyncResult *result, gpointer data) {
+	scrollback_export_t *exp = (scrollback_export_t *)data;
+	GError *error = NULL;
+
+	if (!g_output_stream_close_finish(G_OUTPUT_STREAM(source), result, &error)) {
+		ume_export_failed(exp, error);
+		return;
+	}
+	SAY("Saved scrollback to %s", exp->path);
+	ume_export_free(exp);
+}
+
+static void ume_export_written(GObject *source, GAsyncResult *result, gpointer data) {
+	scrollback_export_t *exp = (scrollback_export_t *)data;
+	GError *error = NULL;
+
+	if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, NULL, &error)) {
+		ume_export_failed(exp, error);
+		return;
+	}
+	g_string_truncate(exp->chunk, 0);
+	ume_export_next(exp);
+}
+
+static void ume_export_next(scrollback_export_t *exp) {
+	while (exp->chunk->len == 0 && exp->reader) {
+		bool complete;
+		if (!ume_row_reader_step(exp->reader, &complete))
+			ume_row_reader_free(exp->reader, complete);
+	}
+
+	if (exp->chunk->len > 0) {
+		g_output_stream_write_all_async(exp->out, exp->chunk->str, exp->chunk->len, G_PRIORITY_LOW, NULL,
+																		ume_export_written, exp);
+	} else {
+		g_output_stream_close_async(exp->out, G_PRIORITY_LOW, NULL, ume_export_closed, exp);
+	}
+}
+
+/* Saves rows [first_row, end_row) of a tab to path, as HTML with colors or plain text,
+ * optionally gzipped. Returns once the file is open, the rest happens in the background */
+static bool ume_term_export(struct terminal *term, const char *path, bool html, bool gzip, glong first_row,
+														glong end_row, bool interactive, GError **error) {
+	GFile *file = g_file_new_for_path(path);
+	GFileOutputStream *file_out = g_file_replace(file, NULL, false, G_FILE_CREATE_NONE, NULL, error);
+	g_object_unref(file);
+	if (!file_out)
+		return false;
+
+	scrollback_export_t *exp = g_new0(scrollback_export_t, 1);
+	exp->path = g_strdup(path);
+	exp->html = html;
+	exp->interactive = interactive;
+	exp->chunk = g_string_new(NULL);
+	if (gzip) {
+		GZlibCompressor *compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+		exp->out = g_converter_output_stream_new(G_OUTPUT_STREAM(file_out), G_CONVERTER(compressor));
+		g_object_unref(compressor);
+		g_object_unref(file_out);
+	} else {
+		exp->out = G_OUTPUT_STREAM(file_out);
+	}
+
+	if (html) {
+		gchar *title = g_markup_escape_text(gtk_label_get_text(GTK_LABEL(term->label)), -1);
+		g_string_append_printf(exp->chunk,
+													 "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>%s</title></head>\n"
+													 "<body><pre style=\"font-family:monospace\">",
+													 title);
+		g_free(title);
+	}
+
+	exp->reader = ume_row_reader_new(term, first_row, end_row, html, ume_export_consume, ume_export_read_done, exp);
+	ume_export_next(exp);
+	return true;
+}
+
+/* Format follows the file name: .html or .htm for HTML, a trailing .gz for gzip */
+static void ume_export_format_from_path(const char *path, bool *html, bool *gzip) {
+	gchar *lower = g_ascii_strdown(path, -1);
+	*gzip = g_str_has_suffix(lower, ".gz");
+	if (*gzip)
+		lower[strlen(lower) - 3] = '\0';
+	*html = g_str_has_suffix(lower, ".html") || g_str_has_suffix(lower, ".htm");
+	g_free(lower);
+}
+
+/* First row to export, the mark if asked for and it's still in the scrollback */
+static glong ume_term_export_start(struct terminal *term, bool since_mark) {
+	glong first, end;
+	ume_term_row_bounds(term, &first, &end);
+	return since_mark && term->has_mark ? CLAMP(term->mark_row, first, end) : first;
+}
+
+static void ume_set_mark(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+	glong column;
+
+	vte_terminal_get_cursor_position(VTE_TERMINAL(term->vte), &column, &term->mark_row);
+	term->has_mark = true;
+}
+
+static void ume_save_scrollback_dialog(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+
+	GtkWidget *dialog = gtk_file_chooser_dialog_new(_("Save scrollback"), GTK_WINDOW(ume.main_window),
+																									GTK_FILE_CHOOSER_ACTION_SAVE, _("_Cancel"), GTK_RESPONSE_CANCEL,
+																									_("_Save"), GTK_RESPONSE_ACCEPT, NULL);
+	gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), true);
+	gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "scrollback.txt");
+
+	GtkWidget *since_mark = gtk_check_button_new_with_label(_("Only since the mark"));
+	gtk_widget_set_sensitive(since_mark, term->has_mark);
+	gtk_file_chooser_set_extra_widget(GTK_FILE_CHOOSER(dialog), since_mark);
+
+	if (ume_dialog_run(dialog, "ume_save_scrollback_dialog") == GTK_RESPONSE_ACCEPT) {
+		GError *error = NULL;
+		gchar *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+		bool html, gzip;
+		glong end;
+
+		ume_export_format_from_path(path, &html, &gzip);
+		ume_term_row_bounds(term, NULL, &end);
+		glong first = ume_term_export_start(term, gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(since_mark)));
+		if (!ume_term_export(term, path, html, gzip, first, end, true, &error)) {
+			ume_error(_("Cannot save scrollback to %s: %s"), path, error->message);
+			g_error_free(error);
+		}
+		g_free(path);
+	}
+	gtk_widget_destroy(dialog);
+}
+
+/******* Runtime state ********/
+/* $XDG_STATE_HOME/ume, for things worth keeping that aren't configuration */
+static gchar *ume_state_dir() {
+	const gchar *state_home = g_getenv("XDG_STATE_HOME");
+	if (state_home && g_path_is_absolute(state_home))
+		return g_build_filename(state_home, "ume", NULL);
+	return g_build_filename(g_get_home_dir(), ".local", "state", "ume", NULL);
+}
+
+static gchar *ume_state_path() {
+	gchar *dir = ume_state_dir();
+	gchar *path = g_build_filename(dir, STATE_FILE, NULL);
+	g_free(dir);
+	return path;
+}
+
+/* Records a change of runtime state, a few bytes appended to the journal */
+static void ume_state_set(const char *key, gint value) {
+	gchar *dir = ume_state_dir();
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	gchar *path = ume_state_path();
+	gchar text[16];
+	snprintf(text, sizeof(text), "%d", value);
+	if (!state_journal_t::append(path, key, text))
+		SAY("Cannot write state to %s", path);
+	g_free(path);
+}
+
+/* Merges the journal into a freshly loaded config */
+static void ume_state_load(config_t &config) {
+	gchar *path = ume_state_path();
+	GHashTable *state = state_journal_t::read(path);
+	g_free(path);
+
+	config.last_colorset = 1;
+	const gchar *colorset = state ? (const gchar *)g_hash_table_lookup(state, "last_colorset") : NULL;
+	if (colorset) {
+		gint cs = atoi(colorset);
+		if (cs > 0 && cs <= NUM_COLORSETS)
+			config.last_colorset = cs;
+	} else if (ume.cfg_file && g_key_file_has_key(ume.cfg_file, cfg_group, "last_colorset", NULL)) {
+		/* Kept in the config file by older versions, moved over once */
+		gint cs = g_key_file_get_integer(ume.cfg_file, cfg_group, "last_colorset", NULL);
+		if (cs > 0 && cs <= NUM_COLORSETS) {
+			config.last_colorset = cs;
+			ume_state_set("last_colorset", cs);
+		}
+	}
+
+	if (state)
+		g_hash_table_unref(state);
+}
+
+/******* Output logging ********/
+static void ume_term_log_start(struct terminal *term) {
+	static guint log_count = 0;
+	gchar *dir;
+
+	if (term->log)
+		return;
+
+	if (ume.config.log_directory && ume.config.log_directory[0]) {
+		dir = g_strdup(ume.config.log_directory);
+	} else {
+		gchar *state_dir = ume_state_dir();
+		dir = g_build_filename(state_dir, "logs", NULL);
+		g_free(state_dir);
+	}
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		SAY("Cannot create log directory %s", dir);
+		g_free(dir);
+		return;
+	}
+
+	gchar *name = g_strdup_printf("ume-%d-%u", getpid(), ++log_count);
+	gchar *base = g_build_filename(dir, name, NULL);
+	term->log = session_log_t::start(base, ume.config.log_compress, LOG_RING_SIZE,
+																	 (gsize)MAX(ume.config.log_max_size, 0) * 1024 * 1024,
+																	 (gint64)MAX(ume.config.log_rotate_minutes, 0) * 60 * G_USEC_PER_SEC);
+	g_free(base);
+	g_free(name);
+	g_free(dir);
+}
+
+static void ume_term_log_stop(struct terminal *term) {
+	if (term->log) {
+		session_log_t::stop(term->log);
+		term->log = NULL;
+	}
+}
+
+static void ume_log_output(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+	bool active = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+
+	/* Also called when the popup syncs the item with the current tab */
+	if (active && !term->log)
+		ume_term_log_start(term);
+	else if (!active && term->log)
+		ume_term_log_stop(term);
+}
+
+static void ume_fast_render(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	struct terminal *term = ume_get_page_term(ume, page);
+	bool active = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+
+	/* Also called when the popup syncs the item with the current tab */
+	if (active != term->fast_render)
+		ume_term_set_fast_render(term, active);
+}
+
+/* Writers finish on their own, give them a moment to flush before the process goes away */
+static void ume_log_wait_writers() {
+	gint64 deadline = g_get_monotonic_time() + LOG_EXIT_WAIT_MS * 1000;
+	while (session_log_t::writers().load() > 0 && g_get_monotonic_time() < deadline)
+		g_usleep(10 * 1000);
+}
+
+/******* Persistent tabs ********/
+/* The shells of persistent tabs run under `ume --holder` (see holder.h) and survive the GUI */
+static gchar *ume_holder_path() {
+	gchar *dir = ume_ctl_dir();
+	gchar *path = g_build_filename(dir, HOLDER_SOCKET, NULL);
+	g_free(dir);
+	return path;
+}
+
+/* Non-blocking connection to the holder, -1 when none listens */
+static int ume_holder_socket() {
+	struct sockaddr_un addr;
+	gchar *path = ume_holder_path();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		g_free(path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	g_free(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/* Runs `ume --holder`, it listens on its socket a moment later */
+static bool ume_holder_start() {
+	gchar *exe = g_file_read_link("/proc/self/exe", NULL);
+	gchar *argv[] = {exe, (gchar *)"--holder", NULL};
+	GError *error = NULL;
+	gchar *dir = ume_ctl_dir();
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+	if (!exe || !g_spawn_async(NULL, argv, NULL, (GSpawnFlags)(G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL),
+														 NULL, NULL, NULL, &error)) {
+		SAY("Cannot start the session holder: %s", error ? error->message : "no executable");
+		if (error)
+			g_error_free(error);
+		g_free(exe);
+		return false;
+	}
+	g_free(exe);
+	return true;
+}
+
+static void ume_holder_field(GString *request, const char *field) {
+	gchar *escaped = g_strescape(field ? field : "", NULL);
+	if (request->len)
+		g_string_append_c(request, '\t');
+	g_string_append(request, escaped);
+	g_free(escaped);
+}
+
+/* A spawn or attach on its way to the holder. The GUI never waits for it: connecting, starting a
+ * holder, sending the request and reading the reply each happen when their source fires */
+struct holder_open_t {
+	struct terminal *term;
+	GString *request;
+	gsize sent;
+	int fd;
+	bool start;			 /* Start a holder when none listens */
+	gint64 deadline; /* For the started holder to listen, 0 before one was started */
+	guint watch, timer;
+	/* What a spawn runs without the holder. An attach (NULL argv) falls back to the saved scrollback */
+	gchar *cwd;
+	gchar **argv, **envv;
+	GSpawnFlags flags;
+};
+
+static void ume_holder_open_free(holder_open_t *open) {
+	if (open->watch)
+		g_source_remove(open->watch);
+	if (open->timer)
+		g_source_remove(open->timer);
+	if (open->fd >= 0)
+		close(open->fd);
+	/* A failed attach may have gone on to a spawn of its own already */
+	if (open->term->holder_open == open)
+		open->term->holder_open = NULL;
+	g_string_free(open->request, true);
+	g_free(open->cwd);
+	g_strfreev(open->argv);
+	g_strfreev(open->envv);
+	g_free(open);
+}
+
+/* The tab goes on without the holder */
+static void ume_holder_open_failed(holder_open_t *open) {
+	struct terminal *term = open->term;
+	SAY("Session holder refused %s", open->request->str);
+	if (open->watch)
+		g_source_remove(open->watch);
+	if (open->timer)
+		g_source_remove(open->timer);
+	open->watch = open->timer = 0;
+
+	if (open->argv) {
+		ume_term_spawn_local(term, open->cwd, open->argv, open->envv, open->flags);
+	} else {
+		term->held_id = 0;
+		ume_term_start_local(term);
+	}
+	ume_holder_open_free(open);
+}
+
+/* Makes the tab the client of the session in the reply */
+static void ume_holder_open_replied(holder_open_t *open) {
+	struct terminal *term = open->term;
+	holder_reply_t reply;
+	int master = -1;
+
+	if (!holder_recv_fd(open->fd, &reply, sizeof(reply), &master) || !reply.ok || master < 0) {
+		if (master >= 0)
+			close(master);
+		ume_holder_open_failed(open);
+		return;
+	}
+
+	GError *error = NULL;
+	term->pty = vte_pty_new_foreign_sync(master, NULL, &error);
+	if (!term->pty) {
+		SAY("Cannot use the holder's pty: %s", error->message);
+		g_error_free(error);
+		close(master);
+		ume_holder_open_failed(open);
+		return;
+	}
+
+	/* Input and resizing go straight to the PTY, output comes through the holder */
+	term->pty_fd = master;
+	term->read_fd = open->fd;
+	open->fd = -1;
+	term->held_id = reply.id;
+	term->pid = reply.pid;
+	g_unix_set_fd_nonblocking(master, true, NULL);
+	ume_term_sync_pty_size(term);
+	term->pty_watch = g_unix_fd_add_full(G_PRIORITY_DEFAULT_IDLE, term->read_fd,
+																			 (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), ume_pty_readable, term, NULL);
+	ume_holder_open_free(open);
+}
+
+static gboolean ume_holder_open_io(gint fd, GIOCondition condition, gpointer data);
+
+/* Waits for the socket to take the rest of the request, then for the reply */
+static void ume_holder_open_wait(holder_open_t *open) {
+	GIOCondition condition = open->sent < open->request->len ? G_IO_OUT : G_IO_IN;
+	open->watch = g_unix_fd_add(open->fd, (GIOCondition)(condition | G_IO_HUP | G_IO_ERR), ume_holder_open_io, open);
+}
+
+static gboolean ume_holder_open_io(gint fd, GIOCondition condition, gpointer data) {
+	holder_open_t *open = (holder_open_t *)data;
+	open->watch = 0;
+
+	if (open->sent == open->request->len) {
+		ume_holder_open_replied(open);
+		return G_SOURCE_REMOVE;
+	}
+
+	gssize sent = send(fd, open->request->str + open->sent, open->request->len - open->sent, MSG_NOSIGNAL);
+	if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+		ume_holder_open_failed(open);
+		return G_SOURCE_REMOVE;
+	}
+	if (sent > 0)
+		open->sent += sent;
+	ume_holder_open_wait(open);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean ume_holder_open_timeout(gpointer data) {
+	holder_open_t *open = (holder_open_t *)data;
+	open->timer = 0;
+	ume_holder_open_failed(open);
+	return G_SOURCE_REMOVE;
+}
+
+/* Connects, starting a holder first if the request may. Runs again every HOLDER_RETRY_MS until the
+ * started holder listens */
+static gboolean ume_holder_open_connect(gpointer data) {
+	holder_open_t *open = (holder_open_t *)data;
+	open->fd = ume_holder_socket();
+	if (open->fd < 0 && open->start && !open->deadline) {
+		if (!ume_holder_start()) {
+			ume_holder_open_failed(open);
+			return G_SOURCE_REMOVE;
+		}
+		open->deadline = g_get_monotonic_time() + HOLDER_START_WAIT_MS * 1000;
+	}
+	if (open->fd < 0 && open->deadline && g_get_monotonic_time() < open->deadline) {
+		if (!open->timer)
+			open->timer = g_timeout_add(HOLDER_RETRY_MS, ume_holder_open_connect, open);
+		return G_SOURCE_CONTINUE;
+	}
+
+	open->timer = 0;
+	if (open->fd < 0) {
+		ume_holder_open_failed(open);
+		return G_SOURCE_REMOVE;
+	}
+	open->timer = g_timeout_add(HOLDER_TIMEOUT_MS, ume_holder_open_timeout, open);
+	ume_holder_open_wait(open);
+	return G_SOURCE_REMOVE;
+}
+
+/* Sends request on its way, the tab becomes the client of the session in the reply */
+static void ume_holder_open(struct terminal *term, holder_open_t *open, GString *request, bool start) {
+	g_string_append_c(request, '\n');
+	open->term = term;
+	open->request = request;
+	open->fd = -1;
+	open->start = start;
+	term->holder_open = open;
+	ume_holder_open_connect(open);
+}
+
+static void ume_holder_spawn(struct terminal *term, const char *cwd, char **argv, char **envv, GSpawnFlags flags) {
+	GString *request = g_string_new(NULL);
+	gchar *number;
+
+	ume_holder_field(request, "spawn");
+	number = g_strdup_printf("%ld", vte_terminal_get_row_count(VTE_TERMINAL(term->vte)));
+	ume_holder_field(request, number);
+	g_free(number);
+	number = g_strdup_printf("%ld", vte_terminal_get_column_count(VTE_TERMINAL(term->vte)));
+	ume_holder_field(request, number);
+	g_free(number);
+	ume_holder_field(request, cwd);
+
+	guint envc = 0;
+	if (envv)
+		envc = g_strv_length(envv);
+	number = g_strdup_printf("%u", envc);
+	ume_holder_field(request, number);
+	g_free(number);
+	for (guint i = 0; i < envc; ++i)
+		ume_holder_field(request, envv[i]);
+
+	/* The holder always searches PATH */
+	ume_holder_field(request, argv[0]);
+	for (char **arg = (flags & G_SPAWN_FILE_AND_ARGV_ZERO) ? argv + 1 : argv; *arg; ++arg)
+		ume_holder_field(request, *arg);
+
+	holder_open_t *open = g_new0(holder_open_t, 1);
+	open->cwd = g_strdup(cwd);
+	open->argv = g_strdupv(argv);
+	open->envv = g_strdupv(envv);
+	open->flags = flags;
+	ume_holder_open(term, open, request, true);
+}
+
+static void ume_holder_attach(struct terminal *term, guint32 id) {
+	GString *request = g_string_new(NULL);
+	gchar *number = g_strdup_printf("%u", id);
+	ume_holder_field(request, "attach");
+	ume_holder_field(request, number);
+	g_free(number);
+
+	/* Attaching never starts a holder, there'd be nothing to attach to */
+	ume_holder_open(term, g_new0(holder_open_t, 1), request, false);
+}
+
+/* Adds a tab for every session the holder has without a client, e.g. after a crash. Tabs
+ * restored from the saved session already claimed theirs. Returns how many were added */
+static gint ume_holder_reattach() {
+	int fd = ume_holder_socket();
+	if (fd < 0)
+		return 0;
+
+	/* Runs before the main loop and decides which tabs there are, so it waits for the list. Not
+	 * longer than HOLDER_TIMEOUT_MS though */
+	struct timeval timeout = {HOLDER_TIMEOUT_MS / 1000, (HOLDER_TIMEOUT_MS % 1000) * 1000};
+	g_unix_set_fd_nonblocking(fd, false, NULL);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	GString *sessions = g_string_new(NULL);
+	char buf[1024];
+	gssize len;
+	if (send(fd, "list\n", 5, MSG_NOSIGNAL) == 5) {
+		while ((len = recv(fd, buf, sizeof(buf), 0)) > 0)
+			g_string_append_len(sessions, buf, len);
+	}
+	close(fd);
+
+	gint added = 0;
+	gchar **lines = g_strsplit(sessions->str, "\n", -1);
+	for (gchar **line = lines; *line; ++line) {
+		guint32 id;
+		gint pid, attached;
+		if (sscanf(*line, "%u\t%d\t%d", &id, &pid, &attached) != 3 || attached)
+			continue;
+
+		bool claimed = false;
+		gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+		for (gint page = 0; page < npages && !claimed; ++page)
+			claimed = ume_get_page_term(ume, page)->held_id == id;
+		if (claimed)
+			continue;
+
+		session_tab_t tab = {};
+		tab.held_id = id;
+		tab.colorset = ume.config.last_colorset - 1;
+		ume_add_tab(&tab);
+		++added;
+	}
+	g_strfreev(lines);
+	g_string_free(sessions, true);
+	return added;
+}
+
+/******* Sessions ********/
+/* A checkpoint gathers every tab on the main thread, reading the scrollback of tabs that printed
+ * something since the last one in idle slices. Compressing and writing happen in a thread. */
+struct session_checkpoint_t {
+	GPtrArray *tabs;		 /* session_tab_t, in notebook order */
+	GPtrArray *captures; /* session_capture_t of the tabs whose scrollback is read anew */
+	guint32 current;
+	guint reading; /* Row readers still running, plus one while the checkpoint is being set up */
+	bool now;			 /* Exiting, do everything before returning */
+	guint generation;
+};
+
+struct session_capture_t {
+	session_checkpoint_t *checkpoint;
+	session_tab_t *tab;
+	GtkWidget *hbox; /* Referenced, the new scrollback is kept on the tab if it's still open */
+	GString *text;
+	guint64 bytes_read;
+};
+
+static gchar *ume_session_path() {
+	gchar *dir = ume_state_dir();
+	gchar *path = g_build_filename(dir, "session", NULL);
+	g_free(dir);
+	return path;
+}
+
+static void ume_session_checkpoint_free(session_checkpoint_t *checkpoint) {
+	for (guint i = 0; i < checkpoint->captures->len; ++i) {
+		session_capture_t *capture = (session_capture_t *)g_ptr_array_index(checkpoint->captures, i);
+		g_object_unref(capture->hbox);
+		g_string_free(capture->text, true);
+		g_free(capture);
+	}
+	g_ptr_array_unref(checkpoint->captures);
+	g_ptr_array_unref(checkpoint->tabs);
+	g_free(checkpoint);
+}
+
+/* Runs in a thread unless exiting. Checkpoints may overlap (the exit one with a periodic one),
+ * an older one finishing last must not replace a newer file */
+static void ume_session_write(session_checkpoint_t *checkpoint) {
+	static GMutex lock;
+	static guint written_generation;
+	GError *error = NULL;
+
+	for (guint i = 0; i < checkpoint->captures->len; ++i) {
+		session_capture_t *capture = (session_capture_t *)g_ptr_array_index(checkpoint->captures, i);
+		capture->tab->scrollback = session_file_t::deflate(capture->text->str, capture->text->len);
+	}
+
+	g_mutex_lock(&lock);
+	if (checkpoint->generation > written_generation) {
+		gchar *path = ume_session_path();
+		gchar *dir = g_path_get_dirname(path);
+		g_mkdir_with_parents(dir, 0700);
+		if (session_file_t::write(path, checkpoint->tabs, checkpoint->current, &error)) {
+			written_generation = checkpoint->generation;
+		} else {
+			g_warning("Cannot save the session: %s", error->message);
+			g_error_free(error);
+		}
+		g_free(dir);
+		g_free(path);
+	}
+	g_mutex_unlock(&lock);
+}
+
+/* Back on the main thread: tabs that printed nothing meanwhile reuse what was just compressed */
+static void ume_session_written(session_checkpoint_t *checkpoint) {
+	for (guint i = 0; i < checkpoint->captures->len; ++i) {
+		session_capture_t *capture = (session_capture_t *)g_ptr_array_index(checkpoint->captures, i);
+		struct terminal *term = (struct terminal *)g_object_get_qdata(G_OBJECT(capture->hbox), term_data_id);
+		if (!term || !capture->tab->scrollback)
+			continue;
+		if (term->session_scrollback)
+			g_bytes_unref(term->session_scrollback);
+		term->session_scrollback = g_bytes_ref(capture->tab->scrollback);
+		term->session_bytes_read = capture->bytes_read;
+	}
+	if (!checkpoint->now)
+		ume.session_saving = false;
+	ume_session_checkpoint_free(checkpoint);
+}
+
+static void ume_session_write_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+	ume_session_write((session_checkpoint_t *)data);
+	g_task_return_boolean(task, true);
+}
+
+static void ume_session_write_done(GObject *source, GAsyncResult *result, gpointer data) {
+	ume_session_written((session_checkpoint_t *)data);
+}
+
+static void ume_session_read_done(session_checkpoint_t *checkpoint) {
+	if (--checkpoint->reading > 0)
+		return;
+
+	if (checkpoint->now) {
+		ume_session_write(checkpoint);
+		ume_session_written(checkpoint);
+	} else {
+		GTask *task = g_task_new(NULL, NULL, ume_session_write_done, checkpoint);
+		g_task_set_task_data(task, checkpoint, NULL);
+		g_task_run_in_thread(task, ume_session_write_thread);
+		g_object_unref(task);
+	}
+}
+
+static bool ume_session_capture_consume(row_reader_t *reader, const char *text, gsize len) {
+	session_capture_t *capture = (session_capture_t *)reader->data;
+	g_string_append_len(capture->text, text, len);
+	return true;
+}
+
+static void ume_session_capture_done(row_reader_t *reader, bool complete) {
+	session_capture_t *capture = (session_capture_t *)reader->data;
+	ume_session_read_done(capture->checkpoint);
+}
+
+/* Saves tab order, directories, labels set by the user, colorsets and the end of the scrollback.
+ * now is for exiting: the scrollback is read and the file written before returning. */
+static void ume_session_save(bool now) {
+	static guint generation;
+
+	/* The windows of a tmux session are kept by tmux */
+	if (option_tmux)
+		return;
+
+	if (!now && ume.session_saving)
+		return;
+	ume.session_saving = ume.session_saving || !now;
+
+	session_checkpoint_t *checkpoint = g_new0(session_checkpoint_t, 1);
+	checkpoint->tabs = g_ptr_array_new_with_free_func((GDestroyNotify)session_tab_t::free);
+	checkpoint->captures = g_ptr_array_new();
+	gint current = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	checkpoint->current = MAX(current, 0);
+	checkpoint->reading = 1;
+	checkpoint->now = now;
+	checkpoint->generation = ++generation;
+
+	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+	for (gint page = 0; page < npages; ++page) {
+		struct terminal *term = ume_get_page_term(ume, page);
+		session_tab_t *tab = g_new0(session_tab_t, 1);
+		tab->cwd = ume_get_term_cwd(term);
+		tab->colorset = term->colorset;
+		if (term->label_set_byuser) {
+			tab->label = g_strdup(term->label_text);
+			tab->flags |= session_tab_t::LABEL_SET_BYUSER;
+		}
+		if (term->fast_render)
+			tab->flags |= session_tab_t::FAST_RENDER;
+		tab->held_id = term->held_id;
+		g_ptr_array_add(checkpoint->tabs, tab);
+
+		/* Tabs not viewed since the restore can't have anything else */
+		if (term->spawn_pending || (term->session_scrollback && term->session_bytes_read == term->stats.bytes_read)) {
+			if (term->session_scrollback)
+				tab->scrollback = g_bytes_ref(term->session_scrollback);
+			continue;
+		}
+
+		session_capture_t *capture = g_new0(session_capture_t, 1);
+		capture->checkpoint = checkpoint;
+		capture->tab = tab;
+		capture->hbox = GTK_WIDGET(g_object_ref(term->hbox));
+		capture->text = g_string_new(NULL);
+		capture->bytes_read = term->stats.bytes_read;
+		g_ptr_array_add(checkpoint->captures, capture);
+
+		glong first, end;
+		ume_term_row_bounds(term, &first, &end);
+		row_reader_t *reader =
+				ume_row_reader_new(term, MAX(first, end - ume.config.session_scrollback_lines), end, false,
+													 ume_session_capture_consume, ume_session_capture_done, capture);
+		checkpoint->reading++;
+		if (now)
+			ume_row_reader_finish(reader);
+		else
+			ume_row_reader_start(reader);
+	}
+
+	ume_session_read_done(checkpoint);
+}
+
+static gboolean ume_session_timer(gpointer data) {
+	handler_scope_t scope(ume.stats.stalls, "ume_session_timer");
+	ume_session_save(false);
+	return G_SOURCE_CONTINUE;
+}
+
+static void ume_session_start_timer() {
+	if (ume.session_timer)
+		g_source_remove(ume.session_timer);
+	ume.session_timer = 0;
+	if (ume.config.save_session && ume.config.session_save_interval > 0)
+		ume.session_timer = g_timeout_add_seconds(ume.config.session_save_interval, ume_session_timer, NULL);
+}
+
+/* Starts a restored tab on its first view: the saved scrollback goes first, then the shell. Background tabs
+ * are still placeholders then, their terminal is created first */
+static void ume_term_start_restored(struct terminal *term) {
+	if (!term->vte)
+		ume_term_materialize(term);
+	if (!term->spawn_pending)
+		return;
+	term->spawn_pending = false;
+
+	if (term->tmux_pane >= 0) {
+		ume_tmux_capture(term);
+		return;
+	}
+
+	/* A persistent tab whose shell still runs gets its recent output from the holder instead */
+	if (term->held_id) {
+		ume_holder_attach(term, term->held_id);
+		return;
+	}
+	ume_term_start_local(term);
+}
+
+/* A restored tab without a holder session: its saved scrollback, then a new shell */
+static void ume_term_start_local(struct terminal *term) {
+	if (term->session_scrollback) {
+		GBytes *text = session_file_t::inflate(term->session_scrollback);
+		gsize len;
+		const char *data = (const char *)g_bytes_get_data(text, &len);
+		GString *lines = g_string_sized_new(len + len / 32);
+		for (gsize i = 0; i < len; ++i) {
+			if (data[i] == '\n')
+				g_string_append_c(lines, '\r');
+			g_string_append_c(lines, data[i]);
+		}
+		if (lines->len && lines->str[lines->len - 1] != '\n')
+			g_string_append(lines, "\r\n");
+		vte_terminal_feed(VTE_TERMINAL(term->vte), lines->str, lines->len);
+		g_string_free(lines, true);
+		g_bytes_unref(text);
+	}
+
+	/* The directory may be gone since, the shell then starts where ume was started */
+	const char *cwd = NULL;
+	if (term->cwd && g_file_test(term->cwd, G_FILE_TEST_IS_DIR))
+		cwd = term->cwd;
+
+	char *command_env[2] = {g_strdup("TERM=xterm-256color"), 0};
+	ume_term_spawn(term, cwd, ume.argv, command_env, (GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_FILE_AND_ARGV_ZERO));
+	g_free(command_env[0]);
+}
+
+static void ume_page_switched(GtkNotebook *notebook, GtkWidget *page, guint page_num, gpointer data) {
+	/* Pages are switched to while being appended, before their terminal is attached */
+	struct terminal *term = (struct terminal *)g_object_get_qdata(G_OBJECT(page), term_data_id);
+	if (term) {
+		ume_term_start_restored(term);
+		ume_set_translucent(term);
+	}
+	/* Keep the current window of tmux in step, new windows start in its directory */
+	if (term && term->tmux_window >= 0)
+		ume_tmux_command(NULL, NULL, "select-window -t @%d", term->tmux_window);
+}
+
+/* Restored tabs only start once switched to, which never happens to the tab in front */
+static void ume_start_current_tab() {
+	struct terminal *term = ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+	ume_term_start_restored(term);
+	gtk_widget_grab_focus(term->vte);
+}
+
+/* Adds the tabs of the saved session. Returns false if there was none */
+static bool ume_session_restore() {
+	guint32 current;
+	gchar *path = ume_session_path();
+	GPtrArray *tabs = session_file_t::read(path, &current);
+	g_free(path);
+
+	if (!tabs || tabs->len == 0) {
+		SAY("No session to restore");
+		if (tabs)
+			g_ptr_array_unref(tabs);
+		return false;
+	}
+
+	for (guint i = 0; i < tabs->len; ++i)
+		ume_add_tab((const session_tab_t *)g_ptr_array_index(tabs, i));
+	g_ptr_array_unref(tabs);
+
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(ume.notebook), current);
+	ume_start_current_tab();
+	return true;
+}
+
+/******* tmux control mode ********/
+/* `ume --tmux` runs `tmux -C` over pipes and shows the windows of the session as tabs. tmux
+ * answers every command with a %begin/%end (or %error) block, in the order they were sent, and
+ * sends notifications like %output and %window-add between blocks. A tab ignores the output of
+ * its pane until first viewed, then the pane is captured with its history and fed live after. */
+
+static void ume_tmux_flush();
+
+static gboolean ume_tmux_writable(gint fd, GIOCondition condition, gpointer data) {
+	ume.tmux.write_watch = 0;
+	ume_tmux_flush();
+	return G_SOURCE_REMOVE;
+}
+
+static void ume_tmux_flush() {
+	while (ume.tmux.outgoing->len > 0) {
+		gssize written = send(ume.tmux.in_fd, ume.tmux.outgoing->data, ume.tmux.outgoing->len, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0 && errno == EAGAIN)
+			break;
+		if (written < 0) { /* tmux is gone, its output ends too and ume_tmux_exited cleans up */
+			g_byte_array_set_size(ume.tmux.outgoing, 0);
+			return;
+		}
+		g_byte_array_remove_range(ume.tmux.outgoing, 0, written);
+	}
+
+	if (ume.tmux.outgoing->len > 0 && !ume.tmux.write_watch)
+		ume.tmux.write_watch = g_unix_fd_add(ume.tmux.in_fd, G_IO_OUT, ume_tmux_writable, NULL);
+}
+
+/* Sends one command. func gets its reply, unless tmux exits first */
+static void ume_tmux_command(tmux_reply_func_t func, gpointer data, const char *format, ...) {
+	if (!ume.tmux.active)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	gchar *command = g_strdup_vprintf(format, args);
+	va_end(args);
+	SAY("tmux < %s", command);
+
+	g_byte_array_append(ume.tmux.outgoing, (const guint8 *)command, strlen(command));
+	g_byte_array_append(ume.tmux.outgoing, (const guint8 *)"\n", 1);
+	g_free(command);
+
+	tmux_pending_t *pending = g_new(tmux_pending_t, 1);
+	pending->func = func;
+	pending->data = data;
+	g_queue_push_tail(ume.tmux.pending, pending);
+	ume_tmux_flush();
+}
+
+static struct terminal *ume_tmux_find_window(gint window) {
+	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+	for (gint page = 0; page < npages; ++page) {
+		struct terminal *term = ume_get_page_term(ume, page);
+		if (term->tmux_window == window)
+			return term;
+	}
+	return NULL;
+}
+
+static void ume_tmux_show(struct terminal *term) {
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(ume.notebook), gtk_notebook_page_num(GTK_NOTEBOOK(ume.notebook), term->hbox));
+	gtk_widget_grab_focus(term->vte);
+}
+
+/* Replies with TMUX_WINDOW_FORMAT lines, from list-windows when attaching (data set) or from
+ * asking about a window tmux just added. Windows without a tab get one */
+static void ume_tmux_windows_listed(const gchar *reply, bool ok, gpointer data) {
+	bool attaching = GPOINTER_TO_INT(data);
+	if (!ok)
+		return;
+
+	struct terminal *active = NULL;
+	gchar **lines = g_strsplit(reply, "\n", -1);
+	for (gchar **line = lines; *line; ++line) {
+		gint window, pane, is_active, offset = 0;
+		if (sscanf(*line, "@%d %%%d %d %n", &window, &pane, &is_active, &offset) != 3 || !offset)
+			continue;
+
+		struct terminal *term = ume_tmux_find_window(window);
+		if (!term) {
+			session_tab_t tab = {};
+			tab.label = (*line)[offset] ? *line + offset : NULL;
+			tab.colorset = ume.config.last_colorset - 1;
+			term = ume_add_tab(&tab);
+			ume.tmux.shown = true;
+			term->tmux_window = window;
+			term->tmux_pane = pane;
+			g_hash_table_insert(ume.tmux.panes, GINT_TO_POINTER(pane), term);
+		}
+
+		if ((attaching && is_active) || window == ume.tmux.select_window) {
+			active = term;
+			ume.tmux.select_window = -1;
+		}
+	}
+	g_strfreev(lines);
+
+	if (active)
+		ume_tmux_show(active);
+	if (attaching && gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook)) > 0)
+		ume_start_current_tab();
+}
+
+/* Reply to new-window -P: the id of the window, whose tab may or may not be there yet */
+static void ume_tmux_window_created(const gchar *reply, bool ok, gpointer data) {
+	gint window;
+	if (!ok || sscanf(reply, "@%d", &window) != 1)
+		return;
+
+	struct terminal *term = ume_tmux_find_window(window);
+	if (term)
+		ume_tmux_show(term);
+	else
+		ume.tmux.select_window = window;
+}
+
+static void ume_tmux_new_window() {
+	ume_tmux_command(ume_tmux_window_created, NULL, "new-window -P -F \"#{window_id}\"");
+}
+
+/* Asks before closing a window with a running process. Not from the reply callback: the dialog runs
+ * a main loop, and tmux's output (the window closing among it) must not be read inside the reader */
+static gboolean ume_tmux_close_ask(gpointer data) {
+	gint window = GPOINTER_TO_INT(data);
+	if (!ume.tmux.active || !ume_tmux_find_window(window))
+		return G_SOURCE_REMOVE;
+
+	GtkWidget *dialog =
+			gtk_message_dialog_new(GTK_WINDOW(ume.main_window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
+														 _("There is a running process in this terminal.\n\nDo you really want to close it?"));
+	gint response = ume_dialog_run(dialog, "ume_tmux_close_ask");
+	gtk_widget_destroy(dialog);
+
+	/* The window may have closed on its own while the question was up */
+	if (response == GTK_RESPONSE_YES && ume.tmux.active && ume_tmux_find_window(window))
+		ume_tmux_command(NULL, NULL, "kill-window -t @%d", window);
+	return G_SOURCE_REMOVE;
+}
+
+/* Reply to asking what runs in the pane of a window that's being closed: its command and the shell.
+ * There's no process group to compare like for a local tab, a command other than the shell counts
+ * as a running process */
+static void ume_tmux_close_checked(const gchar *reply, bool ok, gpointer data) {
+	gint window = GPOINTER_TO_INT(data);
+	if (!ok || !ume_tmux_find_window(window))
+		return;
+
+	gchar **fields = g_strsplit(reply, "\t", 2);
+	bool running = false;
+	if (g_strv_length(fields) == 2) {
+		gchar *shell = g_path_get_basename(g_strstrip(fields[1]));
+		running = strcmp(g_strstrip(fields[0]), shell) != 0;
+		g_free(shell);
+	}
+	g_strfreev(fields);
+
+	if (running)
+		g_idle_add(ume_tmux_close_ask, data);
+	else
+		ume_tmux_command(NULL, NULL, "kill-window -t @%d", window);
+}
+
+/* The tab goes when tmux reports the window closed */
+static void ume_tmux_close_window(struct terminal *term) {
+	if (ume.config.less_questions) {
+		ume_tmux_command(NULL, NULL, "kill-window -t @%d", term->tmux_window);
+		return;
+	}
+	ume_tmux_command(ume_tmux_close_checked, GINT_TO_POINTER(term->tmux_window),
+									 "display-message -p -t %%%d \"#{pane_current_command}\t#{default-shell}\"", term->tmux_pane);
+}
+
+static void ume_tmux_sync_size(struct terminal *term) {
+	/* Every tab has the size of the notebook, so one client size fits all windows */
+	glong rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+	glong columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+	if (rows == ume.tmux.rows && columns == ume.tmux.columns)
+		return;
 
-	if (term->pid >= 0) {
-		char *file, *buf;
-		struct stat sb;
-		int len;
+	ume.tmux.rows = rows;
+	ume.tmux.columns = columns;
+	ume_tmux_command(NULL, NULL, "refresh-client -C %ldx%ld", columns, rows);
+}
 
-		file = g_strdup_printf("/proc/%d/cwd", term->pid);
+/* Input goes through send-keys as hex, which reaches the pane unchanged whatever the bytes. done
+ * gets the reply to the last command, with the pane as data */
+static void ume_tmux_send_keys(gint pane, const char *data, gsize len, tmux_reply_func_t done) {
+	GString *command = g_string_new(NULL);
+	for (gsize start = 0; start < len; start += TMUX_SEND_KEYS_CHUNK) {
+		g_string_printf(command, "send-keys -t %%%d -H", pane);
+		for (gsize i = start; i < len && i < start + TMUX_SEND_KEYS_CHUNK; ++i)
+			g_string_append_printf(command, " %02x", (guint8)data[i]);
+		bool last = start + TMUX_SEND_KEYS_CHUNK >= len;
+		ume_tmux_command(last ? done : NULL, GINT_TO_POINTER(pane), "%s", command->str);
+	}
+	g_string_free(command, true);
+}
 
-		if (g_stat(file, &sb) == -1) {
-			g_free(file);
-			return cwd;
-		}
+/* tmux took a chunk of a paste, the next one goes. One chunk at a time keeps a large paste from
+ * queueing megabytes of commands on the control client */
+static void ume_tmux_paste_sent(const gchar *reply, bool ok, gpointer data) {
+	struct terminal *term = (struct terminal *)g_hash_table_lookup(ume.tmux.panes, data);
+	if (!term || !term->paste)
+		return;
+	if (ok)
+		ume_term_paste_pump(term);
+	else
+		ume_term_paste_cancel(term);
+}
+
+static void ume_tmux_captured(const gchar *reply, bool ok, gpointer data) {
+	struct terminal *term = (struct terminal *)g_hash_table_lookup(ume.tmux.panes, data);
+	if (term && ok)
+		term->tmux_capture = g_strdup(reply);
+}
 
-		buf = (char *)malloc(sb.st_size + 1);
+/* Second half of ume_tmux_capture: feed the pane as captured, put the cursor back and go live */
+static void ume_tmux_cursor(const gchar *reply, bool ok, gpointer data) {
+	struct terminal *term = (struct terminal *)g_hash_table_lookup(ume.tmux.panes, data);
+	if (!term)
+		return;
 
-		if (buf == NULL) {
-			g_free(file);
-			return cwd;
+	GString *screen = g_string_new(NULL);
+	if (term->tmux_capture) {
+		/* One line per row, each ending with a newline */
+		gchar **rows = g_strsplit(term->tmux_capture, "\n", -1);
+		for (guint i = 0; rows[i] && rows[i + 1]; ++i) {
+			if (i > 0)
+				g_string_append(screen, "\r\n");
+			g_string_append(screen, rows[i]);
 		}
+		g_strfreev(rows);
+		g_clear_pointer(&term->tmux_capture, g_free);
+	}
+
+	gint x, y;
+	if (ok && sscanf(reply, "%d %d", &x, &y) == 2)
+		g_string_append_printf(screen, "\033[%d;%dH", y + 1, x + 1);
+	vte_terminal_feed(VTE_TERMINAL(term->vte), screen->str, screen->len);
+	g_string_free(screen, true);
+	term->tmux_live = true;
+}
 
-		len = readlink(file, buf, sb.st_size + 1);
+/* Fetches the scrollback of a tab on its first view. Output of the pane until then has been
+ * dropped, the capture has it. Both commands go out together so tmux runs them back to back,
+ * with no pane output read in between */
+static void ume_tmux_capture(struct terminal *term) {
+	gpointer pane = GINT_TO_POINTER(term->tmux_pane);
+	ume_tmux_sync_size(term);
+	ume_tmux_command(ume_tmux_captured, pane, "capture-pane -p -e -S -%ld -t %%%d", ume.config.scroll_lines,
+									 term->tmux_pane);
+	ume_tmux_command(ume_tmux_cursor, pane, "display-message -p -t %%%d \"#{cursor_x} #{cursor_y}\"", term->tmux_pane);
+}
+
+static bool ume_tmux_octal(gchar c) {
+	return c >= '0' && c <= '7';
+}
+
+/* %output %<pane> <data>, the data has bytes below space and backslashes escaped as \ooo. A
+ * backslash not followed by three octal digits is passed through as it is */
+static void ume_tmux_output(gchar *line, gsize len) {
+	gint pane, offset = 0;
+	if (sscanf(line, "%%output %%%d %n", &pane, &offset) != 1 || !offset)
+		return;
+
+	struct terminal *term = (struct terminal *)g_hash_table_lookup(ume.tmux.panes, GINT_TO_POINTER(pane));
+	if (!term || !term->tmux_live)
+		return;
 
-		if (len > 0 && buf[0] == '/') {
-			buf[len] = '\0';
-			cwd = g_strdup(buf);
+	/* Unescaped in place, the result is never longer */
+	gchar *start = line + offset, *end = line + len, *in = start, *out = start;
+	while (in < end) {
+		if (*in == '\\' && end - in >= 4 && ume_tmux_octal(in[1]) && ume_tmux_octal(in[2]) && ume_tmux_octal(in[3])) {
+			*out++ = (gchar)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+			in += 4;
+		} else {
+			*out++ = *in++;
 		}
+	}
+	ume_term_output(term, start, out - start);
+}
+
+/* tmux ended, or the session did. Every tab was one of its windows */
+static void ume_tmux_exited() {
+	if (!ume.tmux.active)
+		return;
+
+	SAY("tmux exited");
+	ume.tmux.active = false;
+	if (ume.tmux.read_watch)
+		g_source_remove(ume.tmux.read_watch);
+	if (ume.tmux.write_watch)
+		g_source_remove(ume.tmux.write_watch);
+	ume.tmux.read_watch = ume.tmux.write_watch = 0;
+	close(ume.tmux.in_fd);
+	close(ume.tmux.out_fd);
+	g_queue_free_full(ume.tmux.pending, g_free);
+	ume.tmux.pending = g_queue_new();
+	if (ume.tmux.reply)
+		g_string_free(ume.tmux.reply, true);
+	ume.tmux.reply = NULL;
+	g_clear_pointer(&ume.tmux.guard, g_free);
+
+	/* ume is going away, possibly because the last window closed right before %exit */
+	if (ume.destroyed)
+		return;
+	if (!ume.tmux.shown) {
+		ume_error("tmux exited before showing any window");
+		ume_destroy();
+		return;
+	}
+	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+	for (gint page = npages - 1; page >= 0; --page) {
+		struct terminal *term = ume_get_page_term(ume, page);
+		if (term->tmux_window >= 0)
+			ume_tab_exited(term->hbox);
+	}
+}
 
-		g_free(buf);
-		g_free(file);
+static void ume_tmux_line(gchar *line, gsize len) {
+	gint window, offset = 0;
+
+	if (ume.tmux.reply) {
+		/* Output is passed as is, a captured pane may well hold a line starting with %end */
+		bool ok = g_str_has_prefix(line, "%end ");
+		const char *guard = strchr(line, ' ');
+		if ((ok || g_str_has_prefix(line, "%error ")) && g_strcmp0(guard + 1, ume.tmux.guard) == 0) {
+			tmux_pending_t *pending = (tmux_pending_t *)g_queue_pop_head(ume.tmux.pending);
+			GString *reply = ume.tmux.reply;
+			ume.tmux.reply = NULL;
+			g_clear_pointer(&ume.tmux.guard, g_free);
+			if (pending && pending->func)
+				pending->func(reply->str, ok, pending->data);
+			g_free(pending);
+			g_string_free(reply, true);
+		} else {
+			g_string_append_len(ume.tmux.reply, line, len);
+			g_string_append_c(ume.tmux.reply, '\n');
+		}
+		return;
 	}
 
-	return cwd;
+	if (g_str_has_prefix(line, "%output ")) {
+		ume_tmux_output(line, len);
+	} else if (g_str_has_prefix(line, "%begin ")) {
+		ume.tmux.reply = g_string_new(NULL);
+		ume.tmux.guard = g_strdup(line + strlen("%begin "));
+	} else if (sscanf(line, "%%window-add @%d", &window) == 1) {
+		ume_tmux_command(ume_tmux_windows_listed, GINT_TO_POINTER(false), "display-message -p -t @%d \"%s\"", window,
+										 TMUX_WINDOW_FORMAT);
+	} else if (sscanf(line, "%%window-close @%d", &window) == 1) {
+		struct terminal *term = ume_tmux_find_window(window);
+		if (term)
+			ume_tab_exited(term->hbox);
+	} else if (sscanf(line, "%%window-renamed @%d %n", &window, &offset) == 1 && offset) {
+		struct terminal *term = ume_tmux_find_window(window);
+		if (term) {
+			g_free(term->label_text);
+			term->label_text = g_strdup(line + offset);
+			ume_set_tab_label_text(term->label_text, gtk_notebook_page_num(GTK_NOTEBOOK(ume.notebook), term->hbox));
+		}
+	} else if (g_str_has_prefix(line, "%exit")) {
+		ume_tmux_exited();
+	}
 }
 
-static gboolean ume_resized_window(GtkWidget *widget, GdkEventConfigure *event, void *data) {
-	if ((guint)event->width != ume.width || (guint)event->height != ume.height) { // NOTE: configure events are?
-		// SAY("Configure event received. Current w %d h %d ConfigureEvent w %d h %d",
-		// ume.width, ume.height, event->width, event->height);
-		ume.resized = true;
+static gboolean ume_tmux_readable(gint fd, GIOCondition condition, gpointer data) {
+	handler_scope_t scope(ume.stats.stalls, "ume_tmux_readable");
+	char buf[PTY_READ_SIZE];
+	gsize total = 0;
+
+	while (total < PTY_READ_BUDGET) {
+		gssize len = read(fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len <= 0) {
+			ume.tmux.read_watch = 0;
+			ume_tmux_exited();
+			return G_SOURCE_REMOVE;
+		}
+
+		total += len;
+		const char *at = buf, *end = buf + len;
+		while (at < end) {
+			const char *newline = (const char *)memchr(at, '\n', end - at);
+			if (!newline) {
+				g_string_append_len(ume.tmux.line, at, end - at);
+				break;
+			}
+			g_string_append_len(ume.tmux.line, at, newline - at);
+			ume_tmux_line(ume.tmux.line->str, ume.tmux.line->len);
+			g_string_truncate(ume.tmux.line, 0);
+			at = newline + 1;
+
+			/* %exit, the watch is gone */
+			if (!ume.tmux.active)
+				return G_SOURCE_REMOVE;
+		}
 	}
-	return false;
+	return G_SOURCE_CONTINUE;
 }
 
-static void ume_setname_entry_changed(GtkWidget *widget, void *data) {
-	GtkDialog *title_dialog = (GtkDialog *)data;
+/* Starts `tmux -C` on session, created unless it exists. Tabs are added as tmux lists its windows */
+static bool ume_tmux_start(const char *session) {
+	GError *error = NULL;
+	const char *argv[] = {"tmux", "-C", "new-session", "-A", "-s", session, NULL};
+	/* Otherwise tmux refuses to run from inside one of its panes */
+	gchar **envp = g_environ_unsetenv(g_get_environ(), "TMUX");
+
+	/* Commands go over a socket, so a send after tmux died fails with MSG_NOSIGNAL instead of raising SIGPIPE */
+	int input[2], output[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, input) < 0) {
+		ume_error("Cannot start tmux: %s", g_strerror(errno));
+		g_strfreev(envp);
+		return false;
+	}
+	if (!g_unix_open_pipe(output, FD_CLOEXEC, &error)) {
+		ume_error("Cannot start tmux: %s", error->message);
+		g_error_free(error);
+		close(input[0]);
+		close(input[1]);
+		g_strfreev(envp);
+		return false;
+	}
 
-	if (strcmp(gtk_entry_get_text(GTK_ENTRY(widget)), "") == 0) {
-		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, false);
-	} else {
-		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, true);
+	bool spawned = g_spawn_async_with_fds(NULL, (gchar **)argv, envp,
+																				(GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD), NULL, NULL,
+																				&ume.tmux.pid, input[1], output[1], -1, &error);
+	g_strfreev(envp);
+	close(input[1]);
+	close(output[1]);
+	ume.tmux.in_fd = input[0];
+	ume.tmux.out_fd = output[0];
+	if (!spawned) {
+		close(ume.tmux.in_fd);
+		close(ume.tmux.out_fd);
+		ume_error("Cannot start tmux: %s", error->message);
+		g_error_free(error);
+		return false;
 	}
+
+	g_child_watch_add(ume.tmux.pid, [](GPid pid, gint, gpointer) { g_spawn_close_pid(pid); }, NULL);
+	g_unix_set_fd_nonblocking(ume.tmux.in_fd, true, NULL);
+	g_unix_set_fd_nonblocking(ume.tmux.out_fd, true, NULL);
+
+	ume.tmux.active = true;
+	ume.tmux.outgoing = g_byte_array_new();
+	ume.tmux.line = g_string_new(NULL);
+	ume.tmux.pending = g_queue_new();
+	ume.tmux.panes = g_hash_table_new(g_direct_hash, g_direct_equal);
+	ume.tmux.select_window = -1;
+	ume.tmux.read_watch = g_unix_fd_add(ume.tmux.out_fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), ume_tmux_readable, NULL);
+
+	/* The first block answers the command tmux was started with */
+	g_queue_push_tail(ume.tmux.pending, g_new0(tmux_pending_t, 1));
+	ume_tmux_command(ume_tmux_windows_listed, GINT_TO_POINTER(true), "list-windows -F \"%s\"", TMUX_WINDOW_FORMAT);
+	return true;
 }
 
-/* Parameters are never used */
-static void ume_copy(GtkWidget *widget, void *data) {
-	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
-	struct terminal *term = ume_get_page_term(ume, page);
+/* Clipboard contents arrived. hbox was referenced by ume_paste so term is still allocated,
+ * but the tab may have been closed meanwhile */
+static void ume_paste_received(GtkClipboard *clipboard, const gchar *text, gpointer data) {
+	GtkWidget *hbox = GTK_WIDGET(data);
+	struct terminal *term = (struct terminal *)g_object_get_qdata(G_OBJECT(hbox), term_data_id);
 
-	vte_terminal_copy_clipboard_format(VTE_TERMINAL(term->vte), VTE_FORMAT_TEXT);
+	if (text && term && gtk_widget_get_parent(hbox) && (term->pty_fd >= 0 || term->tmux_pane >= 0) && !term->paste) {
+		term->paste = ume_paste_prepare(text, term->paste_bracketed);
+		term->paste_offset = 0;
+		term->paste_progress_us = 0;
+		ume_term_paste_pump(term);
+	}
+	g_object_unref(hbox);
 }
 
 /* Parameters are never used */
@@ -1611,7 +3966,19 @@ static void ume_paste(GtkWidget *widget, void *data) {
 	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
 	struct terminal *term = ume_get_page_term(ume, page);
 
-	vte_terminal_paste_clipboard(VTE_TERMINAL(term->vte));
+	/* One paste at a time, the second one would land inside the brackets of the first */
+	if (term->paste) {
+		gtk_widget_error_bell(term->vte);
+		return;
+	}
+
+	GtkClipboard *clipboard = gtk_widget_get_clipboard(term->vte, GDK_SELECTION_CLIPBOARD);
+	gtk_clipboard_request_text(clipboard, ume_paste_received, g_object_ref(term->hbox));
+}
+
+static void ume_cancel_paste(GtkWidget *widget, void *data) {
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	ume_term_paste_cancel(ume_get_page_term(ume, page));
 }
 
 static void ume_new_tab(GtkWidget *widget, void *data) {
@@ -1621,14 +3988,21 @@ static void ume_new_tab(GtkWidget *widget, void *data) {
 static bool ume_close_tab(gint page) {
 	struct terminal *term = ume_get_page_term(ume, page);
 	SAY("Destroying tab %d\n", page);
-	/* Check if there are running processes for this tab. Use tcgetpgrp to compare to the shell PGID */
-	pid_t pgid = tcgetpgrp(vte_pty_get_fd(vte_terminal_get_pty(VTE_TERMINAL(term->vte))));
-	if ((pgid != -1) && (pgid != term->pid) && (!ume.config.less_questions)) {
+	/* The tab of a tmux window goes when tmux reports it closed. Closing ume only detaches */
+	if (term->tmux_window >= 0 && !ume.detaching) {
+		ume_tmux_close_window(term);
+		return true;
+	}
+	/* Check if there are running processes for this tab. Use tcgetpgrp to compare to the shell PGID. A
+	 * persistent tab closed with the window is only detached, whatever runs in it keeps running */
+	pid_t pgid = ume_term_foreground_pgid(term);
+	bool detached = ume.detaching && term->held_id;
+	if ((pgid != -1) && (pgid != term->pid) && !detached && (!ume.config.less_questions)) {
 		GtkWidget *dialog =
 				gtk_message_dialog_new(GTK_WINDOW(ume.main_window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
 															 _("There is a running process in this terminal.\n\nDo you really want to close it?"));
 
-		gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+		gint response = ume_dialog_run(dialog, "ume_close_tab");
 		gtk_widget_destroy(dialog);
 
 		if (response == GTK_RESPONSE_YES) {
@@ -1682,19 +4056,24 @@ static void ume_closebutton_clicked(GtkWidget *widget, void *data) {
 	term = ume_get_page_term(ume, page);
 	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
 
+	if (term->tmux_window >= 0) {
+		ume_tmux_close_window(term);
+		return;
+	}
+
 	/* Only write configuration to disk if it's the last tab */
 	if (npages == 1) {
 		ume_config_done(false);
 	}
 
 	/* Check if there are running processes for this tab. Use tcgetpgrp to compare to the shell PGID */
-	pgid = tcgetpgrp(vte_pty_get_fd(vte_terminal_get_pty(VTE_TERMINAL(term->vte))));
+	pgid = ume_term_foreground_pgid(term);
 	if ((pgid != -1) && (pgid != term->pid) && (!ume.config.less_questions)) {
 		dialog =
 				gtk_message_dialog_new(GTK_WINDOW(ume.main_window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
 															 _("There is a running process in this terminal.\n\nDo you really want to close it?"));
 
-		response = gtk_dialog_run(GTK_DIALOG(dialog));
+		response = ume_dialog_run(dialog, "ume_closebutton_clicked");
 		gtk_widget_destroy(dialog);
 
 		if (response == GTK_RESPONSE_YES) {
@@ -1719,66 +4098,201 @@ static void ume_conf_changed(GtkWidget *widget, void *data) {
 }
 
 static void ume_disable_numbered_tabswitch(GtkWidget *widget, void *data) {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		ume.config.disable_numbered_tabswitch = true;
-		ume_set_config(cfg_group, "disable_numbered_tabswitch", true);
-	} else {
-		ume.config.disable_numbered_tabswitch = false;
-		ume_set_config(cfg_group, "disable_numbered_tabswitch", false);
-	}
+	ume.config.disable_numbered_tabswitch = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	ume_config_save("disable_numbered_tabswitch");
 }
 
 static void ume_use_fading(GtkWidget *widget, void *data) {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		ume.config.use_fading = true;
-		ume_set_config(cfg_group, "use_fading", true);
-	} else {
-		ume.config.use_fading = false;
-		ume_set_config(cfg_group, "use_fading", false);
+	ume.config.use_fading = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	ume_config_save("use_fading");
+	if (!ume.config.use_fading) {
 		ume_fade_in();
 		ume_set_colors();
 	}
 }
 
 /******* Functions ********/
+enum { COLOR_SLOT_FOREGROUND, COLOR_SLOT_BACKGROUND, COLOR_SLOT_CURSOR, COLOR_SLOT_PALETTE };
+
+static GdkRGBA *ume_colorset_slot(term_colors_t &colors, int cs, int slot) {
+	switch (slot) {
+	case COLOR_SLOT_FOREGROUND:
+		return &colors.forecolors[cs];
+	case COLOR_SLOT_BACKGROUND:
+		return &colors.backcolors[cs];
+	case COLOR_SLOT_CURSOR:
+		return &colors.curscolors[cs];
+	default:
+		return &colors.palettes[cs][slot - COLOR_SLOT_PALETTE];
+	}
+}
+
+static int ume_colorset_slot_of(const gchar *key) {
+	if (strcmp(key, COLOR_FOREGROUND_KEY) == 0)
+		return COLOR_SLOT_FOREGROUND;
+	if (strcmp(key, COLOR_BACKGROUND_KEY) == 0)
+		return COLOR_SLOT_BACKGROUND;
+	if (strcmp(key, COLOR_CURSOR_KEY) == 0)
+		return COLOR_SLOT_CURSOR;
+	if (g_str_has_prefix(key, "color")) {
+		gchar *end;
+		guint64 index = g_ascii_strtoull(key + 5, &end, 10);
+		if (end != key + 5 && *end == '\0' && index < PALETTE_SIZE)
+			return COLOR_SLOT_PALETTE + index;
+	}
+	return -1;
+}
+
+/* Colors start out as the compile time defaults, only the keys a group has are parsed. Missing
+ * ones are added to the file */
 static term_colors_t ume_load_colorsets() {
-	using str_ptr = std::unique_ptr<const gchar, g_free_deleter>;
 	term_colors_t colors;
 
 	for (int i = 0; i < NUM_COLORSETS; i++) {
 		char group[32];
-		sprintf(group, "colors%d", i + 1);
+		sprintf(group, COLOR_GROUP_KEY, i + 1);
+
+		colors.forecolors[i] = DEFAULT_FOREGROUND;
+		colors.backcolors[i] = DEFAULT_BACKGROUND;
+		colors.curscolors[i] = DEFAULT_CURSOR;
+		std::copy(std::begin(DEFAULT_PALETTES[i]), std::end(DEFAULT_PALETTES[i]), colors.palettes[i].begin());
+
+		std::array<bool, COLOR_SLOT_PALETTE + PALETTE_SIZE> seen = {};
+		gchar **keys = g_key_file_get_keys(ume.cfg_file, group, NULL, NULL);
+		for (gchar **key = keys; key && *key; ++key) {
+			int slot = ume_colorset_slot_of(*key);
+			if (slot < 0)
+				continue;
+			seen[slot] = true;
+
+			gchar *value = g_key_file_get_string(ume.cfg_file, group, *key, NULL);
+			GdkRGBA *color = ume_colorset_slot(colors, i, slot);
+			/* An empty cursor color lets VTE pick one */
+			if (slot == COLOR_SLOT_CURSOR && value && value[0] == '\0')
+				*color = {0, 0, 0, 0};
+			else if (value)
+				gdk_rgba_parse(color, value);
+			g_free(value);
+		}
+		g_strfreev(keys);
 
-		auto cfgtmp = str_ptr(ume_load_config_or(group, COLOR_FOREGROUND_KEY, "rgb(192,192,192)"));
-		gdk_rgba_parse(&colors.forecolors[i], cfgtmp.get());
+		for (int slot = 0; slot < (int)seen.size(); ++slot) {
+			if (seen[slot])
+				continue;
+			char key[32];
+			if (slot == COLOR_SLOT_FOREGROUND)
+				strcpy(key, COLOR_FOREGROUND_KEY);
+			else if (slot == COLOR_SLOT_BACKGROUND)
+				strcpy(key, COLOR_BACKGROUND_KEY);
+			else if (slot == COLOR_SLOT_CURSOR)
+				strcpy(key, COLOR_CURSOR_KEY);
+			else
+				sprintf(key, COLOR_PALETTE_KEY, slot - COLOR_SLOT_PALETTE);
+			unique_g_ptr<gchar> value(gdk_rgba_to_string(ume_colorset_slot(colors, i, slot)));
+			ume_set_config<const gchar *>(group, key, value.get());
+		}
+	}
+	return colors;
+}
 
-		cfgtmp = str_ptr(ume_load_config_or(group, COLOR_BACKGROUND_KEY, "rgba(0,0,0,1)"));
-		gdk_rgba_parse(&colors.backcolors[i], cfgtmp.get());
+/* The [matches] group as config_t::match_rules. A file without the group gets the default rules */
+static gchar *ume_load_match_rules() {
+	if (!g_key_file_has_group(ume.cfg_file, MATCHES_GROUP)) {
+		for (const match_default_t &rule : DEFAULT_MATCHES) {
+			gchar *action_key = g_strconcat(rule.name, MATCH_ACTION_SUFFIX, NULL);
+			ume_set_config<const gchar *>(MATCHES_GROUP, rule.name, rule.regex);
+			ume_set_config<const gchar *>(MATCHES_GROUP, action_key, rule.action);
+			g_free(action_key);
+		}
+	}
 
-		cfgtmp = str_ptr(ume_load_config_or(group, COLOR_CURSOR_KEY, "rgb(255,255,255)"));
-		if (g_strcmp0(cfgtmp.get(), "") != 0)
-			gdk_rgba_parse(&colors.curscolors[i], cfgtmp.get());
-		else
-			colors.curscolors[i] = {0, 0, 0, 0};
+	GString *rules = g_string_new(NULL);
+	gchar **keys = g_key_file_get_keys(ume.cfg_file, MATCHES_GROUP, NULL, NULL);
+	for (gchar **key = keys; key && *key; ++key) {
+		if (g_str_has_suffix(*key, MATCH_ACTION_SUFFIX))
+			continue;
+		gchar *regex = g_key_file_get_string(ume.cfg_file, MATCHES_GROUP, *key, NULL);
+		gchar *action_key = g_strconcat(*key, MATCH_ACTION_SUFFIX, NULL);
+		gchar *action = g_key_file_get_string(ume.cfg_file, MATCHES_GROUP, action_key, NULL);
+		if (regex && regex[0]) {
+			g_string_append(rules, *key);
+			g_string_append_c(rules, MATCH_FIELD_SEPARATOR);
+			g_string_append(rules, regex);
+			g_string_append_c(rules, MATCH_FIELD_SEPARATOR);
+			g_string_append(rules, action && action[0] ? action : MATCH_DEFAULT_ACTION);
+			g_string_append_c(rules, MATCH_RULE_SEPARATOR);
+		}
+		g_free(regex);
+		g_free(action_key);
+		g_free(action);
+	}
+	g_strfreev(keys);
+	return g_string_free(rules, false);
+}
 
-		for (int j = 0; j < PALETTE_SIZE; ++j) {
-			char key[32];
-			sprintf(key, COLOR_PALETTE_KEY, j);
-			auto cfgstr = str_ptr(ume_load_config_or(group, key, DEFAULT_PALETTES[i][j]));
-			gdk_rgba_parse(&colors.palettes[i][j], cfgstr.get());
+/* Loads the [ume] group into config in one pass over the keys the file has. Keys it lacks get
+ * their default without any parsing, and are added to the file */
+static void ume_config_load_group(config_t &config) {
+	std::array<bool, G_N_ELEMENTS(CONFIG_SCHEMA)> seen = {};
+	GHashTable *index = ume_config_index();
+
+	gchar **keys = g_key_file_get_keys(ume.cfg_file, cfg_group, NULL, NULL);
+	for (gchar **key = keys; key && *key; ++key) {
+		/* Unknown keys stay in the file untouched */
+		const config_entry_t *entry = (const config_entry_t *)g_hash_table_lookup(index, *key);
+		if (!entry)
+			continue;
+		seen[entry - CONFIG_SCHEMA] = true;
+		if (!ume_config_read(*entry, config)) {
+			SAY("Unusable value for %s, using the default", entry->key);
+			ume_config_set_default(*entry, config);
 		}
 	}
-	return colors;
+	g_strfreev(keys);
+
+	for (gsize i = 0; i < seen.size(); ++i) {
+		if (seen[i])
+			continue;
+		ume_config_set_default(CONFIG_SCHEMA[i], config);
+		ume_config_write(CONFIG_SCHEMA[i], config);
+	}
 }
 
-// TODO make this return a config struct.
-static void ume_reload_config_file() {
-	term_data_id = g_quark_from_static_string("ume_term");
+/* Brings the open tabs in line with settings that changed */
+static void ume_config_apply(guint apply) {
+	gint n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+
+	if (apply & APPLY_TERMINALS) {
+		for (int i = 0; i < n_pages; i++) {
+			struct terminal *term = ume_get_page_term(ume, i);
+			if (term->vte)
+				ume_term_apply_config(term);
+		}
+	}
+	if (apply & APPLY_FONT)
+		ume_set_font();
+	if (apply & APPLY_TABS) {
+		gtk_notebook_set_scrollable(GTK_NOTEBOOK(ume.notebook), ume.config.scrollable_tabs);
+		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(ume.notebook), ume.config.tabs_on_bottom ? GTK_POS_BOTTOM : GTK_POS_TOP);
+		gtk_notebook_set_show_tabs(GTK_NOTEBOOK(ume.notebook), n_pages >= 2 || ume.config.first_tab);
+	}
+	if ((apply & (APPLY_FONT | APPLY_TERMINALS | APPLY_TABS)) && n_pages > 0)
+		ume_set_size();
+	if (apply & APPLY_SESSION_TIMER)
+		ume_session_start_timer();
+	if (apply & APPLY_MATCHES) {
+		for (int i = 0; i < n_pages; i++)
+			ume_term_apply_render(ume_get_page_term(ume, i));
+	}
+}
+
+/* The parsed config file, for writing settings back. Loaded on first use when the config came from the cache */
+static GKeyFile *ume_config_keyfile() {
+	if (ume.cfg_file)
+		return ume.cfg_file;
 
 	/* Config file initialization*/
 	ume.cfg_file = g_key_file_new();
-	ume.config_modified = false;
-
 	GError *error = NULL;
 	/* Open config file */
 	// TODO debug further regarding mass edits and config file getting cleared!
@@ -1789,226 +4303,318 @@ static void ume_reload_config_file() {
 			g_error_free(error);
 			exit(EXIT_FAILURE);
 		}
+		g_error_free(error);
 	}
+	return ume.cfg_file;
+}
 
-	if (ume.cfg_signal_id == 0) { // Only load the monitor signal once!
-		/* Add GFile monitor to control file external changes */
-		GFile *cfgfile = g_file_new_for_path(ume.configfile);
-		ume.cfg_monitor = g_file_monitor_file(cfgfile, (GFileMonitorFlags)0, nullptr, nullptr);
-		ume.cfg_signal_id = g_signal_connect(G_OBJECT(ume.cfg_monitor), "changed", G_CALLBACK(ume_conf_changed), NULL);
-	}
-
-	SAY("Reloading config file");
-	using g_str_ptr = unique_g_ptr<const gchar>;
-	g_str_ptr cfgtmp = nullptr;
-
-	/* We can safely ignore errors from g_key_file_get_value(), since if the
-	 * call to g_key_file_has_key() was successful, the key IS there. From the
-	 * glib docs I don't know if we can ignore errors from g_key_file_has_key,
-	 * too. I think we can: the only possible error is that the config file
-	 * doesn't exist, but we have just read it!
-	 */
-
-	ume.config.colors = ume_load_colorsets();
-	ume.config.last_colorset = ume_load_config_or<gint>(cfg_group, "last_colorset", 1);
-	ume.palette = ume.config.colors.palettes[ume.config.last_colorset - 1].data();
-
-	ume.config.scroll_lines = ume_load_config_or(cfg_group, "scroll_lines", DEFAULT_SCROLL_LINES);
-	ume.config.scroll_amount = ume_load_config_or(cfg_group, "scroll_amount", DEFAULT_SCROLL_AMOUNT);
-
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "font", DEFAULT_FONT));
-	ume.config.font = pango_font_description_from_string(cfgtmp.get());
-
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "show_always_first_tab", "No"));
-	ume.config.first_tab = (strcmp(cfgtmp.get(), "Yes") == 0) ? true : false;
-
-	ume.config.show_scrollbar = ume_load_config_or(cfg_group, "scrollbar", false);
-	ume.config.show_closebutton = ume_load_config_or(cfg_group, "closebutton", true);
-	ume.config.tabs_on_bottom = ume_load_config_or(cfg_group, "tabs_on_bottom", false);
-
-	ume.config.less_questions = ume_load_config_or(cfg_group, "less_questions", false);
-	ume.config.disable_numbered_tabswitch = ume_load_config_or(cfg_group, "disable_numbered_tabswitch", false);
-	ume.config.use_fading = ume_load_config_or(cfg_group, "use_fading", false);
-	ume.config.scrollable_tabs = ume_load_config_or(cfg_group, "scrollable_tabs", true);
-
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "urgent_bell", "Yes"));
-	ume.config.urgent_bell = (strcmp(cfgtmp.get(), "Yes") == 0);
-
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "audible_bell", "Yes"));
-	ume.config.audible_bell = (strcmp(cfgtmp.get(), "Yes") == 0);
+static gchar *ume_config_cache_path() {
+	return g_strconcat(ume.configfile, ".cache", NULL);
+}
 
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "blinking_cursor", "No"));
-	ume.config.blinking_cursor = (strcmp(cfgtmp.get(), "Yes") == 0);
+static void ume_reload_config_file() {
+	handler_scope_t scope(ume.stats.stalls, "ume_reload_config_file");
+	latency_scope_t timing(ume.stats.config_load);
+	term_data_id = g_quark_from_static_string("ume_term");
 
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "stop_tab_cycling_at_end_tabs", "No"));
-	ume.config.stop_tab_cycling_at_end_tabs = (strcmp(cfgtmp.get(), "Yes") == 0);
+	if (ume.cfg_file)
+		g_key_file_free(ume.cfg_file);
+	ume.cfg_file = NULL;
+	ume.config_modified = false;
 
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "allow_bold", "Yes"));
-	ume.config.allow_bold = (strcmp(cfgtmp.get(), "Yes") == 0);
+	SAY("Reloading config file");
+	/* Loaded next to the current config, runtime only members carry over */
+	config_t loaded = ume.config;
+	GStatBuf st;
+	bool have_file = g_stat(ume.configfile, &st) == 0;
+	gchar *cache_path = ume_config_cache_path();
+
+	ume.stats.config_cached = have_file && config_cache_t::read(cache_path, st, loaded);
+	if (!ume.stats.config_cached) {
+		ume_config_keyfile();
+		loaded.colors = ume_load_colorsets();
+		ume_config_load_group(loaded);
+		loaded.match_rules = ume_load_match_rules();
+
+		/* With defaults added the file is about to change, the next load caches it */
+		GError *error = NULL;
+		if (have_file && !ume.config_modified && !config_cache_t::write(cache_path, st, loaded, &error)) {
+			SAY("Cannot write the config cache: %s", error->message);
+			g_error_free(error);
+		}
+	}
+	g_free(cache_path);
+	ume_state_load(loaded);
 
-	cfgtmp = g_str_ptr(ume_load_config_or(cfg_group, "cursor_type", "block"));
-	if (strcmp(cfgtmp.get(), "block") == 0) {
-		ume.config.cursor_type = VTE_CURSOR_SHAPE_BLOCK;
-	} else if (strcmp(cfgtmp.get(), "underline") == 0) {
-		ume.config.cursor_type = VTE_CURSOR_SHAPE_UNDERLINE;
-	} else if (strcmp(cfgtmp.get(), "ibeam") == 0) {
-		ume.config.cursor_type = VTE_CURSOR_SHAPE_IBEAM;
-	} else {
-		ume.config.cursor_type = VTE_CURSOR_SHAPE_BLOCK;
+	/* On a reload only what changed is applied to the open tabs */
+	guint apply = APPLY_NONE;
+	for (const config_entry_t &entry : CONFIG_SCHEMA) {
+		if (ume.notebook && !ume_config_equal(entry, loaded, ume.config)) {
+			SAY("%s changed", entry.key);
+			apply |= entry.apply;
+		}
+		ume_config_clear(entry, ume.config);
+	}
+	/* Compiling the rules is the costly part of them, it's only redone when they changed */
+	bool rules_changed = !ume.matches.rules || g_strcmp0(loaded.match_rules, ume.config.match_rules) != 0;
+	g_free(ume.config.match_rules);
+	ume.config = loaded;
+	ume.palette = ume.config.colors.palettes[ume.config.last_colorset - 1].data();
+	if (rules_changed) {
+		ume_matches_compile();
+		apply |= APPLY_MATCHES;
 	}
 
-	ume.config.word_chars = ume_load_config_or(cfg_group, "word_chars", DEFAULT_WORD_CHARS);
+	if (ume.notebook)
+		ume_config_apply(apply);
+}
 
-	// TODO modifier better strings or merge with keybinds!
+/* ume --config-docs, the settings table of the README */
+static void ume_config_print_docs() {
+	printf("| Config Key | Default | Description |\n| --- | --- | --- |\n");
+	for (const config_entry_t &entry : CONFIG_SCHEMA) {
+		gchar *value = NULL;
+		switch (entry.type) {
+		case config_type_t::INT:
+		case config_type_t::MODIFIER:
+			value = g_strdup_printf("%d", entry.int_default);
+			break;
+		case config_type_t::BOOL:
+			value = g_strdup(entry.int_default ? "true" : "false");
+			break;
+		case config_type_t::YES_NO:
+			value = g_strdup(entry.int_default ? "Yes" : "No");
+			break;
+		case config_type_t::STRING:
+		case config_type_t::FONT:
+			value = g_strdup(entry.string_default);
+			break;
+		case config_type_t::KEY:
+			value = g_strdup(gdk_keyval_name(entry.int_default));
+			break;
+		case config_type_t::CURSOR:
+			value = g_strdup(ume_cursor_name((VteCursorShape)entry.int_default));
+			break;
+		}
+		if (value && value[0])
+			printf("|`%s`|`%s`| %s |\n", entry.key, value, entry.doc);
+		else
+			printf("|`%s`|| %s |\n", entry.key, entry.doc);
+		g_free(value);
+	}
+}
 
-	// ----- Begin of keybinds -----
-	// TODO make a keybind struct with modifier and key bundled together.
-	ume.config.add_tab_modifier = ume_load_config_or(cfg_group, "add_tab_modifier", DEFAULT_ADD_TAB_MODIFIER);
-	ume.config.add_tab_key = ume_load_keybind_or(cfg_group, "add_tab_key", DEFAULT_ADD_TAB_KEY);
+static void ume_config_load() {
+	std::string configdir = g_build_filename(g_get_user_config_dir(), "ume", NULL);
+	if (!g_file_test(g_get_user_config_dir(), G_FILE_TEST_EXISTS))
+		g_mkdir(g_get_user_config_dir(), 0755);
+	if (!g_file_test(configdir.data(), G_FILE_TEST_EXISTS))
+		g_mkdir(configdir.data(), 0755);
+	if (option_config_file) {
+		ume.configfile = g_build_filename(configdir.data(), option_config_file, NULL);
+	} else { /* Use more standard-conforming path for config files, if available. */
+		ume.configfile = g_build_filename(configdir.data(), DEFAULT_CONFIGFILE, NULL);
+	}
 
-	ume.config.del_tab_modifier = ume_load_config_or(cfg_group, "del_tab_modifier", DEFAULT_DEL_TAB_MODIFIER);
-	ume.config.del_tab_key = ume_load_keybind_or(cfg_group, "del_tab_key", DEFAULT_DEL_TAB_KEY);
+	ume_reload_config_file();
+}
 
-	ume.config.move_tab_modifier = ume_load_config_or(cfg_group, "move_tab_modifier", DEFAULT_MOVE_TAB_MODIFIER);
-	ume.config.switch_tab_modifier =
-			ume_load_config_or<gint>(cfg_group, "switch_tab_modifier", DEFAULT_SWITCH_TAB_MODIFIER);
-	ume.config.prev_tab_key = ume_load_keybind_or(cfg_group, "prev_tab_key", DEFAULT_PREV_TAB_KEY);
-	ume.config.next_tab_key = ume_load_keybind_or(cfg_group, "next_tab_key", DEFAULT_NEXT_TAB_KEY);
+/* Whether the AT-SPI registry says an assistive technology is running. False without a session bus
+ * or registry */
+static bool ume_a11y_enabled() {
+	GDBusConnection *bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	if (!bus)
+		return false;
 
-	ume.config.copy_modifier = ume_load_config_or(cfg_group, "copy_modifier", DEFAULT_COPY_MODIFIER);
-	ume.config.copy_key = ume_load_keybind_or(cfg_group, "copy_key", DEFAULT_COPY_KEY);
-	ume.config.paste_key = ume_load_keybind_or(cfg_group, "paste_key", DEFAULT_PASTE_KEY);
+	bool enabled = false;
+	GVariant *reply = g_dbus_connection_call_sync(bus, A11Y_BUS_NAME, A11Y_BUS_PATH, "org.freedesktop.DBus.Properties",
+																								 "Get", g_variant_new("(ss)", A11Y_STATUS_INTERFACE, "IsEnabled"),
+																								 G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NO_AUTO_START,
+																								 A11Y_DBUS_TIMEOUT_MS, NULL, NULL);
+	if (reply) {
+		GVariant *value;
+		g_variant_get(reply, "(v)", &value);
+		if (g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN))
+			enabled = g_variant_get_boolean(value);
+		g_variant_unref(value);
+		g_variant_unref(reply);
+	}
+	g_object_unref(bus);
+	return enabled;
+}
 
-	ume.config.scrollbar_modifier = ume_load_config_or(cfg_group, "scrollbar_modifier", DEFAULT_SCROLLBAR_MODIFIER);
-	ume.config.scrollbar_key = ume_load_keybind_or(cfg_group, "scrollbar_key", DEFAULT_SCROLLBAR_KEY);
-	ume.config.scroll_up_key = ume_load_keybind_or(cfg_group, "scroll_up_key", DEFAULT_SCROLL_UP_KEY);
-	ume.config.scroll_down_key = ume_load_keybind_or(cfg_group, "scroll_down_key", DEFAULT_SCROLL_DOWN_KEY);
-	ume.config.page_up_key = ume_load_keybind_or(cfg_group, "page_up_key", DEFAULT_PAGE_UP_KEY);
-	ume.config.page_down_key = ume_load_keybind_or(cfg_group, "page_down_key", DEFAULT_PAGE_DOWN_KEY);
+/* org.a11y.Status changed on the bus, e.g. a screen reader was started after ume. Terminals hand out
+ * their real accessible from the next time they're asked on. One that already has it keeps it when
+ * the assistive technology goes away */
+static void ume_a11y_changed(GDBusConnection *bus, const gchar *sender, const gchar *path, const gchar *interface,
+														 const gchar *signal, GVariant *parameters, gpointer data) {
+	if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(sa{sv}as)")))
+		return;
 
-	ume.config.set_tab_name_modifier =
-			ume_load_config_or(cfg_group, "set_tab_name_modifier", DEFAULT_SET_TAB_NAME_MODIFIER);
-	ume.config.set_tab_name_key = ume_load_keybind_or(cfg_group, "set_tab_name_key", DEFAULT_SET_TAB_NAME_KEY);
+	GVariant *changed = g_variant_get_child_value(parameters, 1);
+	gboolean enabled;
+	if (g_variant_lookup(changed, "IsEnabled", "b", &enabled) && enabled != ume.accessible) {
+		ume.accessible = enabled;
+		SAY("Accessibility %s", ume.accessible ? "on" : "off");
+	}
+	g_variant_unref(changed);
+}
 
-	ume.config.search_modifier = ume_load_config_or(cfg_group, "search_modifier", DEFAULT_SEARCH_MODIFIER);
-	ume.config.search_key = ume_load_keybind_or(cfg_group, "search_key", DEFAULT_SEARCH_KEY);
+/* Follows the AT-SPI registry after startup, unless accessibility is off for good. The connection
+ * is kept for as long as ume runs, GDBus closes the shared one when its last reference goes */
+static void ume_a11y_watch(GDBusConnection *bus) {
+	if (!bus || option_no_a11y || !ume.config.accessibility)
+		return;
+	g_object_ref(bus);
+	g_dbus_connection_signal_subscribe(bus, A11Y_BUS_NAME, "org.freedesktop.DBus.Properties", "PropertiesChanged",
+																		 A11Y_BUS_PATH, A11Y_STATUS_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE, ume_a11y_changed,
+																		 NULL, NULL);
+}
 
-	ume.config.font_size_modifier = ume_load_config_or(cfg_group, "font_size_modifier", DEFAULT_FONT_SIZE_MODIFIER);
-	ume.config.increase_font_size_key =
-			ume_load_keybind_or(cfg_group, "increase_font_size_key", DEFAULT_INCREASE_FONT_SIZE_KEY);
-	ume.config.decrease_font_size_key =
-			ume_load_keybind_or(cfg_group, "decrease_font_size_key", DEFAULT_DECREASE_FONT_SIZE_KEY);
+/* Startup runs the config load on a worker thread while gtk_init connects to the display. Nothing
+ * else touches ume until it is joined, and main leaves the environment alone until then */
+static gpointer ume_config_load_thread(gpointer data) {
+	ume_config_load();
+	ume.stats.config_ready_us = g_get_monotonic_time() - ume.stats.started_us;
+
+	ume.accessible = !option_no_a11y && ume.config.accessibility && ume_a11y_enabled();
+	SAY("Accessibility %s", ume.accessible ? "on" : "off");
+
+	/* Fontconfig reads its configuration and caches on first use, have that happen here rather than
+	 * when the first terminal measures its font. The font map is private to this thread */
+	PangoFontDescription *font = NULL;
+	if (option_font)
+		font = pango_font_description_from_string(option_font);
+	PangoFontMap *font_map = pango_cairo_font_map_new();
+	PangoContext *context = pango_font_map_create_context(font_map);
+	PangoFont *loaded = pango_font_map_load_font(font_map, context, font ? font : ume.config.font);
+	if (loaded)
+		g_object_unref(loaded);
+	g_object_unref(context);
+	g_object_unref(font_map);
+	if (font)
+		pango_font_description_free(font);
+	return NULL;
+}
 
-	ume.config.fullscreen_key = ume_load_keybind_or(cfg_group, "fullscreen_key", DEFAULT_FULLSCREEN_KEY);
+/* Shell and size of new tabs, from the command line */
+static void ume_init_command() {
+	/* Default terminal size*/
+	ume.columns = DEFAULT_COLUMNS;
+	ume.rows = DEFAULT_ROWS;
 
-	ume.config.reload_modifier = ume_load_config_or(cfg_group, "reload_modifier", DEFAULT_RELOAD_MODIFIER);
-	ume.config.reload_key = ume_load_keybind_or(cfg_group, "reload_key", DEFAULT_RELOAD_KEY);
+	/* Set argv for forked childs. Real argv vector starts at argv[1] because we're
+		 using G_SPAWN_FILE_AND_ARGV_ZERO to be able to launch login shells */
+	ume.argv[0] = g_strdup(g_getenv("SHELL"));
+	if (option_login) {
+		ume.argv[1] = g_strdup_printf("-%s", g_getenv("SHELL"));
+	} else {
+		ume.argv[1] = g_strdup(g_getenv("SHELL"));
+	}
+	ume.argv[2] = NULL;
 
-	ume.config.set_colorset_modifier =
-			ume_load_config_or(cfg_group, "set_colorset_modifier", DEFAULT_SELECT_COLORSET_MODIFIER);
-	for (int i = 0; i < NUM_COLORSETS; ++i) {
-		char key_name[32];
-		sprintf(key_name, COLOR_SWITCH_KEY, i + 1);
-		ume.config.set_colorset_keys[i] = ume_load_keybind_or(cfg_group, key_name, cs_keys[i]);
+	if (option_columns) {
+		ume.columns = option_columns;
 	}
 
-	ume.config.open_url_modifier = ume_load_config_or(cfg_group, "open_url_modifier", DEFAULT_OPEN_URL_MODIFIER);
+	if (option_rows) {
+		ume.rows = option_rows;
+	}
+}
 
-	// ------ End of keybindings -----
-	ume.config.icon = ume_load_config_or(cfg_group, "icon_file", ICON_FILE);
+/* With early_shell, starts the shell of the plain first tab before any widget exists, VTE forks and
+ * execs it on its spawn thread while ume_init builds the window. ume_add_tab adopts it, and whatever
+ * the shell printed by then is fed before the window is shown. Tabs that come from tmux, a session,
+ * detached persistent tabs or a command keep starting in ume_add_tab. The early shell can't have
+ * WINDOWID, there is no window yet, hence opt-in */
+static void ume_spawn_early() {
+	if (!ume.config.early_shell || option_tmux || option_restore || option_execute || option_xterm_execute ||
+			option_xterm_args || ume.config.persistent_sessions)
+		return;
 
-	/* set default title pattern from config or NULL */
-	ume.config.tab_default_title = g_key_file_get_string(ume.cfg_file, cfg_group, "tab_default_title", NULL);
-	// ume.config.reload_config_on_modify = ume_load_config_or(cfg_group, "reload_config_on_modify", false);
-	ume.config.ignore_overwrite = ume_load_config_or(cfg_group, "ignore_overwrite", false);
+	struct terminal *term = ume_term_new();
+	gchar *cwd = g_get_current_dir();
+	const char *mode = "TERM=xterm-256color";
+	char *command_env[2] = {g_strdup(mode), 0};
+	ume_term_spawn(term, cwd, ume.argv, command_env, (GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_FILE_AND_ARGV_ZERO));
+	g_free(command_env[0]);
+	g_free(cwd);
+	ume.early_term = term;
 }
 
-static void ume_config_load() {
-	std::string configdir = g_build_filename(g_get_user_config_dir(), "ume", NULL);
-	if (!g_file_test(g_get_user_config_dir(), G_FILE_TEST_EXISTS))
-		g_mkdir(g_get_user_config_dir(), 0755);
-	if (!g_file_test(configdir.data(), G_FILE_TEST_EXISTS))
-		g_mkdir(configdir.data(), 0755);
-	if (option_config_file) {
-		ume.configfile = g_build_filename(configdir.data(), option_config_file, NULL);
-	} else { /* Use more standard-conforming path for config files, if available. */
-		ume.configfile = g_build_filename(configdir.data(), DEFAULT_CONFIGFILE, NULL);
+/* A chosen icon is loaded from its file. The default one is in the binary, already rasterized */
+static void ume_set_icon() {
+	if (option_icon || g_strcmp0(ume.config.icon, ICON_FILE) != 0) {
+		/* Add datadir path to icon name and set icon */
+		gchar *icon_path;
+		GError *error = NULL;
+		if (option_icon) {
+			icon_path = g_strdup_printf("%s", option_icon);
+		} else {
+			icon_path = g_strdup_printf(DATADIR "/pixmaps/%s", ume.config.icon);
+		}
+		gtk_window_set_icon_from_file(GTK_WINDOW(ume.main_window), icon_path, &error);
+		g_free(icon_path);
+		if (error)
+			g_error_free(error);
+		return;
 	}
 
-	ume_reload_config_file();
+	GList *icons = NULL;
+	for (int size : ICON_SIZES) {
+		gchar *path = g_strdup_printf(ICON_RESOURCE_FORMAT, size);
+		GdkPixbuf *pixbuf = gdk_pixbuf_new_from_resource(path, NULL);
+		if (pixbuf)
+			icons = g_list_append(icons, pixbuf);
+		g_free(path);
+	}
+	gtk_window_set_icon_list(GTK_WINDOW(ume.main_window), icons);
+	g_list_free_full(icons, g_object_unref);
 }
 
 static void ume_init() { // TODO break this glorious mega function .
-	ume_config_load();
+	/* Add GFile monitor to control file external changes */
+	GFile *cfgfile = g_file_new_for_path(ume.configfile);
+	ume.cfg_monitor = g_file_monitor_file(cfgfile, (GFileMonitorFlags)0, nullptr, nullptr);
+	ume.cfg_signal_id = g_signal_connect(G_OBJECT(ume.cfg_monitor), "changed", G_CALLBACK(ume_conf_changed), NULL);
+	g_object_unref(cfgfile);
 
 	/* Use always GTK header bar*/
 	g_object_set(gtk_settings_get_default(), "gtk-dialogs-use-header", true, NULL);
+
+	/* Parsed once for every window and dialog, widgets opt in with the ume classes */
 	ume.provider = gtk_css_provider_new();
+	gtk_css_provider_load_from_resource(ume.provider, CSS_RESOURCE);
+	gtk_style_context_add_provider_for_screen(gdk_screen_get_default(), GTK_STYLE_PROVIDER(ume.provider),
+																						GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
 
 	ume.main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(ume.main_window), "ume");
 
-	/* Default terminal size*/
-	ume.columns = DEFAULT_COLUMNS;
-	ume.rows = DEFAULT_ROWS;
-
 	/* Create notebook and set style */
 	ume.notebook = gtk_notebook_new();
 	gtk_notebook_set_scrollable((GtkNotebook *)ume.notebook, ume.config.scrollable_tabs);
 
-	gchar *css = g_strdup_printf(NOTEBOOK_CSS);
-	gtk_css_provider_load_from_data(ume.provider, css, -1, NULL);
-	GtkStyleContext *context = gtk_widget_get_style_context(ume.notebook);
-	gtk_style_context_add_provider(context, GTK_STYLE_PROVIDER(ume.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-	g_free(css);
+	gtk_style_context_add_class(gtk_widget_get_style_context(ume.notebook), "ume");
 
 	/* Adding mask, for handle scroll events */
 	gtk_widget_add_events(ume.notebook, GDK_SCROLL_MASK);
 
-	/* Figure out if we have rgba capabilities. FIXME: Is this really needed? */
+	/* An RGBA visual only if a colorset needs it, an opaque window skips blending with the desktop. It
+	 * can't change once the window is realized, a colorset made translucent later needs a restart */
+	gtk_style_context_add_class(gtk_widget_get_style_context(ume.main_window), "ume");
 	GdkScreen *screen = gtk_widget_get_screen(GTK_WIDGET(ume.main_window));
 	GdkVisual *visual = gdk_screen_get_rgba_visual(screen);
-	if (visual != NULL && gdk_screen_is_composited(screen)) {
+	if (visual != NULL && gdk_screen_is_composited(screen) && ume_colors_translucent()) {
 		gtk_widget_set_visual(GTK_WIDGET(ume.main_window), visual);
 	}
 
 	/* Command line options initialization */
-
-	/* Set argv for forked childs. Real argv vector starts at argv[1] because we're
-		 using G_SPAWN_FILE_AND_ARGV_ZERO to be able to launch login shells */
-	ume.argv[0] = g_strdup(g_getenv("SHELL"));
-	if (option_login) {
-		ume.argv[1] = g_strdup_printf("-%s", g_getenv("SHELL"));
-	} else {
-		ume.argv[1] = g_strdup(g_getenv("SHELL"));
-	}
-	ume.argv[2] = NULL;
-
-	if (option_title) {
-		gtk_window_set_title(GTK_WINDOW(ume.main_window), option_title);
-	}
-
-	if (option_columns) {
-		ume.columns = option_columns;
-	}
-
-	if (option_rows) {
-		ume.rows = option_rows;
+	if (option_title) {
+		gtk_window_set_title(GTK_WINDOW(ume.main_window), option_title);
 	}
 
-	/* Add datadir path to icon name and set icon */
-	gchar *icon_path;
-	GError *error = NULL;
-	if (option_icon) {
-		icon_path = g_strdup_printf("%s", option_icon);
-	} else {
-		icon_path = g_strdup_printf(DATADIR "/pixmaps/%s", ume.config.icon);
-	}
-	gtk_window_set_icon_from_file(GTK_WINDOW(ume.main_window), icon_path, &error);
-	g_free(icon_path);
-	icon_path = NULL;
-	if (error)
-		g_error_free(error);
+	ume_set_icon();
 
 	if (option_font) {
 		ume.config.font = pango_font_description_from_string(option_font);
@@ -2031,28 +4637,24 @@ static void ume_init() { // TODO break this glorious mega function .
 	ume.config.keep_fc = false;
 	ume.externally_modified = false;
 
-	error = NULL;
-	ume.config.http_vteregexp = vte_regex_new_for_match(HTTP_REGEXP, strlen(HTTP_REGEXP), 0, &error);
-	if (!ume.config.http_vteregexp) {
-		SAY("http_regexp: %s", error->message);
-		g_error_free(error);
-	}
-	error = NULL;
-	ume.config.mail_vteregexp = vte_regex_new_for_match(MAIL_REGEXP, strlen(MAIL_REGEXP), 0, &error);
-	if (!ume.config.mail_vteregexp) {
-		SAY("mail_regexp: %s", error->message);
-		g_error_free(error);
-	}
-
 	gtk_container_add(GTK_CONTAINER(ume.main_window), ume.notebook);
 
+	/* A drop-down window is a strip along the top of the screen, out of the taskbar */
+	if (option_dropdown) {
+		gtk_window_set_decorated(GTK_WINDOW(ume.main_window), false);
+		gtk_window_set_skip_taskbar_hint(GTK_WINDOW(ume.main_window), true);
+		gtk_window_set_skip_pager_hint(GTK_WINDOW(ume.main_window), true);
+		gtk_window_set_keep_above(GTK_WINDOW(ume.main_window), true);
+	}
+
 	/* Adding mask to see wheter ume window is focused or not */
 	// gtk_widget_add_events(ume.main_window, GDK_FOCUS_CHANGE_MASK);
 	ume.focused = true;
 	ume.first_focus = true;
 	ume.faded = false;
 
-	ume_init_popup();
+	ume_stats_init();
+	ume_ctl_init();
 
 	g_signal_connect(G_OBJECT(ume.main_window), "delete_event", G_CALLBACK(ume_delete_event), NULL);
 	g_signal_connect(G_OBJECT(ume.main_window), "destroy", G_CALLBACK(ume_destroy_window), NULL);
@@ -2062,15 +4664,62 @@ static void ume_init() { // TODO break this glorious mega function .
 	g_signal_connect(G_OBJECT(ume.main_window), "focus-in-event", G_CALLBACK(ume_focus_in), NULL);
 	g_signal_connect(G_OBJECT(ume.main_window), "show", G_CALLBACK(ume_window_show_event), NULL);
 	g_signal_connect(ume.notebook, "scroll-event", G_CALLBACK(ume_notebook_scroll), NULL);
+	g_signal_connect(ume.notebook, "switch-page", G_CALLBACK(ume_page_switched), NULL);
+}
+
+/* Check items of the "More" menu and the setting each one shows. A NULL label is a separator */
+struct menu_toggle_t {
+	const char *label;
+	bool config_t::*setting;
+	void (*toggled)(GtkWidget *, void *);
+};
+
+static const menu_toggle_t MENU_TOGGLES[] = {
+		{N_("Always show tab bar"), &config_t::first_tab, ume_show_first_tab},
+		{N_("Tabs at bottom"), &config_t::tabs_on_bottom, ume_tabs_on_bottom},
+		{N_("Show close button on tabs"), &config_t::show_closebutton, ume_show_close_button},
+		{NULL, NULL, NULL},
+		{N_("Show scrollbar"), &config_t::show_scrollbar, ume_show_scrollbar},
+		{N_("Don't show exit dialog"), &config_t::less_questions, ume_less_questions},
+		{N_("Set urgent bell"), &config_t::urgent_bell, ume_urgent_bell},
+		{N_("Set audible bell"), &config_t::audible_bell, ume_audible_bell},
+		{N_("Disable numbered tabswitch"), &config_t::disable_numbered_tabswitch, ume_disable_numbered_tabswitch},
+		{N_("Enable focus fade"), &config_t::use_fading, ume_use_fading},
+		{N_("Set blinking cursor"), &config_t::blinking_cursor, ume_blinking_cursor},
+		{N_("Enable bold font"), &config_t::allow_bold, ume_allow_bold},
+		{N_("Stop tab cycling at end tabs"), &config_t::stop_tab_cycling_at_end_tabs, ume_stop_tab_cycling_at_end_tabs},
+};
+static const VteCursorShape MENU_CURSORS[] = {VTE_CURSOR_SHAPE_BLOCK, VTE_CURSOR_SHAPE_UNDERLINE, VTE_CURSOR_SHAPE_IBEAM};
+
+static GtkWidget *menu_toggle_items[G_N_ELEMENTS(MENU_TOGGLES)];
+static GtkWidget *menu_cursor_items[G_N_ELEMENTS(MENU_CURSORS)];
+
+/* Sets a check item without running its handler, which would save the setting again */
+static void ume_menu_item_set_active(GtkWidget *item, gpointer handler, bool active) {
+	g_signal_handlers_block_matched(item, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, handler, NULL);
+	gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), active);
+	g_signal_handlers_unblock_matched(item, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, handler, NULL);
+}
+
+/* The settings may have been changed or reloaded since the menu was last up */
+static void ume_popup_refresh() {
+	for (gsize i = 0; i < G_N_ELEMENTS(MENU_TOGGLES); ++i) {
+		if (MENU_TOGGLES[i].label)
+			ume_menu_item_set_active(menu_toggle_items[i], (gpointer)MENU_TOGGLES[i].toggled,
+															 ume.config.*MENU_TOGGLES[i].setting);
+	}
+	for (gsize i = 0; i < G_N_ELEMENTS(MENU_CURSORS); ++i) {
+		if (MENU_CURSORS[i] == ume.config.cursor_type)
+			ume_menu_item_set_active(menu_cursor_items[i], (gpointer)ume_set_cursor, true);
+	}
 }
 
+/* Built on the first right click, most sessions never open it */
 static void ume_init_popup() {
-	GtkWidget *item_new_tab, *item_set_name, *item_close_tab, *item_copy, *item_paste, *item_select_font,
-			*item_select_colors, *item_set_title, *item_fullscreen, *item_toggle_scrollbar, *item_options,
-			*item_show_first_tab, *item_urgent_bell, *item_audible_bell, *item_blinking_cursor, *item_allow_bold,
-			*item_other_options, *item_cursor, *item_cursor_block, *item_cursor_underline, *item_cursor_ibeam,
-			*item_show_close_button, *item_tabs_on_bottom, *item_less_questions, *item_disable_numbered_tabswitch,
-			*item_use_fading, *item_stop_tab_cycling_at_end_tabs;
+	handler_scope_t scope(ume.stats.stalls, "ume_init_popup");
+	GtkWidget *item_new_tab, *item_set_name, *item_close_tab, *item_copy, *item_copy_scrollback, *item_copy_last_lines,
+			*item_copy_last_output, *item_paste, *item_set_mark, *item_save_scrollback, *item_select_font, *item_select_colors,
+			*item_set_title, *item_fullscreen, *item_options, *item_other_options, *item_cursor;
 	GtkWidget *options_menu, *other_options_menu, *cursor_menu;
 
 	ume.item_open_mail = gtk_menu_item_new_with_label(_("Open mail"));
@@ -2081,7 +4730,15 @@ static void ume_init_popup() {
 	item_close_tab = gtk_menu_item_new_with_label(_("Close tab"));
 	item_fullscreen = gtk_menu_item_new_with_label(_("Full screen"));
 	item_copy = gtk_menu_item_new_with_label(_("Copy"));
+	item_copy_scrollback = gtk_menu_item_new_with_label(_("Copy scrollback"));
+	item_copy_last_lines = gtk_menu_item_new_with_label(_("Copy last lines"));
+	item_copy_last_output = gtk_menu_item_new_with_label(_("Copy last output"));
+	item_set_mark = gtk_menu_item_new_with_label(_("Set mark"));
+	item_save_scrollback = gtk_menu_item_new_with_label(_("Save scrollback..."));
+	ume.item_log_output = gtk_check_menu_item_new_with_label(_("Log output"));
+	ume.item_fast_render = gtk_check_menu_item_new_with_label(_("Fast rendering"));
 	item_paste = gtk_menu_item_new_with_label(_("Paste"));
+	ume.item_cancel_paste = gtk_menu_item_new_with_label(_("Cancel paste"));
 	item_select_font = gtk_menu_item_new_with_label(_("Select font..."));
 	item_select_colors = gtk_menu_item_new_with_label(_("Select colors..."));
 	item_set_title = gtk_menu_item_new_with_label(_("Set window title..."));
@@ -2089,98 +4746,7 @@ static void ume_init_popup() {
 	item_options = gtk_menu_item_new_with_label(_("Options"));
 
 	item_other_options = gtk_menu_item_new_with_label(_("More"));
-	item_show_first_tab = gtk_check_menu_item_new_with_label(_("Always show tab bar"));
-	item_tabs_on_bottom = gtk_check_menu_item_new_with_label(_("Tabs at bottom"));
-	item_show_close_button = gtk_check_menu_item_new_with_label(_("Show close button on tabs"));
-	item_toggle_scrollbar = gtk_check_menu_item_new_with_label(_("Show scrollbar"));
-	item_less_questions = gtk_check_menu_item_new_with_label(_("Don't show exit dialog"));
-	item_urgent_bell = gtk_check_menu_item_new_with_label(_("Set urgent bell"));
-	item_audible_bell = gtk_check_menu_item_new_with_label(_("Set audible bell"));
-	item_blinking_cursor = gtk_check_menu_item_new_with_label(_("Set blinking cursor"));
-	item_allow_bold = gtk_check_menu_item_new_with_label(_("Enable bold font"));
-	item_stop_tab_cycling_at_end_tabs = gtk_check_menu_item_new_with_label(_("Stop tab cycling at end tabs"));
-	item_disable_numbered_tabswitch = gtk_check_menu_item_new_with_label(_("Disable numbered tabswitch"));
-	item_use_fading = gtk_check_menu_item_new_with_label(_("Enable focus fade"));
 	item_cursor = gtk_menu_item_new_with_label(_("Set cursor type"));
-	item_cursor_block = gtk_radio_menu_item_new_with_label(NULL, _("Block"));
-	item_cursor_underline =
-			gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_cursor_block), _("Underline"));
-	item_cursor_ibeam =
-			gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_cursor_block), _("IBeam"));
-
-	/* Show defaults in menu items */
-	if (ume.config.first_tab) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_first_tab), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_first_tab), false);
-	}
-
-	if (ume.config.show_closebutton) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_close_button), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_close_button), false);
-	}
-
-	if (ume.config.tabs_on_bottom) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_tabs_on_bottom), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_tabs_on_bottom), false);
-	}
-
-	if (ume.config.less_questions) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_less_questions), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_less_questions), false);
-	}
-
-	if (ume.config.show_scrollbar) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_scrollbar), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_scrollbar), false);
-	}
-
-	if (ume.config.disable_numbered_tabswitch) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_disable_numbered_tabswitch), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_disable_numbered_tabswitch), false);
-	}
-
-	if (ume.config.use_fading) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_use_fading), true);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_use_fading), false);
-	}
-
-	if (ume.config.urgent_bell) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_urgent_bell), true);
-	}
-
-	if (ume.config.audible_bell) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_audible_bell), true);
-	}
-
-	if (ume.config.blinking_cursor) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_blinking_cursor), true);
-	}
-
-	if (ume.config.allow_bold) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_allow_bold), true);
-	}
-
-	if (ume.config.stop_tab_cycling_at_end_tabs) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_stop_tab_cycling_at_end_tabs), true);
-	}
-
-	switch (ume.config.cursor_type) {
-		case VTE_CURSOR_SHAPE_BLOCK:
-			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_block), true);
-			break;
-		case VTE_CURSOR_SHAPE_UNDERLINE:
-			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_underline), true);
-			break;
-		case VTE_CURSOR_SHAPE_IBEAM:
-			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_ibeam), true);
-	}
 
 	ume.open_link_separator = gtk_separator_menu_item_new();
 
@@ -2199,7 +4765,16 @@ static void ume_init_popup() {
 	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_fullscreen);
 	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), gtk_separator_menu_item_new());
 	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_copy);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_copy_last_output);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_copy_last_lines);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_copy_scrollback);
 	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_paste);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), ume.item_cancel_paste);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_set_mark);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_save_scrollback);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), ume.item_log_output);
+	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), ume.item_fast_render);
 	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), gtk_separator_menu_item_new());
 	gtk_menu_shell_append(GTK_MENU_SHELL(ume.menu), item_options);
 
@@ -2212,23 +4787,33 @@ static void ume_init_popup() {
 	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_font);
 	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), gtk_separator_menu_item_new());
 	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_other_options);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_show_first_tab);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_tabs_on_bottom);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_show_close_button);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_toggle_scrollbar);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_less_questions);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_urgent_bell);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_audible_bell);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_disable_numbered_tabswitch);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_use_fading);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_blinking_cursor);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_allow_bold);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_stop_tab_cycling_at_end_tabs);
+
+	/* Check items get their state before their handlers are connected */
+	for (gsize i = 0; i < G_N_ELEMENTS(MENU_TOGGLES); ++i) {
+		const menu_toggle_t &toggle = MENU_TOGGLES[i];
+		if (!toggle.label) {
+			gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), gtk_separator_menu_item_new());
+			continue;
+		}
+		menu_toggle_items[i] = gtk_check_menu_item_new_with_label(_(toggle.label));
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(menu_toggle_items[i]), ume.config.*toggle.setting);
+		gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), menu_toggle_items[i]);
+		g_signal_connect(G_OBJECT(menu_toggle_items[i]), "activate", G_CALLBACK(toggle.toggled), NULL);
+	}
 	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_cursor);
-	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_block);
-	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_underline);
-	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_ibeam);
+
+	GSList *cursor_group = NULL;
+	const char *cursor_labels[] = {_("Block"), _("Underline"), _("IBeam")};
+	for (gsize i = 0; i < G_N_ELEMENTS(MENU_CURSORS); ++i) {
+		menu_cursor_items[i] = gtk_radio_menu_item_new_with_label(cursor_group, cursor_labels[i]);
+		cursor_group = gtk_radio_menu_item_get_group(GTK_RADIO_MENU_ITEM(menu_cursor_items[i]));
+		if (MENU_CURSORS[i] == ume.config.cursor_type)
+			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(menu_cursor_items[i]), true);
+		gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), menu_cursor_items[i]);
+	}
+	for (gsize i = 0; i < G_N_ELEMENTS(MENU_CURSORS); ++i)
+		g_signal_connect(G_OBJECT(menu_cursor_items[i]), "activate", G_CALLBACK(ume_set_cursor),
+										 (void *)ume_cursor_name(MENU_CURSORS[i]));
 
 	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_options), options_menu);
 	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_other_options), other_options_menu);
@@ -2240,31 +4825,20 @@ static void ume_init_popup() {
 	g_signal_connect(G_OBJECT(item_close_tab), "activate", G_CALLBACK(ume_close_tab_callback), NULL);
 	g_signal_connect(G_OBJECT(item_select_font), "activate", G_CALLBACK(ume_font_dialog), NULL);
 	g_signal_connect(G_OBJECT(item_copy), "activate", G_CALLBACK(ume_copy), NULL);
+	g_signal_connect(G_OBJECT(item_copy_scrollback), "activate", G_CALLBACK(ume_copy_scrollback), NULL);
+	g_signal_connect(G_OBJECT(item_copy_last_lines), "activate", G_CALLBACK(ume_copy_last_lines), NULL);
+	g_signal_connect(G_OBJECT(item_copy_last_output), "activate", G_CALLBACK(ume_copy_last_output), NULL);
+	g_signal_connect(G_OBJECT(item_set_mark), "activate", G_CALLBACK(ume_set_mark), NULL);
+	g_signal_connect(G_OBJECT(item_save_scrollback), "activate", G_CALLBACK(ume_save_scrollback_dialog), NULL);
+	g_signal_connect(G_OBJECT(ume.item_log_output), "toggled", G_CALLBACK(ume_log_output), NULL);
+	g_signal_connect(G_OBJECT(ume.item_fast_render), "toggled", G_CALLBACK(ume_fast_render), NULL);
 	g_signal_connect(G_OBJECT(item_paste), "activate", G_CALLBACK(ume_paste), NULL);
+	g_signal_connect(G_OBJECT(ume.item_cancel_paste), "activate", G_CALLBACK(ume_cancel_paste), NULL);
 	g_signal_connect(G_OBJECT(item_select_colors), "activate", G_CALLBACK(ume_color_dialog), NULL);
-
-	g_signal_connect(G_OBJECT(item_show_first_tab), "activate", G_CALLBACK(ume_show_first_tab), NULL);
-	g_signal_connect(G_OBJECT(item_tabs_on_bottom), "activate", G_CALLBACK(ume_tabs_on_bottom), NULL);
-	g_signal_connect(G_OBJECT(item_less_questions), "activate", G_CALLBACK(ume_less_questions), NULL);
-	g_signal_connect(G_OBJECT(item_show_close_button), "activate", G_CALLBACK(ume_show_close_button), NULL);
-	g_signal_connect(G_OBJECT(item_toggle_scrollbar), "activate", G_CALLBACK(ume_show_scrollbar), NULL);
-	g_signal_connect(G_OBJECT(item_urgent_bell), "activate", G_CALLBACK(ume_urgent_bell), NULL);
-	g_signal_connect(G_OBJECT(item_audible_bell), "activate", G_CALLBACK(ume_audible_bell), NULL);
-	g_signal_connect(G_OBJECT(item_blinking_cursor), "activate", G_CALLBACK(ume_blinking_cursor), NULL);
-	g_signal_connect(G_OBJECT(item_allow_bold), "activate", G_CALLBACK(ume_allow_bold), NULL);
-	g_signal_connect(G_OBJECT(item_stop_tab_cycling_at_end_tabs), "activate",
-									 G_CALLBACK(ume_stop_tab_cycling_at_end_tabs), NULL);
-	g_signal_connect(G_OBJECT(item_disable_numbered_tabswitch), "activate", G_CALLBACK(ume_disable_numbered_tabswitch),
-									 NULL);
-	g_signal_connect(G_OBJECT(item_use_fading), "activate", G_CALLBACK(ume_use_fading), NULL);
 	g_signal_connect(G_OBJECT(item_set_title), "activate", G_CALLBACK(ume_set_title_dialog), NULL);
 
-	g_signal_connect(G_OBJECT(item_cursor_block), "activate", G_CALLBACK(ume_set_cursor), (void *)"block");
-	g_signal_connect(G_OBJECT(item_cursor_underline), "activate", G_CALLBACK(ume_set_cursor), (void *)"underline");
-	g_signal_connect(G_OBJECT(item_cursor_ibeam), "activate", G_CALLBACK(ume_set_cursor), (void *)"ibeam");
-
 	g_signal_connect(G_OBJECT(ume.item_open_mail), "activate", G_CALLBACK(ume_open_mail), NULL);
-	g_signal_connect(G_OBJECT(ume.item_open_link), "activate", G_CALLBACK(ume_open_url), NULL);
+	g_signal_connect(G_OBJECT(ume.item_open_link), "activate", G_CALLBACK(ume_match_open), NULL);
 	g_signal_connect(G_OBJECT(ume.item_copy_link), "activate", G_CALLBACK(ume_copy_url), NULL);
 	//	g_signal_connect(G_OBJECT(item_fullscreen), "activate", G_CALLBACK(ume_fullscreen), NULL);
 
@@ -2272,16 +4846,29 @@ static void ume_init_popup() {
 }
 
 static void ume_destroy() {
+	if (ume.destroyed)
+		return;
 	SAY("Destroying ume.");
+	ume.destroyed = true;
+	ume.detaching = true;
+	/* Nothing tmux sends after this is acted on */
+	ume_tmux_exited();
+	if (ume.session_timer)
+		g_source_remove(ume.session_timer);
+	if (ume.config.save_session && !ume.session_saved)
+		ume_session_save(true);
+
 	/* Delete all existing tabs */
 	while (gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook)) > 0) {
 		ume_del_tab(-1);
 	}
 	SAY("Deleted all tabs");
 
-	g_key_file_free(ume.cfg_file);
-	pango_font_description_free(ume.config.font);
-	free(ume.configfile);
+	ume_ctl_done();
+	ume_log_wait_writers();
+	g_clear_pointer(&ume.cfg_file, g_key_file_free);
+	g_clear_pointer(&ume.config.font, pango_font_description_free);
+	g_clear_pointer(&ume.configfile, free);
 
 	gtk_main_quit();
 	SAY("Destroyed ume.");
@@ -2291,17 +4878,25 @@ static void ume_set_size(void) {
 	struct terminal *term;
 	gint pad_x, pad_y;
 	gint char_width, char_height;
+	gdouble scale;
 	guint npages;
 	gint min_width, natural_width;
 	gint page;
 
-	term = ume_get_page_term(ume, 0);
+	/* Tabs in the background may be placeholders, the current one always has its terminal */
+	term = ume_get_page_term(ume, gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+	if (!term || !term->vte)
+		return;
 	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+	/* Columns and rows count unzoomed cells, a zoomed current tab doesn't change the window size */
+	scale = term->font_scale;
 
 	/* Mayhaps an user resize happened. Check if row and columns have changed */
 	if (ume.resized) {
 		ume.columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
 		ume.rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+		ume.columns = lround(ume.columns * scale);
+		ume.rows = lround(ume.rows * scale);
 		SAY("New columns %ld and rows %ld", ume.columns, ume.rows);
 		ume.resized = false;
 	}
@@ -2313,6 +4908,8 @@ static void ume_set_size(void) {
 	// SAY("padding x %d y %d", pad_x, pad_y);
 	char_width = vte_terminal_get_char_width(VTE_TERMINAL(term->vte));
 	char_height = vte_terminal_get_char_height(VTE_TERMINAL(term->vte));
+	char_width = lround(char_width / scale);
+	char_height = lround(char_height / scale);
 
 	ume.width = pad_x + (char_width * ume.columns);
 	ume.height = pad_y + (char_height * ume.rows);
@@ -2350,11 +4947,16 @@ static void ume_set_size(void) {
 		}
 	}
 
+	/* The size of a drop-down window follows its monitor, see ume_dropdown_place */
+	if (option_dropdown)
+		return;
+
 	gtk_window_resize(GTK_WINDOW(ume.main_window), ume.width, ume.height);
 	SAY("Resized to %d %d", ume.width, ume.height);
 }
 
 static void ume_set_font() {
+	handler_scope_t scope(ume.stats.stalls, "ume_set_font");
 	gint n_pages;
 	struct terminal *term;
 	int i;
@@ -2364,7 +4966,8 @@ static void ume_set_font() {
 	/* Set the font for all tabs */
 	for (i = (n_pages - 1); i >= 0; i--) {
 		term = ume_get_page_term(ume, i);
-		vte_terminal_set_font(VTE_TERMINAL(term->vte), ume.config.font);
+		if (term->vte)
+			vte_terminal_set_font(VTE_TERMINAL(term->vte), ume.config.font);
 	}
 }
 
@@ -2428,27 +5031,789 @@ static void ume_set_tab_label_text(const gchar *title, gint page) {
 	}
 }
 
-/* Callback for vte_terminal_spawn_async */
-void ume_spawn_callback(VteTerminal *vte, GPid pid, GError *error, gpointer user_data) {
-	struct terminal *term = (struct terminal *)user_data;
-	// term = ume_get_page_term(ume, page);
-	if (pid == -1) { /* Fork has failed */
-		SAY("Error: %s", error->message);
-	} else {
-		term->pid = pid;
-	}
+/* Callback for vte_pty_spawn_async */
+void ume_spawn_callback(GObject *source, GAsyncResult *result, gpointer user_data) {
+	GError *error = NULL;
+	GPid pid = -1;
+
+	if (!vte_pty_spawn_finish(VTE_PTY(source), result, &pid, &error)) { /* Fork has failed */
+		/* The tab may already be gone if the spawn was cancelled, don't touch it */
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			SAY("Error: %s", error->message);
+		}
+		g_error_free(error);
+		return;
+	}
+
+	struct terminal *term = (struct terminal *)user_data;
+	g_clear_object(&term->spawn_cancellable);
+	term->pid = pid;
+	if (!ume.stats.shell_spawned_us)
+		ume.stats.shell_spawned_us = g_get_monotonic_time() - ume.stats.started_us;
+	/* vte_pty_spawn_async always adds G_SPAWN_DO_NOT_REAP_CHILD, so we reap it ourselves */
+	term->child_watch = g_child_watch_add(pid, ume_child_watch, term);
+}
+
+/* Spawn argv in a new PTY owned by ume. Output is read by ume_pty_readable and fed to VTE,
+ * input arrives through the VTE "commit" signal. This is what lets ume count, log and parse
+ * everything that goes through the terminal. */
+static void ume_term_spawn(struct terminal *term, const char *cwd, char **argv, char **envv, GSpawnFlags flags) {
+	/* The holder's answer comes later, a tab it can't take gets ume_term_spawn_local then */
+	if (ume.config.persistent_sessions)
+		ume_holder_spawn(term, cwd, argv, envv, flags);
+	else
+		ume_term_spawn_local(term, cwd, argv, envv, flags);
+}
+
+static void ume_term_spawn_local(struct terminal *term, const char *cwd, char **argv, char **envv, GSpawnFlags flags) {
+	GError *error = NULL;
+
+	term->pty = vte_pty_new_sync(VTE_PTY_NO_HELPER, NULL, &error);
+	if (!term->pty) {
+		ume_error("Cannot create a pty: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	term->pty_fd = vte_pty_get_fd(term->pty);
+	term->read_fd = term->pty_fd;
+	g_unix_set_fd_nonblocking(term->pty_fd, true, NULL);
+	ume_term_sync_pty_size(term);
+
+	term->spawn_cancellable = g_cancellable_new();
+	vte_pty_spawn_async(term->pty, cwd, argv, envv, flags, NULL, NULL, NULL, -1, term->spawn_cancellable,
+											ume_spawn_callback, term);
+
+	/* An early shell is read once its tab has a terminal, see ume_add_tab */
+	if (term->vte)
+		term->pty_watch = g_unix_fd_add_full(G_PRIORITY_DEFAULT_IDLE, term->read_fd,
+																				 (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), ume_pty_readable, term, NULL);
+}
+
+/* Output of the child however it arrived: counted, scanned, logged and fed to VTE */
+static void ume_term_output(struct terminal *term, const char *buf, gsize len) {
+	gint64 now = g_get_monotonic_time();
+	if (!ume.stats.first_output_us)
+		ume.stats.first_output_us = now - ume.stats.started_us;
+	term->stats.bytes_read += len;
+	term->stats.output_rate.add(len, now);
+	term->stats.last_output_us = now;
+	ume_term_scan_output(term, buf, len);
+	if (term->log)
+		term->log->push(buf, len);
+	vte_terminal_feed(VTE_TERMINAL(term->vte), buf, len);
+}
+
+/* Read at most budget bytes from the PTY and feed them to VTE.
+ * Returns false once the slave side is gone. */
+static bool ume_term_read(struct terminal *term, gsize budget) {
+	char buf[FAST_RENDER_READ_SIZE];
+	gsize size = term->fast_render ? FAST_RENDER_READ_SIZE : PTY_READ_SIZE;
+	gsize total = 0;
+
+	while (total < budget) {
+		gssize len = read(term->read_fd, buf, size);
+		if (len > 0) {
+			term->fed_pending += len;
+			ume_term_output(term, buf, len);
+			total += len;
+		} else if (len < 0 && errno == EINTR) {
+			continue;
+		} else if (len < 0 && errno == EAGAIN) {
+			break;
+		} else { /* EOF, or EIO once every slave fd has been closed */
+			term->pty_eof = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+static gboolean ume_term_throttle_done(gpointer data) {
+	struct terminal *term = (struct terminal *)data;
+	/* Pacing says nothing about VTE's progress, what was fed still counts towards PTY_MAX_PENDING */
+	if (!term->pacing)
+		term->fed_pending = 0;
+	term->throttle_id = 0;
+	term->pacing = false;
+
+	if (!term->pty_watch && !term->pty_eof) {
+		term->pty_watch = g_unix_fd_add_full(G_PRIORITY_DEFAULT_IDLE, term->read_fd,
+																				 (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), ume_pty_readable, term, NULL);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean ume_pty_readable(gint fd, GIOCondition condition, gpointer data) {
+	handler_scope_t scope(ume.stats.stalls, "ume_pty_readable");
+	struct terminal *term = (struct terminal *)data;
+
+	if (!ume_term_read(term, term->fast_render ? FAST_RENDER_READ_BUDGET : PTY_READ_BUDGET)) {
+		/* Nothing left to read, the child watch closes the tab. The shell of a persistent tab isn't
+		 * our child, the holder closing the connection is all we learn */
+		term->pty_watch = 0;
+		if (term->held_id)
+			ume_child_exited(term->vte, NULL);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* VTE parses what we feed it later, on its own timer. Without a limit a child writing
+	 * faster than VTE can process would make us buffer without bound, so pause reading
+	 * until VTE reports progress (or a frame passes) and let the kernel apply backpressure */
+	if (term->fed_pending >= PTY_MAX_PENDING) {
+		term->pty_watch = 0;
+		term->throttle_id = g_timeout_add(PTY_THROTTLE_MS, ume_term_throttle_done, term);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* A fast tab may be read only every so often, VTE then draws fewer and bigger updates */
+	if (term->fast_render && ume.config.fast_render_interval > 0) {
+		term->pty_watch = 0;
+		term->pacing = true;
+		term->throttle_id = g_timeout_add(ume.config.fast_render_interval, ume_term_throttle_done, term);
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean ume_pty_writable(gint fd, GIOCondition condition, gpointer data) {
+	struct terminal *term = (struct terminal *)data;
+
+	if (term->outgoing->len > 0) {
+		gssize written = write(fd, term->outgoing->data, term->outgoing->len);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return G_SOURCE_CONTINUE;
+			/* The child is gone, drop whatever it didn't read */
+			g_byte_array_set_size(term->outgoing, 0);
+			term->write_watch = 0;
+			if (term->paste)
+				ume_term_paste_cancel(term);
+			return G_SOURCE_REMOVE;
+		}
+		g_byte_array_remove_range(term->outgoing, 0, written);
+	}
+
+	/* A paste only moves on once the previous chunk has been taken by the PTY */
+	if (term->outgoing->len == 0 && term->paste)
+		ume_term_paste_pump(term);
+
+	if (term->outgoing->len == 0 && !term->paste) {
+		term->write_watch = 0;
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+/* Input for the child. While a paste is streaming it waits, so it can't end up inside the paste */
+static void ume_term_write(struct terminal *term, const char *data, gsize len) {
+	if (term->paste)
+		g_byte_array_append(term->held_input, (const guint8 *)data, len);
+	else
+		ume_term_send(term, data, len);
+}
+
+/* Queue bytes for the child. Writes directly while the PTY keeps up, buffers otherwise */
+static void ume_term_send(struct terminal *term, const char *data, gsize len) {
+	if (term->tmux_pane >= 0 && len > 0) {
+		term->stats.bytes_written += len;
+		ume_tmux_send_keys(term->tmux_pane, data, len);
+		return;
+	}
+	if (term->pty_fd < 0 || len == 0)
+		return;
+
+	term->stats.bytes_written += len;
+	if (term->outgoing->len == 0) {
+		gssize written = write(term->pty_fd, data, len);
+		if (written < 0 && errno != EAGAIN && errno != EINTR)
+			return; /* The child is gone */
+		if (written > 0) {
+			data += written;
+			len -= written;
+		}
+	}
+
+	if (len > 0) {
+		g_byte_array_append(term->outgoing, (const guint8 *)data, len);
+		if (!term->write_watch)
+			term->write_watch = g_unix_fd_add(term->pty_fd, G_IO_OUT, ume_pty_writable, term);
+	}
+}
+
+/* Clipboard text as it should reach the child: newlines as CR like a typed Enter, and when the
+ * child asked for bracketed paste, wrapped in the brackets with the other controls stripped so
+ * the text can't close the bracket itself */
+static GByteArray *ume_paste_prepare(const gchar *text, bool bracketed) {
+	gsize len = strlen(text);
+	GByteArray *paste = g_byte_array_sized_new(len + strlen(PASTE_START) + strlen(PASTE_END));
+
+	if (bracketed)
+		g_byte_array_append(paste, (const guint8 *)PASTE_START, strlen(PASTE_START));
+	for (gsize i = 0; i < len; ++i) {
+		guint8 c = text[i];
+		if (c == '\r' && text[i + 1] == '\n')
+			continue;
+		if (c == '\n')
+			c = '\r';
+		else if (bracketed && (c < 0x20 || c == 0x7f) && c != '\t' && c != '\r')
+			continue;
+		g_byte_array_append(paste, &c, 1);
+	}
+	if (bracketed)
+		g_byte_array_append(paste, (const guint8 *)PASTE_END, strlen(PASTE_END));
+	return paste;
+}
+
+static void ume_term_paste_show_progress(struct terminal *term) {
+	gint64 now = g_get_monotonic_time();
+	if (term->paste->len < PASTE_PROGRESS_MIN || now - term->paste_progress_us < PASTE_PROGRESS_INTERVAL_MS * 1000)
+		return;
+
+	gchar *text = g_strdup_printf("%u%%", (guint)(term->paste_offset * 100 / term->paste->len));
+	gtk_label_set_text(GTK_LABEL(term->paste_progress), text);
+	gtk_widget_show(term->paste_progress);
+	term->paste_progress_us = now;
+	g_free(text);
+}
+
+static void ume_term_paste_done(struct terminal *term) {
+	g_byte_array_unref(term->paste);
+	term->paste = NULL;
+	gtk_widget_hide(term->paste_progress);
+
+	ume_term_send(term, (const char *)term->held_input->data, term->held_input->len);
+	g_byte_array_set_size(term->held_input, 0);
+}
+
+/* Hands the next chunk of the paste to the PTY. Only called when nothing else is queued, the
+ * writable watch calls it again once the chunk is gone, so a slow reader slows the paste down
+ * instead of the paste piling up in memory or blocking the UI. For a tmux tab tmux's reply to
+ * the chunk takes the place of the writable watch */
+static void ume_term_paste_pump(struct terminal *term) {
+	const guint8 *data = term->paste->data;
+	gsize len = term->paste->len;
+	gsize chunk = MIN((gsize)PASTE_CHUNK_SIZE, len - term->paste_offset);
+
+	/* Never split a UTF-8 sequence, a cancel after this chunk must leave valid text behind */
+	while (term->paste_offset + chunk < len && chunk > 1 && (data[term->paste_offset + chunk] & 0xC0) == 0x80)
+		--chunk;
+
+	if (term->tmux_pane >= 0) {
+		term->stats.bytes_written += chunk;
+		ume_tmux_send_keys(term->tmux_pane, (const char *)data + term->paste_offset, chunk, ume_tmux_paste_sent);
+	} else {
+		ume_term_send(term, (const char *)data + term->paste_offset, chunk);
+	}
+	term->paste_offset += chunk;
+
+	if (term->paste_offset == len) {
+		ume_term_paste_done(term);
+		return;
+	}
+
+	ume_term_paste_show_progress(term);
+	if (!term->write_watch && term->pty_fd >= 0)
+		term->write_watch = g_unix_fd_add(term->pty_fd, G_IO_OUT, ume_pty_writable, term);
+}
+
+/* Stops a streaming paste. A started bracket gets closed so the child leaves paste mode */
+static void ume_term_paste_cancel(struct terminal *term) {
+	if (!term->paste)
+		return;
+
+	gsize end_len = strlen(PASTE_END);
+	bool bracketed = term->paste->len >= end_len &&
+									 memcmp(term->paste->data + term->paste->len - end_len, PASTE_END, end_len) == 0;
+	if (bracketed && term->paste_offset > 0) {
+		if (term->paste_offset < term->paste->len - end_len)
+			ume_term_send(term, PASTE_END, end_len);
+		else /* Already inside the closing bracket, finish it */
+			ume_term_send(term, (const char *)term->paste->data + term->paste_offset, term->paste->len - term->paste_offset);
+	}
+	ume_term_paste_done(term);
+}
+
+/******* Output scanning ********/
+/* ume follows a few sequences in the output it feeds VTE: DECSET/DECRST 2004 to know whether
+ * pastes must be bracketed, and OSC 133 shell integration marks. Everything else is left to VTE. */
+enum { SCAN_GROUND, SCAN_ESC, SCAN_CSI, SCAN_OSC, SCAN_OSC_ESC };
+
+static struct command_mark_t *ume_term_last_command(struct terminal *term) {
+	if (!term->commands || term->commands->len == 0)
+		return NULL;
+	return &g_array_index(term->commands, command_mark_t, term->commands->len - 1);
+}
+
+static void ume_term_command_mark(struct terminal *term, int mark, const char *params) {
+	gint64 now = g_get_monotonic_time();
+	command_mark_t *command = ume_term_last_command(term);
+
+	if (!term->commands) {
+		term->commands = g_array_new(false, true, sizeof(command_mark_t));
+		term->nav_index = -1;
+	}
+
+	/* A prompt starts a new command, so does any mark the current one already has */
+	if (!command || mark == MARK_PROMPT || (command->seen & (1 << mark))) {
+		if (term->commands->len >= PROMPT_MARKS_MAX) {
+			g_array_remove_range(term->commands, 0, PROMPT_MARKS_MAX / 4);
+			term->nav_index = -1;
+		}
+		command_mark_t fresh = {};
+		fresh.exit_status = -1;
+		g_array_append_val(term->commands, fresh);
+		command = ume_term_last_command(term);
+	}
+
+	command->seen |= 1 << mark;
+	command->newlines[mark] = term->newlines;
+	if (mark == MARK_OUTPUT || (mark == MARK_COMMAND && !command->started_us))
+		command->started_us = now;
+	if (mark == MARK_END) {
+		command->finished_us = now;
+		if (params && *params == ';')
+			command->exit_status = atoi(params + 1);
+		ume_term_command_finished(term, command);
+	}
+}
+
+static void ume_term_dispatch_sequence(struct terminal *term, guint8 state, char final) {
+	const char *seq = term->scan_seq;
+
+	if (state == SCAN_CSI && seq[0] == '?' && (final == 'h' || final == 'l')) {
+		/* Private modes may come several at once: ?1049;2004h */
+		gchar **modes = g_strsplit(seq + 1, ";", -1);
+		for (gchar **mode = modes; *mode; ++mode) {
+			if (strcmp(*mode, "2004") == 0)
+				term->paste_bracketed = final == 'h';
+		}
+		g_strfreev(modes);
+	} else if (state == SCAN_OSC && strncmp(seq, "133;", 4) == 0) {
+		/* A prompt start, B command start, C output start, D[;status] command end */
+		switch (seq[4]) {
+			case 'A':
+				ume_term_command_mark(term, MARK_PROMPT, seq + 5);
+				break;
+			case 'B':
+				ume_term_command_mark(term, MARK_COMMAND, seq + 5);
+				break;
+			case 'C':
+				ume_term_command_mark(term, MARK_OUTPUT, seq + 5);
+				break;
+			case 'D':
+				ume_term_command_mark(term, MARK_END, seq + 5);
+				break;
+		}
+	}
+}
+
+static void ume_term_scan_output(struct terminal *term, const char *buf, gsize len) {
+	const char *end = buf + len;
+
+	for (const char *c = buf; c < end; ++c) {
+		switch (term->scan_state) {
+			case SCAN_GROUND: {
+				/* Nothing to count before the shell sends its first mark, skip straight to the next escape */
+				const char *esc = (const char *)memchr(c, '\033', end - c);
+				if (term->commands) {
+					for (const char *n = c; n < (esc ? esc : end); ++n)
+						term->newlines += *n == '\n';
+				}
+				if (!esc)
+					return;
+				c = esc;
+				term->scan_state = SCAN_ESC;
+				break;
+			}
+			case SCAN_ESC:
+				term->scan_len = 0;
+				term->scan_seq[0] = '\0';
+				if (*c == '[')
+					term->scan_state = SCAN_CSI;
+				else if (*c == ']')
+					term->scan_state = SCAN_OSC;
+				else if (*c != '\033')
+					term->scan_state = SCAN_GROUND;
+				break;
+			case SCAN_CSI:
+				if (*c >= 0x40 && *c <= 0x7e) {
+					ume_term_dispatch_sequence(term, SCAN_CSI, *c);
+					term->scan_state = SCAN_GROUND;
+				} else if (*c == '\033') {
+					term->scan_state = SCAN_ESC;
+				} else if (term->scan_len < SCAN_SEQ_MAX - 1) {
+					term->scan_seq[term->scan_len++] = *c;
+					term->scan_seq[term->scan_len] = '\0';
+				}
+				break;
+			case SCAN_OSC:
+				if (*c == '\a') {
+					ume_term_dispatch_sequence(term, SCAN_OSC, *c);
+					term->scan_state = SCAN_GROUND;
+				} else if (*c == '\033') {
+					term->scan_state = SCAN_OSC_ESC;
+				} else if (term->scan_len < SCAN_SEQ_MAX - 1) {
+					/* Longer strings (titles, hyperlinks) are cut, none of the ones we want are that long */
+					term->scan_seq[term->scan_len++] = *c;
+					term->scan_seq[term->scan_len] = '\0';
+				}
+				break;
+			case SCAN_OSC_ESC:
+				if (*c == '\\') {
+					ume_term_dispatch_sequence(term, SCAN_OSC, *c);
+					term->scan_state = SCAN_GROUND;
+				} else {
+					term->scan_state = SCAN_ESC;
+					--c; /* Reparse it as the start of a new sequence */
+				}
+				break;
+		}
+	}
+}
+
+/* Marks are seen when read, before VTE has processed the output around them. Once it has, the
+ * cursor row minus the newlines that came after a mark gives the mark's row. Lines wrapped by
+ * VTE itself aren't counted, which can only push a mark further down within its own output. */
+static void ume_term_place_marks(struct terminal *term) {
+	glong column, cursor_row;
+	vte_terminal_get_cursor_position(VTE_TERMINAL(term->vte), &column, &cursor_row);
+
+	for (gint i = (gint)term->commands->len - 1; i >= 0; --i) {
+		command_mark_t *command = &g_array_index(term->commands, command_mark_t, i);
+		if (command->placed == command->seen)
+			break;
+		for (int mark = 0; mark < NUM_MARKS; ++mark) {
+			guint8 bit = 1 << mark;
+			if ((command->seen & bit) && !(command->placed & bit)) {
+				command->rows[mark] = MAX(cursor_row - (glong)(term->newlines - command->newlines[mark]), 0);
+				command->placed |= bit;
+			}
+		}
+	}
+}
+
+/* Index of the command to jump to from the current scroll position, -1 if there's none.
+ * Repeated jumps step from the last one, otherwise it's a binary search on the prompt rows. */
+static gint ume_term_find_command(struct terminal *term, int step) {
+	GtkAdjustment *adjust = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+	gdouble value = gtk_adjustment_get_value(adjust);
+	gint len = term->commands ? (gint)term->commands->len : 0;
+	auto prompt_row = [term](gint i) {
+		return g_array_index(term->commands, command_mark_t, i).rows[MARK_PROMPT];
+	};
+
+	if (len == 0)
+		return -1;
+	if (term->nav_index >= 0 && term->nav_index < len && value == term->nav_value) {
+		gint index = term->nav_index + step;
+		return index >= 0 && index < len ? index : -1;
+	}
+
+	/* First command whose prompt is at or below the top of the view */
+	gint low = 0, high = len;
+	while (low < high) {
+		gint mid = (low + high) / 2;
+		if (prompt_row(mid) < (glong)value)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (step < 0)
+		return low - 1;
+	if (low < len && prompt_row(low) == (glong)value)
+		++low;
+	return low < len ? low : -1;
+}
+
+static void ume_term_jump_command(struct terminal *term, int direction) {
+	GtkAdjustment *adjust = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte));
+	int step = direction == FORWARD ? 1 : -1;
+	gint index = ume_term_find_command(term, step);
+
+	/* Skip commands without a placed prompt, and the ones gone from the scrollback */
+	while (index >= 0 && index < (gint)term->commands->len) {
+		command_mark_t *command = &g_array_index(term->commands, command_mark_t, index);
+		if ((command->placed & (1 << MARK_PROMPT)) && command->rows[MARK_PROMPT] >= gtk_adjustment_get_lower(adjust))
+			break;
+		index += step;
+	}
+	if (index < 0 || index >= (gint)term->commands->len) {
+		gtk_widget_error_bell(term->vte);
+		return;
+	}
+
+	gtk_adjustment_set_value(adjust, g_array_index(term->commands, command_mark_t, index).rows[MARK_PROMPT]);
+	term->nav_index = index;
+	term->nav_value = gtk_adjustment_get_value(adjust);
+}
+
+/* Output rows of the last finished command, false if there's none */
+static bool ume_term_last_output(struct terminal *term, glong *first, glong *end) {
+	const guint8 wanted = (1 << MARK_OUTPUT) | (1 << MARK_END);
+	for (gint i = term->commands ? (gint)term->commands->len - 1 : -1; i >= 0; --i) {
+		command_mark_t *command = &g_array_index(term->commands, command_mark_t, i);
+		if ((command->placed & wanted) == wanted) {
+			*first = command->rows[MARK_OUTPUT];
+			*end = command->rows[MARK_END];
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Shows how the last command went on the tab */
+static void ume_term_command_finished(struct terminal *term, command_mark_t *command) {
+	gchar *tooltip;
+	gdouble seconds = command->started_us ? (command->finished_us - command->started_us) / 1e6 : 0;
+
+	if (command->exit_status >= 0)
+		tooltip = g_strdup_printf(_("Last command exited with %d after %.1fs"), command->exit_status, seconds);
+	else
+		tooltip = g_strdup_printf(_("Last command took %.1fs"), seconds);
+	gtk_widget_set_tooltip_text(term->label, tooltip);
+	g_free(tooltip);
+}
+
+/* Keyboard input and terminal replies from VTE */
+/* Typed input waits for a streaming paste to end. Replies of the emulator go out right away, a
+ * program querying the terminal during a paste would otherwise get its answer after the paste.
+ * Replies are escape sequences committed outside a key press. Text committed outside one is typed
+ * all the same, an input method like IBus commits it later on its own */
+static void ume_term_commit(VteTerminal *vte, gchar *text, guint size, gpointer data) {
+	bool reply = !((UmeVte *)vte)->typing && size > 0 && text[0] == '\033';
+	if (reply)
+		ume_term_send((struct terminal *)data, text, size);
+	else
+		ume_term_write((struct terminal *)data, text, size);
+}
+
+/* VTE has processed what we fed it so far */
+static void ume_term_contents_changed(VteTerminal *vte, gpointer data) {
+	struct terminal *term = (struct terminal *)data;
+	term->fed_pending = 0;
+
+	command_mark_t *command = ume_term_last_command(term);
+	if (command && command->placed != command->seen)
+		ume_term_place_marks(term);
+
+	if (term->throttle_id && !term->pacing) {
+		g_source_remove(term->throttle_id);
+		ume_term_throttle_done(term);
+	}
+}
+
+/* VTE only resizes PTYs it owns, so forward the grid size ourselves */
+static void ume_term_sync_pty_size(struct terminal *term) {
+	/* Tabs not viewed yet may not have their size, see ume_tmux_capture */
+	if (term->tmux_pane >= 0 && !term->spawn_pending)
+		ume_tmux_sync_size(term);
+	if (!term->pty)
+		return;
+
+	/* The early shell starts out with the size the window is going to have */
+	glong rows = ume.rows, columns = ume.columns;
+	if (term->vte) {
+		rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+		columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+	}
+	if (rows == term->pty_rows && columns == term->pty_columns)
+		return;
+
+	term->pty_rows = rows;
+	term->pty_columns = columns;
+	vte_pty_set_size(term->pty, rows, columns, NULL);
+}
+
+static void ume_term_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer data) {
+	ume_term_sync_pty_size((struct terminal *)data);
+}
+
+static void ume_child_watch(GPid pid, gint status, gpointer data) {
+	struct terminal *term = (struct terminal *)data;
+	term->child_watch = 0;
+
+	/* Show whatever the child printed right before exiting */
+	if (term->pty_watch && !ume_term_read(term, PTY_MAX_PENDING)) {
+		g_source_remove(term->pty_watch);
+		term->pty_watch = 0;
+	}
+
+	ume_child_exited(term->vte, NULL);
+}
+
+/* Use tcgetpgrp to find the foreground process group of the tab */
+static pid_t ume_term_foreground_pgid(struct terminal *term) {
+	if (term->pty_fd < 0)
+		return -1;
+	return tcgetpgrp(term->pty_fd);
+}
+
+/* Destroy notify for the page qdata, the widgets are already gone at this point */
+static void ume_term_free(struct terminal *term) {
+	if (term->pty_watch)
+		g_source_remove(term->pty_watch);
+	if (term->write_watch)
+		g_source_remove(term->write_watch);
+	if (term->throttle_id)
+		g_source_remove(term->throttle_id);
+	if (term->spawn_cancellable) {
+		g_cancellable_cancel(term->spawn_cancellable);
+		g_object_unref(term->spawn_cancellable);
+	}
+	if (term->holder_open)
+		ume_holder_open_free(term->holder_open);
+	if (term->child_watch) {
+		g_source_remove(term->child_watch);
+		/* The child gets SIGHUP once the PTY is closed below, keep reaping it */
+		g_child_watch_add(term->pid, [](GPid pid, gint, gpointer) { g_spawn_close_pid(pid); }, NULL);
+	}
+	if (term->pty)
+		g_object_unref(term->pty);
+	if (term->held_id && term->read_fd >= 0) {
+		/* Closing the connection alone only detaches */
+		if (!ume.detaching)
+			send(term->read_fd, &holder_t::KILL, 1, MSG_NOSIGNAL);
+		close(term->read_fd);
+	}
+	if (term->outgoing)
+		g_byte_array_unref(term->outgoing);
+	if (term->paste)
+		g_byte_array_unref(term->paste);
+	if (term->held_input)
+		g_byte_array_unref(term->held_input);
+	if (term->commands)
+		g_array_unref(term->commands);
+	if (term->log)
+		session_log_t::stop(term->log);
+	if (term->session_scrollback)
+		g_bytes_unref(term->session_scrollback);
+	if (term->tmux_pane >= 0)
+		g_hash_table_remove(ume.tmux.panes, GINT_TO_POINTER(term->tmux_pane));
+
+	g_free(term->tmux_capture);
+	g_free(term->label_text);
+	g_free(term->cwd);
+	g_free(term);
+}
+
+/* Fidelity or throughput. A fast tab does without BiDi, Arabic shaping and the match rules VTE runs
+ * on every hover, and reads its PTY in bigger chunks. Bold as bright, sixel images and hyperlinks
+ * are left to VTE's default, off, in both */
+static void ume_term_apply_render(struct terminal *term) {
+	/* Placeholders get it once materialized */
+	if (!term->vte)
+		return;
+	VteTerminal *vte = VTE_TERMINAL(term->vte);
+	bool fidelity = !term->fast_render;
+
+	vte_terminal_match_remove_all(vte);
+	/* All tabs share the one compiled regex of the match rules */
+	if (fidelity && ume.matches.regex)
+		vte_terminal_match_add_regex(vte, ume.matches.regex, 0);
+#if VTE_CHECK_VERSION(0, 58, 0)
+	vte_terminal_set_enable_bidi(vte, fidelity);
+	vte_terminal_set_enable_shaping(vte, fidelity);
+#endif
+}
+
+static void ume_term_set_fast_render(struct terminal *term, bool fast) {
+	SAY("%s rendering", fast ? "Fast" : "Full");
+	term->fast_render = fast;
+	ume_term_apply_render(term);
+}
+
+/* Whether colorset cs (from 0) is listed in fast_render_colorsets */
+static bool ume_colorset_fast_render(int cs) {
+	bool fast = false;
+	gchar **numbers = g_strsplit_set(ume.config.fast_render_colorsets ? ume.config.fast_render_colorsets : "", ", ", -1);
+	for (gchar **number = numbers; *number; ++number) {
+		if (**number && atoi(*number) == cs + 1)
+			fast = true;
+	}
+	g_strfreev(numbers);
+	return fast;
+}
+
+/* Creates the terminal of a tab and packs it in its page. Tabs restored in the background are
+ * placeholders holding only their label, colorset, directory and saved scrollback until they are
+ * first viewed or addressed by a control command, see ume_term_start_restored */
+static void ume_term_materialize(struct terminal *term) {
+	handler_scope_t scope(ume.stats.stalls, "ume_term_materialize");
+
+	/* Create new vte terminal, scrollbar, and pack it */
+	term->vte = GTK_WIDGET(g_object_new(ume_vte_get_type(), NULL));
+	term->scrollbar =
+			gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte)));
+	gtk_box_pack_start(GTK_BOX(term->hbox), term->vte, true, true, 0);
+	gtk_box_pack_start(GTK_BOX(term->hbox), term->scrollbar, false, false, 0);
+
+	/* vte signals */
+	g_signal_connect(G_OBJECT(term->vte), "bell", G_CALLBACK(ume_beep), term);
+	g_signal_connect(G_OBJECT(term->vte), "increase-font-size", G_CALLBACK(ume_increase_font), term);
+	g_signal_connect(G_OBJECT(term->vte), "decrease-font-size", G_CALLBACK(ume_decrease_font), term);
+	g_signal_connect(G_OBJECT(term->vte), "window-title-changed", G_CALLBACK(ume_title_changed), NULL);
+	g_signal_connect(G_OBJECT(term->vte), "current-directory-uri-changed", G_CALLBACK(ume_term_directory_changed), term);
+	g_signal_connect(G_OBJECT(term->vte), "commit", G_CALLBACK(ume_term_commit), term);
+	g_signal_connect(G_OBJECT(term->vte), "contents-changed", G_CALLBACK(ume_term_contents_changed), term);
+	g_signal_connect_after(G_OBJECT(term->vte), "size-allocate", G_CALLBACK(ume_term_size_allocate), term);
+	g_signal_connect(G_OBJECT(term->vte), "button-press-event", G_CALLBACK(ume_button_press), NULL);
+
+	/* Init vte terminal */
+	ume_term_apply_render(term);
+	vte_terminal_set_mouse_autohide(VTE_TERMINAL(term->vte), true);
+	vte_terminal_set_backspace_binding(VTE_TERMINAL(term->vte), VTE_ERASE_ASCII_DELETE);
+	vte_terminal_set_font(VTE_TERMINAL(term->vte), ume.config.font);
+	vte_terminal_set_font_scale(VTE_TERMINAL(term->vte), term->font_scale);
+	ume_term_set_colors(term);
+
+	gtk_widget_show_all(term->hbox);
+	ume_term_apply_config(term);
+}
+
+/* The APPLY_TERMINALS settings of the schema, again whenever they change */
+static void ume_term_apply_config(struct terminal *term) {
+	vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte), ume.config.scroll_lines);
+	vte_terminal_set_word_char_exceptions(VTE_TERMINAL(term->vte), ume.config.word_chars);
+	vte_terminal_set_audible_bell(VTE_TERMINAL(term->vte), ume.config.audible_bell ? true : false);
+	vte_terminal_set_cursor_blink_mode(VTE_TERMINAL(term->vte),
+																		 ume.config.blinking_cursor ? VTE_CURSOR_BLINK_ON : VTE_CURSOR_BLINK_OFF);
+	vte_terminal_set_allow_bold(VTE_TERMINAL(term->vte), ume.config.allow_bold ? true : false);
+	vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte), ume.config.cursor_type);
+	gtk_widget_set_visible(term->scrollbar, ume.config.show_scrollbar);
+}
+
+static struct terminal *ume_term_new() {
+	struct terminal *term = g_new0(struct terminal, 1);
+	term->font_scale = 1.0;
+	term->pty_fd = -1;
+	term->read_fd = -1;
+	term->tmux_window = term->tmux_pane = -1;
+	term->outgoing = g_byte_array_new();
+	term->held_input = g_byte_array_new();
+	term->stats.created_us = g_get_monotonic_time();
+	return term;
 }
 
 // TODO break this up
-static void ume_add_tab() {
+/* Restored tabs (restore set) wait for their first view to start the shell, see ume_term_start_restored.
+ * In tmux mode new tabs are asked of tmux, NULL is returned and the tab comes with %window-add */
+static struct terminal *ume_add_tab(const session_tab_t *restore) {
+	handler_scope_t scope(ume.stats.stalls, "ume_add_tab");
 	GtkWidget *tab_label_hbox;
 	GtkWidget *close_button;
 	int index;
 	int npages;
 	gchar *cwd = NULL;
-	gchar *label_text = _("Terminal %d");
+	const gchar *label_text = _("Terminal %d");
 
-	struct terminal *term = g_new0(struct terminal, 1);
+	if (!restore && ume.tmux.active) {
+		ume_tmux_new_window();
+		return NULL;
+	}
+
+	struct terminal *term = ume.early_term ? ume.early_term : ume_term_new();
+	ume.early_term = NULL;
 
 	/* Create label for tabs */
 	term->label_set_byuser = false;
@@ -2459,7 +5824,13 @@ static void ume_add_tab() {
 		term->label_set_byuser = true;
 	}
 
-	term->label_text = g_strdup_printf(label_text, ume.label_count++);
+	if (restore && restore->label) {
+		term->label_text = g_strdup(restore->label);
+		term->label_set_byuser = true;
+		ume.label_count++;
+	} else {
+		term->label_text = g_strdup_printf(label_text, ume.label_count++);
+	}
 	term->label = gtk_label_new(term->label_text);
 
 	tab_label_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
@@ -2467,6 +5838,12 @@ static void ume_add_tab() {
 	gtk_label_set_ellipsize(GTK_LABEL(term->label), PANGO_ELLIPSIZE_END);
 	gtk_box_pack_start(GTK_BOX(tab_label_hbox), term->label, true, false, 0);
 
+	/* Only shown while a large paste is streaming */
+	term->paste_progress = gtk_label_new(NULL);
+	gtk_widget_set_no_show_all(term->paste_progress, true);
+	gtk_widget_set_tooltip_text(term->paste_progress, _("Pasting, press Escape to cancel"));
+	gtk_box_pack_start(GTK_BOX(tab_label_hbox), term->paste_progress, false, false, 0);
+
 	/* If the tab close button is enabled, create and add it to the tab */
 	if (ume.config.show_closebutton) {
 		close_button = gtk_button_new();
@@ -2487,39 +5864,50 @@ static void ume_add_tab() {
 	}
 
 	/* Set tab title style */
-	gchar *css = g_strdup_printf(TAB_TITLE_CSS);
-	gtk_css_provider_load_from_data(ume.provider, css, -1, NULL);
-	GtkStyleContext *context = gtk_widget_get_style_context(tab_label_hbox);
-	gtk_style_context_add_provider(context, GTK_STYLE_PROVIDER(ume.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-	g_free(css);
+	gtk_style_context_add_class(gtk_widget_get_style_context(tab_label_hbox), "ume-tab-label");
 
 	gtk_widget_show_all(tab_label_hbox);
 
-	/* Create new vte terminal, scrollbar, and pack it */
-	term->vte = vte_terminal_new();
-	term->scrollbar =
-			gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(term->vte)));
+	/* The page. Its terminal and scrollbar come with ume_term_materialize */
 	term->hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-	gtk_box_pack_start(GTK_BOX(term->hbox), term->vte, true, true, 0);
-	gtk_box_pack_start(GTK_BOX(term->hbox), term->scrollbar, false, false, 0);
 
 	term->colorset = ume.config.last_colorset - 1;
 
+	if (ume.config.log_output || option_log_output)
+		ume_term_log_start(term);
+
 	/* Select the directory to use for the new tab */
 	index = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
-	if (index >= 0) {
+	if (restore) {
+		if (restore->colorset < NUM_COLORSETS)
+			term->colorset = restore->colorset;
+		term->cwd = g_strdup(restore->cwd);
+		cwd = g_strdup(restore->cwd);
+		term->held_id = restore->held_id;
+		term->spawn_pending = true;
+		if (restore->scrollback)
+			term->session_scrollback = g_bytes_ref(restore->scrollback);
+	} else if (index >= 0) {
 		struct terminal *prev_term;
 		prev_term = ume_get_page_term(ume, index);
 		cwd = ume_get_term_cwd(prev_term);
 
 		term->colorset = prev_term->colorset;
 	}
+	/* A saved tab keeps the profile it was switched to, any other follows its colorset */
+	if (restore && (restore->flags & session_tab_t::FROM_SESSION))
+		term->fast_render = restore->flags & session_tab_t::FAST_RENDER;
+	else
+		term->fast_render = ume_colorset_fast_render(term->colorset);
 	if (!cwd)
 		cwd = g_get_current_dir();
 
 	/* Keep values when adding tabs */
 	ume.config.keep_fc = true;
 
+	/* Tabs restored in the background stay placeholders until first viewed */
+	bool placeholder = restore && gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook)) > 0;
+
 	if ((index = gtk_notebook_append_page(GTK_NOTEBOOK(ume.notebook), term->hbox, tab_label_hbox)) == -1) {
 		ume_error("Cannot create a new tab");
 		exit(1);
@@ -2530,15 +5918,8 @@ static void ume_add_tab() {
 	// gtk_notebook_set_tab_detachable(GTK_NOTEBOOK(ume.notebook), term->hbox, true);
 
 	ume_set_page_term(ume, index, term);
-
-	/* vte signals */
-	g_signal_connect(G_OBJECT(term->vte), "bell", G_CALLBACK(ume_beep), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "increase-font-size", G_CALLBACK(ume_increase_font), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "decrease-font-size", G_CALLBACK(ume_decrease_font), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "child-exited", G_CALLBACK(ume_child_exited), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "eof", G_CALLBACK(ume_eof), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "window-title-changed", G_CALLBACK(ume_title_changed), NULL);
-	g_signal_connect_swapped(G_OBJECT(term->vte), "button-press-event", G_CALLBACK(ume_button_press), ume.menu);
+	if (!placeholder)
+		ume_term_materialize(term);
 
 	/* Notebook signals */
 	g_signal_connect(G_OBJECT(ume.notebook), "page-removed", G_CALLBACK(ume_page_removed), NULL);
@@ -2569,7 +5950,15 @@ static void ume_add_tab() {
 			gtk_widget_hide(term->scrollbar);
 		}
 
-		gtk_widget_show(ume.main_window);
+		/* What the early shell printed while the window was built is in the first frame */
+		if (term->pty && !term->pty_watch && ume_term_read(term, PTY_READ_BUDGET))
+			term->pty_watch = g_unix_fd_add_full(G_PRIORITY_DEFAULT_IDLE, term->read_fd,
+																					 (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), ume_pty_readable, term, NULL);
+
+		if (option_dropdown)
+			ume_dropdown_show();
+		else
+			gtk_widget_show(ume.main_window);
 
 #ifdef GDK_WINDOWING_X11
 		/* Set WINDOWID env variable */
@@ -2588,7 +5977,9 @@ static void ume_add_tab() {
 
 		int command_argc = 0;
 		char **command_argv;
-		if (option_execute || option_xterm_execute) {
+		if (restore) {
+			/* Started on first view */
+		} else if (option_execute || option_xterm_execute) {
 			GError *gerror = NULL;
 			gchar *path;
 
@@ -2639,8 +6030,7 @@ static void ume_add_tab() {
 			if (command_argc > 0) {
 				path = g_find_program_in_path(command_argv[0]);
 				if (path) {
-					vte_terminal_spawn_async(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, NULL, command_argv, command_env,
-																	 G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, -1, NULL, ume_spawn_callback, term);
+					ume_term_spawn(term, NULL, command_argv, command_env, G_SPAWN_SEARCH_PATH);
 				} else {
 					ume_error("%s command not found", command_argv[0]);
 					command_argc = 0;
@@ -2653,22 +6043,22 @@ static void ume_add_tab() {
 			}
 		} // else { /* No execute option */
 
-		/* Only fork if there is no execute option or if it has failed */
-		if ((!option_execute && !option_xterm_args) || (command_argc == 0)) {
+		/* Only fork if there is no execute option or if it has failed, and the shell wasn't started early */
+		if (!restore && ((!option_execute && !option_xterm_args) || (command_argc == 0))) {
 			if (option_hold == true) {
 				ume_error("Hold option given without any command");
 				option_hold = false;
 			}
-			vte_terminal_spawn_async(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, cwd, ume.argv, command_env,
-															 (GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_FILE_AND_ARGV_ZERO), NULL, NULL, NULL, -1,
-															 NULL, ume_spawn_callback, term);
+			if (!term->pty)
+				ume_term_spawn(term, cwd, ume.argv, command_env,
+											 (GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_FILE_AND_ARGV_ZERO));
 		}
 		/* Not the first tab */
 	} else {
 		ume_set_font();
 		ume_set_colors();
 		gtk_widget_show_all(term->hbox);
-		if (!ume.config.show_scrollbar) {
+		if (term->scrollbar && !ume.config.show_scrollbar) {
 			gtk_widget_hide(term->scrollbar);
 		}
 
@@ -2679,32 +6069,20 @@ static void ume_add_tab() {
 		/* Call set_current page after showing the widget: gtk ignores this
 		 * function in the window is not visible *sigh*. Gtk documentation
 		 * says this is for "historical" reasons. Me arse */
-		gtk_notebook_set_current_page(GTK_NOTEBOOK(ume.notebook), index);
-		vte_terminal_spawn_async(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, cwd, ume.argv, command_env,
-														 (GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_FILE_AND_ARGV_ZERO), NULL, NULL, NULL, -1,
-														 NULL, ume_spawn_callback, term);
+		if (!restore) {
+			gtk_notebook_set_current_page(GTK_NOTEBOOK(ume.notebook), index);
+			ume_term_spawn(term, cwd, ume.argv, command_env, (GSpawnFlags)(G_SPAWN_SEARCH_PATH | G_SPAWN_FILE_AND_ARGV_ZERO));
+		}
 	}
 
 	free(cwd);
 
-	/* Init vte terminal */
-	vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte), ume.config.scroll_lines);
-	vte_terminal_match_add_regex(VTE_TERMINAL(term->vte), ume.config.http_vteregexp, PCRE2_CASELESS);
-	vte_terminal_match_add_regex(VTE_TERMINAL(term->vte), ume.config.mail_vteregexp, PCRE2_CASELESS);
-	vte_terminal_set_mouse_autohide(VTE_TERMINAL(term->vte), true);
-	vte_terminal_set_backspace_binding(VTE_TERMINAL(term->vte), VTE_ERASE_ASCII_DELETE);
-	vte_terminal_set_word_char_exceptions(VTE_TERMINAL(term->vte), ume.config.word_chars);
-	vte_terminal_set_audible_bell(VTE_TERMINAL(term->vte), ume.config.audible_bell ? true : false);
-	vte_terminal_set_cursor_blink_mode(VTE_TERMINAL(term->vte),
-																		 ume.config.blinking_cursor ? VTE_CURSOR_BLINK_ON : VTE_CURSOR_BLINK_OFF);
-	vte_terminal_set_allow_bold(VTE_TERMINAL(term->vte), ume.config.allow_bold ? true : false);
-	vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte), ume.config.cursor_type);
-
 	// ume_set_colors();
 
 	/* FIXME: Possible race here. Find some way to force to process all configure
 	 * events before setting keep_fc again to false */
 	ume.config.keep_fc = false;
+	return term;
 }
 
 /* Delete the notebook tab passed as a parameter */
@@ -2719,7 +6097,9 @@ static void ume_del_tab(gint page) {
 	if (npages == 2) {
 		const char *title;
 		term = ume_get_page_term(ume, 0);
-		title = vte_terminal_get_window_title(VTE_TERMINAL(term->vte));
+		title = NULL;
+		if (term->vte)
+			title = vte_terminal_get_window_title(VTE_TERMINAL(term->vte));
 		if (title != NULL)
 			gtk_window_set_title(GTK_WINDOW(ume.main_window), title);
 	}
@@ -2748,38 +6128,6 @@ static void ume_del_tab(gint page) {
 	}
 }
 
-static void ume_set_keybind(const gchar *key, guint value) {
-	char *valname = gdk_keyval_name(value);
-	g_key_file_set_string(ume.cfg_file, cfg_group, key, valname);
-	ume.config_modified = true;
-	// FIXME: free() valname?
-}
-
-static guint ume_get_keybind(const gchar *key) {
-	guint retval = GDK_KEY_VoidSymbol;
-	std::unique_ptr<gchar, g_free_deleter> value(g_key_file_get_string(ume.cfg_file, cfg_group, key, nullptr));
-
-	if (value != nullptr) {
-		if (strcmp(value.get(), "") == 0)
-			return GDK_KEY_VoidSymbol;
-		retval = gdk_keyval_from_name(value.get());
-	}
-
-	/* For backwards compatibility with integer values */
-	/* If gdk_keyval_from_name fail, it seems to be integer value*/
-	if ((retval == GDK_KEY_VoidSymbol) || (retval == 0))
-		retval = g_key_file_get_integer(ume.cfg_file, cfg_group, key, nullptr);
-
-	/* Always use uppercase value as keyval */
-	return gdk_keyval_to_upper(retval);
-}
-
-static guint ume_load_keybind_or(const gchar *group, const gchar *key, guint default_value) {
-	if (!g_key_file_has_key(ume.cfg_file, group, key, nullptr))
-		ume_set_keybind(key, default_value);
-	return ume_get_keybind(key);
-}
-
 static void ume_error(const char *format, ...) {
 	GtkWidget *dialog;
 	va_list args;
@@ -2792,11 +6140,17 @@ static void ume_error(const char *format, ...) {
 	dialog = gtk_message_dialog_new(GTK_WINDOW(ume.main_window), GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR,
 																	GTK_BUTTONS_CLOSE, "%s", buff);
 	gtk_window_set_title(GTK_WINDOW(dialog), _("Error message"));
-	gtk_dialog_run(GTK_DIALOG(dialog));
+	ume_dialog_run(dialog, "ume_error");
 	gtk_widget_destroy(dialog);
 	free(buff);
 }
 
+/* gtk_dialog_run, but stalls inside the nested main loop get attributed to the dialog */
+static gint ume_dialog_run(GtkWidget *dialog, const char *handler) {
+	handler_scope_t scope(ume.stats.stalls, handler);
+	return gtk_dialog_run(GTK_DIALOG(dialog));
+}
+
 /* This function is used to fix bug #1393939 */
 static void ume_sanitize_working_directory() {
 	const gchar *home_directory = g_getenv("HOME");
@@ -2812,14 +6166,735 @@ static void ume_sanitize_working_directory() {
 	}
 }
 
-// Reload ume when it recieves
-static void ume_usr1_signal_handler(int signum) {
+// Reload ume when it recieves SIGUSR1. Dispatched from the main loop, not in the signal handler
+static gboolean ume_usr1_signal_handler(gpointer data) {
 	SAY("Caught SIGUSR1, reloading config file");
+	ume.stats.config_reloads++;
 	ume_reload_config_file();
 	ume_set_colorset(ume.config.last_colorset - 1);
+	return G_SOURCE_CONTINUE;
+}
+
+/******* Stats ********/
+/* Main loop probe. It never dispatches, it only timestamps the end of poll (check) and the
+ * start of the next iteration (prepare), which brackets the time spent dispatching */
+struct loop_probe_t {
+	GSource source;
+	gint64 iteration_start;
+};
+
+static gboolean ume_loop_probe_prepare(GSource *source, gint *timeout) {
+	loop_probe_t *probe = (loop_probe_t *)source;
+	if (probe->iteration_start) {
+		gint64 now = g_get_monotonic_time();
+		ume.stats.main_loop.record(now - probe->iteration_start);
+		ume.stats.stalls.iteration_done(now, now - probe->iteration_start, STALL_THRESHOLD_MS * 1000);
+		probe->iteration_start = 0;
+	}
+	*timeout = -1;
+	return false;
+}
+
+static gboolean ume_loop_probe_check(GSource *source) {
+	((loop_probe_t *)source)->iteration_start = g_get_monotonic_time();
+	return false;
+}
+
+static gboolean ume_loop_probe_dispatch(GSource *source, GSourceFunc callback, gpointer data) {
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs loop_probe_funcs = {ume_loop_probe_prepare, ume_loop_probe_check, ume_loop_probe_dispatch, NULL};
+
+static void ume_frame_after_paint(GdkFrameClock *clock, gpointer data) {
+	gint64 frame_time = gdk_frame_clock_get_frame_time(clock);
+	gint64 interval = frame_time - ume.stats.last_frame_us;
+	if (!ume.stats.first_frame_us)
+		ume.stats.first_frame_us = g_get_monotonic_time() - ume.stats.started_us;
+	if (ume.dropdown.shown_us) {
+		ume.stats.summons.record(g_get_monotonic_time() - ume.dropdown.shown_us);
+		ume.dropdown.shown_us = 0;
+	}
+	ume.stats.frames.record(g_get_monotonic_time() - frame_time);
+
+	/* The clock only ticks while something is animating or redrawing, so only count
+	 * back to back frames. Anything longer than a refresh cycle there is a missed frame */
+	if (ume.stats.last_frame_us && interval < FRAME_IDLE_GAP_MS * 1000) {
+		gint64 refresh_interval = 0;
+		gdk_frame_clock_get_refresh_info(clock, frame_time, &refresh_interval, NULL);
+		ume.stats.frame_intervals.record(interval);
+		if (refresh_interval > 0 && interval > refresh_interval + refresh_interval / 2)
+			ume.stats.frames_missed += (interval + refresh_interval / 2) / refresh_interval - 1;
+	}
+	ume.stats.last_frame_us = frame_time;
+}
+
+static void ume_window_realized(GtkWidget *widget, gpointer data) {
+	GdkFrameClock *clock = gtk_widget_get_frame_clock(widget);
+	g_signal_connect(G_OBJECT(clock), "after-paint", G_CALLBACK(ume_frame_after_paint), NULL);
+}
+
+static void ume_stats_init() {
+	/* Highest priority so it is prepared and checked on every iteration */
+	GSource *probe = g_source_new(&loop_probe_funcs, sizeof(loop_probe_t));
+	g_source_set_priority(probe, G_PRIORITY_HIGH);
+	g_source_attach(probe, NULL);
+	g_source_unref(probe);
+
+	g_signal_connect(G_OBJECT(ume.main_window), "realize", G_CALLBACK(ume_window_realized), NULL);
+}
+
+static void ume_json_string(GString *out, const char *str) {
+	g_string_append_c(out, '"');
+	for (const char *c = str ? str : ""; *c; ++c) {
+		switch (*c) {
+			case '"':
+				g_string_append(out, "\\\"");
+				break;
+			case '\\':
+				g_string_append(out, "\\\\");
+				break;
+			default:
+				if ((unsigned char)*c < 0x20)
+					g_string_append_printf(out, "\\u%04x", *c);
+				else
+					g_string_append_c(out, *c);
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
+static void ume_json_histogram(GString *out, const char *name, const latency_histogram_t &histogram) {
+	g_string_append_printf(out,
+												 "\"%s\":{\"count\":%" G_GUINT64_FORMAT ",\"mean\":%" G_GINT64_FORMAT ",\"p50\":%" G_GINT64_FORMAT
+												 ",\"p90\":%" G_GINT64_FORMAT ",\"p99\":%" G_GINT64_FORMAT ",\"max\":%" G_GINT64_FORMAT "}",
+												 name, histogram.count, histogram.mean(), histogram.percentile(0.5), histogram.percentile(0.9),
+												 histogram.percentile(0.99), histogram.max_us);
+}
+
+/* Stall summary plus the most recent ones, newest first */
+static void ume_json_stalls(GString *out, gint64 now) {
+	const stall_tracker_t &stalls = ume.stats.stalls;
+	guint logged = MIN(stalls.count, (guint64)stall_tracker_t::LOG_SIZE);
+
+	g_string_append_printf(out, "\"stalls\":{\"threshold_ms\":%d,", STALL_THRESHOLD_MS);
+	ume_json_histogram(out, "duration_us", stalls.durations);
+	g_string_append(out, ",\"recent\":[");
+	for (guint i = 0; i < logged; ++i) {
+		const stall_event_t &event = stalls.log[(stalls.log_next - 1 - i) % stall_tracker_t::LOG_SIZE];
+		g_string_append_printf(out, "%s{\"ago_s\":%.3f,\"duration_us\":%" G_GINT64_FORMAT ",\"handler\":", i ? "," : "",
+													 (now - event.at_us) / 1e6, event.duration_us);
+		ume_json_string(out, event.handler);
+		g_string_append_c(out, '}');
+	}
+	g_string_append(out, "]}");
+}
+
+static long ume_stats_rss() {
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Command line of a process with the arguments separated by spaces, NULL if it's gone */
+static gchar *ume_proc_cmdline(pid_t pid) {
+	gchar *path = g_strdup_printf("/proc/%d/cmdline", pid);
+	gchar *contents = NULL;
+	gsize len = 0;
+
+	if (g_file_get_contents(path, &contents, &len, NULL)) {
+		for (gsize i = 0; i + 1 < len; ++i) {
+			if (contents[i] == '\0')
+				contents[i] = ' ';
+		}
+	}
+	g_free(path);
+	return contents;
+}
+
+/* Everything here is read on demand from state kept up to date anyway,
+ * so a scrape costs a few syscalls per tab and nothing between scrapes */
+static void ume_stats_json(GString *out) {
+	gint64 now = g_get_monotonic_time();
+	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+	gint width = 0, height = 0;
+	gtk_window_get_size(GTK_WINDOW(ume.main_window), &width, &height);
+
+	g_string_append_printf(out,
+												 "{\"pid\":%d,\"uptime_s\":%.3f,\"rss_bytes\":%ld,\"config_reloads\":%u,\"config_cached\":%s,"
+												 "\"accessible\":%s,",
+												 getpid(), (now - ume.stats.started_us) / 1e6, ume_stats_rss(), ume.stats.config_reloads,
+												 ume.stats.config_cached ? "true" : "false", ume.accessible ? "true" : "false");
+	ume_json_histogram(out, "main_loop_us", ume.stats.main_loop);
+	g_string_append_c(out, ',');
+	ume_json_histogram(out, "frame_us", ume.stats.frames);
+	g_string_append_c(out, ',');
+	ume_json_histogram(out, "frame_interval_us", ume.stats.frame_intervals);
+	g_string_append_c(out, ',');
+	ume_json_histogram(out, "key_dispatch_us", ume.stats.key_dispatch);
+	g_string_append_c(out, ',');
+	ume_json_histogram(out, "config_load_us", ume.stats.config_load);
+	g_string_append_c(out, ',');
+	ume_json_histogram(out, "dropdown_summon_us", ume.stats.summons);
+	g_string_append_c(out, ',');
+	ume_json_histogram(out, "hover_us", ume.stats.hover);
+	g_string_append_printf(out,
+												 ",\"startup_us\":{\"config_ready\":%" G_GINT64_FORMAT ",\"shell_spawned\":%" G_GINT64_FORMAT
+												 ",\"first_output\":%" G_GINT64_FORMAT ",\"first_frame\":%" G_GINT64_FORMAT "}",
+												 ume.stats.config_ready_us, ume.stats.shell_spawned_us, ume.stats.first_output_us,
+												 ume.stats.first_frame_us);
+	g_string_append_printf(out, ",\"frames_missed\":%" G_GUINT64_FORMAT ",", ume.stats.frames_missed);
+	ume_json_stalls(out, now);
+
+	g_string_append_printf(out,
+												 ",\"window\":{\"width\":%d,\"height\":%d,\"focused\":%s,\"fullscreen\":%s,\"tabs\":%d,"
+												 "\"current_tab\":%d},\"tabs\":[",
+												 width, height, ume.focused ? "true" : "false", ume.fullscreen ? "true" : "false", npages,
+												 gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook)));
+
+	for (gint i = 0; i < npages; ++i) {
+		struct terminal *term = ume_get_page_term(ume, i);
+		VteTerminal *vte = NULL;
+		const char *title = NULL;
+		glong lines = 0, columns = 0;
+		if (term->vte) {
+			vte = VTE_TERMINAL(term->vte);
+			title = vte_terminal_get_window_title(vte);
+			GtkAdjustment *adjust = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(vte));
+			lines = (glong)(gtk_adjustment_get_upper(adjust) - gtk_adjustment_get_lower(adjust));
+			columns = vte_terminal_get_column_count(vte);
+		}
+		gint64 last_output = term->stats.last_output_us ? term->stats.last_output_us : term->stats.created_us;
+		pid_t pgid = ume_term_foreground_pgid(term);
+
+		if (i > 0)
+			g_string_append_c(out, ',');
+		g_string_append_printf(out, "{\"index\":%d,\"label\":", i);
+		ume_json_string(out, gtk_label_get_text(GTK_LABEL(term->label)));
+		g_string_append(out, ",\"title\":");
+		ume_json_string(out, title);
+		g_string_append_printf(
+				out,
+				",\"pid\":%d,\"bytes_read\":%" G_GUINT64_FORMAT ",\"bytes_written\":%" G_GUINT64_FORMAT
+				",\"output_bytes_per_s\":%.1f,\"scrollback_lines\":%ld,\"scrollback_bytes_est\":%ld,"
+				"\"title_changes\":%u,\"title_changes_per_s\":%.2f,\"bells\":%u,\"idle_s\":%.3f,\"foreground_pgid\":%d,"
+				"\"foreground_command\":",
+				term->pid, term->stats.bytes_read, term->stats.bytes_written, term->stats.output_rate.per_second(now), lines,
+				lines * (columns + SCROLLBACK_ROW_OVERHEAD), term->stats.title_changes, term->stats.title_rate.per_second(now),
+				term->stats.bells, (now - last_output) / 1e6, pgid);
+
+		gchar *command = pgid > 0 ? ume_proc_cmdline(pgid) : NULL;
+		ume_json_string(out, command);
+		g_free(command);
+		g_string_append_printf(out, ",\"placeholder\":%s", vte ? "false" : "true");
+		g_string_append_printf(out, ",\"logging\":%s", term->log ? "true" : "false");
+		g_string_append_printf(out, ",\"fast_render\":%s", term->fast_render ? "true" : "false");
+		if (term->log)
+			g_string_append_printf(out,
+														 ",\"log_written_bytes\":%" G_GUINT64_FORMAT ",\"log_dropped_bytes\":%" G_GUINT64_FORMAT
+														 ",\"log_failing\":%s",
+														 term->log->written.load(), term->log->ring.dropped.load(),
+														 term->log->failing.load() ? "true" : "false");
+		g_string_append_c(out, '}');
+	}
+	g_string_append(out, "]}");
+}
+
+/* SIGUSR2 dumps the stats next to the control socket */
+static gboolean ume_usr2_signal_handler(gpointer data) {
+	GError *error = NULL;
+	GString *json = g_string_new(NULL);
+	ume_stats_json(json);
+	g_string_append_c(json, '\n');
+
+	gchar *name = g_strdup_printf(STATS_DUMP_FORMAT, getpid());
+	gchar *path = g_build_filename(g_get_user_runtime_dir(), CTL_DIR, name, NULL);
+	if (!g_file_set_contents(path, json->str, json->len, &error)) {
+		SAY("Cannot write stats: %s", error->message);
+		g_error_free(error);
+	}
+
+	g_free(path);
+	g_free(name);
+	g_string_free(json, true);
+	return G_SOURCE_CONTINUE;
+}
+
+/******* Drop-down ********/
+/* Full width along the top of the work area of the monitor the pointer is on */
+static void ume_dropdown_place() {
+	GdkDisplay *display = gdk_display_get_default();
+	GdkDevice *pointer = gdk_seat_get_pointer(gdk_display_get_default_seat(display));
+	GdkRectangle area;
+	gint x = 0, y = 0;
+
+	gdk_device_get_position(pointer, NULL, &x, &y);
+	gdk_monitor_get_workarea(gdk_display_get_monitor_at_point(display, x, y), &area);
+	gint height = area.height * CLAMP(ume.config.dropdown_height, 10, 100) / 100;
+	gtk_window_move(GTK_WINDOW(ume.main_window), area.x, area.y);
+	gtk_window_resize(GTK_WINDOW(ume.main_window), area.width, height);
+}
+
+/* The window stays realized while hidden, showing it only maps it again */
+static void ume_dropdown_show() {
+	ume.dropdown.shown_us = g_get_monotonic_time();
+	ume_dropdown_place();
+	gtk_widget_show(ume.main_window);
+
+	/* Summoned by a hotkey daemon, there's no event to take a timestamp from */
+	guint32 timestamp = GDK_CURRENT_TIME;
+#ifdef GDK_WINDOWING_X11
+	GdkWindow *gwin = gtk_widget_get_window(ume.main_window);
+	if (gwin && GDK_IS_X11_WINDOW(gwin))
+		timestamp = gdk_x11_get_server_time(gwin);
+#endif
+	gtk_window_present_with_time(GTK_WINDOW(ume.main_window), timestamp);
+}
+
+/* Shows the window, or hides it if it's already in front. True if it's shown now */
+static bool ume_dropdown_toggle() {
+	if (gtk_widget_get_visible(ume.main_window) && ume.focused) {
+		gtk_widget_hide(ume.main_window);
+		return false;
+	}
+	ume_dropdown_show();
+	return true;
+}
+
+static gboolean ume_hup_signal_handler(gpointer data) {
+	ume_dropdown_toggle();
+	return G_SOURCE_CONTINUE;
+}
+
+static gchar *ume_dropdown_path() {
+	return g_build_filename(g_get_user_runtime_dir(), CTL_DIR, DROPDOWN_SOCKET, NULL);
+}
+
+/******* Control socket ********/
+/* Each running instance listens on $XDG_RUNTIME_DIR/ume/ume-<pid>.sock. A client sends one
+ * command line, ume answers with one line of JSON and closes the connection. */
+struct ctl_client_t {
+	int fd;
+	GString *request;
+	GString *reply; /* NULL until the request is complete */
+	gsize sent;			/* Bytes of reply already written */
+};
+
+struct ctl_command_t {
+	const char *name;
+	void (*handler)(GString *reply, gint argc, gchar **argv);
+};
+
+static void ume_ctl_stats(GString *reply, gint argc, gchar **argv) {
+	ume_stats_json(reply);
+}
+
+/* Tab given with --tab, the current one otherwise. NULL and an error reply if there's no such tab.
+ * A placeholder is only started when start is set, queries leave it one */
+static struct terminal *ume_ctl_term(GString *reply, gint tab, bool start) {
+	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(ume.notebook));
+	if (tab < 0)
+		tab = gtk_notebook_get_current_page(GTK_NOTEBOOK(ume.notebook));
+	if (tab >= npages) {
+		g_string_append_printf(reply, "{\"error\":\"no tab %d\"}", tab);
+		return NULL;
+	}
+	struct terminal *term = ume_get_page_term(ume, tab);
+	if (start)
+		ume_term_start_restored(term);
+	return term;
+}
+
+/* export [--tab N] [--html] [--gzip] [--since-mark] PATH
+ * The format follows the extension of PATH unless given */
+static void ume_ctl_export(GString *reply, gint argc, gchar **argv) {
+	const char *path = NULL;
+	bool html, gzip, since_mark = false;
+	bool force_html = false, force_gzip = false;
+	gint tab = -1;
+
+	for (gint i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--tab") == 0 && i + 1 < argc)
+			tab = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--html") == 0)
+			force_html = true;
+		else if (strcmp(argv[i], "--gzip") == 0)
+			force_gzip = true;
+		else if (strcmp(argv[i], "--since-mark") == 0)
+			since_mark = true;
+		else
+			path = argv[i];
+	}
+	if (!path || !g_path_is_absolute(path)) {
+		g_string_append(reply, "{\"error\":\"usage: export [--tab N] [--html] [--gzip] [--since-mark] ABSOLUTE_PATH\"}");
+		return;
+	}
+
+	struct terminal *term = ume_ctl_term(reply, tab, true);
+	if (!term)
+		return;
+
+	GError *error = NULL;
+	glong end;
+	ume_export_format_from_path(path, &html, &gzip);
+	ume_term_row_bounds(term, NULL, &end);
+	glong first = ume_term_export_start(term, since_mark);
+	if (!ume_term_export(term, path, html || force_html, gzip || force_gzip, first, end, false, &error)) {
+		g_string_append(reply, "{\"error\":");
+		ume_json_string(reply, error->message);
+		g_string_append_c(reply, '}');
+		g_error_free(error);
+		return;
+	}
+	g_string_append(reply, "{\"exporting\":");
+	ume_json_string(reply, path);
+	g_string_append_printf(reply, ",\"rows\":%ld}", end - first);
+}
+
+/* log on|off|status [--tab N] */
+static void ume_ctl_log(GString *reply, gint argc, gchar **argv) {
+	const char *action = "status";
+	gint tab = -1;
+
+	for (gint i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--tab") == 0 && i + 1 < argc)
+			tab = atoi(argv[++i]);
+		else
+			action = argv[i];
+	}
+
+	struct terminal *term = ume_ctl_term(reply, tab, strcmp(action, "on") == 0);
+	if (!term)
+		return;
+
+	if (strcmp(action, "on") == 0) {
+		ume_term_log_start(term);
+	} else if (strcmp(action, "off") == 0) {
+		ume_term_log_stop(term);
+	} else if (strcmp(action, "status") != 0) {
+		g_string_append(reply, "{\"error\":\"usage: log on|off|status [--tab N]\"}");
+		return;
+	}
+	g_string_append_printf(reply, "{\"logging\":%s}", term->log ? "true" : "false");
+}
+
+/* commands [--tab N] [--last N]: the shell integration index of a tab, oldest first */
+static void ume_ctl_commands(GString *reply, gint argc, gchar **argv) {
+	gint tab = -1, last = 100;
+
+	for (gint i = 1; i + 1 < argc; ++i) {
+		if (strcmp(argv[i], "--tab") == 0)
+			tab = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--last") == 0)
+			last = atoi(argv[++i]);
+	}
+
+	struct terminal *term = ume_ctl_term(reply, tab, false);
+	if (!term)
+		return;
+
+	gint len = term->commands ? (gint)term->commands->len : 0;
+	g_string_append(reply, "{\"commands\":[");
+	for (gint i = MAX(len - last, 0); i < len; ++i) {
+		command_mark_t *command = &g_array_index(term->commands, command_mark_t, i);
+		if (i > MAX(len - last, 0))
+			g_string_append_c(reply, ',');
+		g_string_append_c(reply, '{');
+		static const char *names[NUM_MARKS] = {"prompt_row", "command_row", "output_row", "end_row"};
+		for (int mark = 0; mark < NUM_MARKS; ++mark) {
+			if (command->placed & (1 << mark))
+				g_string_append_printf(reply, "\"%s\":%ld,", names[mark], command->rows[mark]);
+		}
+		if (command->finished_us && command->started_us)
+			g_string_append_printf(reply, "\"duration_s\":%.3f,", (command->finished_us - command->started_us) / 1e6);
+		if (command->exit_status >= 0)
+			g_string_append_printf(reply, "\"exit_status\":%d,", command->exit_status);
+		g_string_append_printf(reply, "\"finished\":%s}", command->finished_us ? "true" : "false");
+	}
+	g_string_append(reply, "]}");
+}
+
+/* toggle: the window of a --dropdown instance */
+static void ume_ctl_toggle(GString *reply, gint argc, gchar **argv) {
+	if (!option_dropdown) {
+		g_string_append(reply, "{\"error\":\"not a drop-down instance\"}");
+		return;
+	}
+	g_string_append_printf(reply, "{\"visible\":%s}", ume_dropdown_toggle() ? "true" : "false");
+}
+
+/* render fast|normal|status [--tab N] */
+static void ume_ctl_render(GString *reply, gint argc, gchar **argv) {
+	const char *action = "status";
+	gint tab = -1;
+
+	for (gint i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--tab") == 0 && i + 1 < argc)
+			tab = atoi(argv[++i]);
+		else
+			action = argv[i];
+	}
+
+	bool change = strcmp(action, "fast") == 0 || strcmp(action, "normal") == 0;
+	struct terminal *term = ume_ctl_term(reply, tab, change);
+	if (!term)
+		return;
+
+	if (change) {
+		ume_term_set_fast_render(term, strcmp(action, "fast") == 0);
+	} else if (strcmp(action, "status") != 0) {
+		g_string_append(reply, "{\"error\":\"usage: render fast|normal|status [--tab N]\"}");
+		return;
+	}
+	g_string_append_printf(reply, "{\"fast_render\":%s}", term->fast_render ? "true" : "false");
+}
+
+static const ctl_command_t ctl_commands[] = {
+		{"stats", ume_ctl_stats},
+		{"toggle", ume_ctl_toggle},
+		{"commands", ume_ctl_commands},
+		{"export", ume_ctl_export},
+		{"log", ume_ctl_log},
+		{"render", ume_ctl_render},
+};
+
+static GString *ume_ctl_reply(const gchar *request) {
+	GString *reply = g_string_new(NULL);
+	gint argc = 0;
+	gchar **argv = NULL;
+
+	if (!g_shell_parse_argv(request, &argc, &argv, NULL)) {
+		g_string_append(reply, "{\"error\":\"empty or malformed command\"}");
+	} else {
+		const ctl_command_t *command = NULL;
+		for (auto &candidate : ctl_commands) {
+			if (strcmp(candidate.name, argv[0]) == 0)
+				command = &candidate;
+		}
+
+		if (command) {
+			command->handler(reply, argc, argv);
+		} else {
+			g_string_append(reply, "{\"error\":");
+			ume_json_string(reply, "unknown command");
+			g_string_append(reply, ",\"command\":");
+			ume_json_string(reply, argv[0]);
+			g_string_append_c(reply, '}');
+		}
+		g_strfreev(argv);
+	}
+	g_string_append_c(reply, '\n');
+	return reply;
+}
+
+static void ume_ctl_client_free(ctl_client_t *client) {
+	close(client->fd);
+	g_string_free(client->request, true);
+	if (client->reply)
+		g_string_free(client->reply, true);
+	g_free(client);
+}
+
+/* Writes what the socket takes of the reply, the rest waits for it to become writable like the
+ * input of a PTY does. False once the client is done with, one way or the other */
+static bool ume_ctl_flush(ctl_client_t *client) {
+	while (client->sent < client->reply->len) {
+		/* A client that went away must not take ume down with SIGPIPE */
+		gssize written =
+				send(client->fd, client->reply->str + client->sent, client->reply->len - client->sent, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0 && errno == EAGAIN)
+			return true;
+		if (written <= 0)
+			break;
+		client->sent += written;
+	}
+	ume_ctl_client_free(client);
+	return false;
+}
+
+static gboolean ume_ctl_writable(gint fd, GIOCondition condition, gpointer data) {
+	ctl_client_t *client = (ctl_client_t *)data;
+	if (condition & (G_IO_HUP | G_IO_ERR)) {
+		ume_ctl_client_free(client);
+		return G_SOURCE_REMOVE;
+	}
+	return ume_ctl_flush(client) ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean ume_ctl_readable(gint fd, GIOCondition condition, gpointer data) {
+	ctl_client_t *client = (ctl_client_t *)data;
+	char buf[512];
+
+	gssize len = read(fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return G_SOURCE_CONTINUE;
+	if (len > 0)
+		g_string_append_len(client->request, buf, len);
+
+	const char *newline = strchr(client->request->str, '\n');
+	if (!newline && len > 0 && client->request->len < CTL_MAX_REQUEST)
+		return G_SOURCE_CONTINUE;
+
+	/* A full line, or the client closed its side */
+	if (newline)
+		g_string_truncate(client->request, newline - client->request->str);
+	client->reply = ume_ctl_reply(client->request->str);
+	if (ume_ctl_flush(client))
+		g_unix_fd_add(fd, (GIOCondition)(G_IO_OUT | G_IO_HUP | G_IO_ERR), ume_ctl_writable, client);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean ume_ctl_accept(gint fd, GIOCondition condition, gpointer data) {
+	int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client_fd < 0)
+		return G_SOURCE_CONTINUE;
+
+	ctl_client_t *client = g_new0(ctl_client_t, 1);
+	client->fd = client_fd;
+	client->request = g_string_new(NULL);
+	g_unix_fd_add(client_fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), ume_ctl_readable, client);
+	return G_SOURCE_CONTINUE;
+}
+
+static gchar *ume_ctl_dir() {
+	return g_build_filename(g_get_user_runtime_dir(), CTL_DIR, NULL);
+}
+
+/* Listening socket at path served by ume_ctl_accept, -1 on failure */
+static int ume_ctl_listen(const char *path) {
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		SAY("Control socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+		SAY("Cannot listen on %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	g_unix_fd_add(fd, G_IO_IN, ume_ctl_accept, NULL);
+	return fd;
+}
+
+static void ume_ctl_init() {
+	gchar *dir = ume_ctl_dir();
+	gchar *name = g_strdup_printf(CTL_SOCKET_FORMAT, getpid());
+
+	g_mkdir_with_parents(dir, 0700);
+	ume.ctl_path = g_build_filename(dir, name, NULL);
+	g_free(name);
+	g_free(dir);
+
+	/* A socket with our pid can only be a leftover from a dead instance */
+	unlink(ume.ctl_path);
+	ume.ctl_fd = ume_ctl_listen(ume.ctl_path);
+
+	/* A stale drop-down socket was removed by main trying it. If another drop-down instance won the race
+	 * to bind it, this one still toggles through its own socket and SIGHUP */
+	ume.dropdown.fd = -1;
+	if (option_dropdown) {
+		ume.dropdown.path = ume_dropdown_path();
+		ume.dropdown.fd = ume_ctl_listen(ume.dropdown.path);
+	}
+}
+
+static void ume_ctl_done() {
+	if (ume.ctl_fd >= 0) {
+		close(ume.ctl_fd);
+		unlink(ume.ctl_path);
+		ume.ctl_fd = -1;
+	}
+	g_free(ume.ctl_path);
+	ume.ctl_path = NULL;
+
+	if (ume.dropdown.fd >= 0) {
+		close(ume.dropdown.fd);
+		unlink(ume.dropdown.path);
+		ume.dropdown.fd = -1;
+	}
+	g_free(ume.dropdown.path);
+	ume.dropdown.path = NULL;
+}
+
+/* Send command to one instance and copy its reply to stdout */
+static bool ume_ctl_send(const char *path, const char *command) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (errno == ECONNREFUSED) /* Nobody listening anymore, the instance died */
+			unlink(path);
+		close(fd);
+		return false;
+	}
+
+	gchar *line = g_strconcat(command, "\n", NULL);
+	bool sent = send(fd, line, strlen(line), MSG_NOSIGNAL) == (gssize)strlen(line);
+	g_free(line);
+	shutdown(fd, SHUT_WR);
+
+	char buf[4096];
+	gssize len;
+	while (sent && (len = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, len, stdout);
+	close(fd);
+	return sent;
+}
+
+/* ume --ctl: send the command to every running instance, or only to pid if it's not 0 */
+static int ume_ctl_client(const char *command, gint pid) {
+	gchar *dir = ume_ctl_dir();
+	GDir *entries = g_dir_open(dir, 0, NULL);
+	int replies = 0;
+
+	if (entries) {
+		const gchar *name;
+		while ((name = g_dir_read_name(entries)) != NULL) {
+			int entry_pid = 0;
+			if (sscanf(name, "ume-%d", &entry_pid) != 1 || (pid && entry_pid != pid))
+				continue;
+			gchar *expected = g_strdup_printf(CTL_SOCKET_FORMAT, entry_pid);
+			if (strcmp(expected, name) == 0) {
+				gchar *path = g_build_filename(dir, name, NULL);
+				if (ume_ctl_send(path, command))
+					replies++;
+				g_free(path);
+			}
+			g_free(expected);
+		}
+		g_dir_close(entries);
+	}
+	g_free(dir);
+
+	if (replies == 0) {
+		fprintf(stderr, "No running ume instance answered\n");
+		return 1;
+	}
+	return 0;
 }
 
 int main(int argc, char **argv) {
+	ume.stats.started_us = g_get_monotonic_time();
+
 	/* Localization */
 	setlocale(LC_ALL, "");
 	gchar *localedir = g_strdup_printf("%s/locale", DATADIR);
@@ -2882,14 +6957,26 @@ int main(int argc, char **argv) {
 		option_ntabs = 1;
 	}
 
+	if (option_config_docs) {
+		ume_config_print_docs();
+		return 0;
+	}
+
+	if (option_ctl) {
+		return ume_ctl_client(option_ctl, option_ctl_pid);
+	}
+
+	if (option_holder) {
+		gchar *path = ume_holder_path();
+		int status = holder_t::run(path);
+		g_free(path);
+		return status;
+	}
+
 	if (option_change_colorset != INT_MIN) {
 		if (option_change_colorset > 0 && option_change_colorset <= NUM_COLORSETS) {
-			ume_config_load();
-			ume_set_config(cfg_group, "last_colorset", option_change_colorset);
+			ume_state_set("last_colorset", option_change_colorset);
 			SAY("Setting colorset %d", option_change_colorset);
-			ume.config_modified = true;
-			ume.externally_modified = false;
-			ume_config_done(true);
 			system("killall -USR1 ume");
 			return 0;
 		} else {
@@ -2899,15 +6986,69 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	/* Init stuff */
+	/* A drop-down instance is already running, it only has to show or hide its window */
+	if (option_dropdown) {
+		gchar *path = ume_dropdown_path();
+		bool toggled = ume_ctl_send(path, "toggle");
+		g_free(path);
+		if (toggled)
+			return 0;
+	}
+
+	/* Not even the bridge, GTK reads this in gtk_init. Shells must not inherit it */
+	bool no_bridge = option_no_a11y && !g_getenv("NO_AT_BRIDGE");
+	if (no_bridge)
+		g_setenv("NO_AT_BRIDGE", "1", true);
+
+	/* The config thread reads the environment, GLib's directories and the session bus address, while
+	 * GDK unsets DESKTOP_STARTUP_ID when it opens the display. Resolve what can be resolved first and
+	 * take the startup id out before there is a second thread, the window gets it back from us */
+	g_get_home_dir();
+	g_get_user_config_dir();
+	g_get_user_runtime_dir();
+	GDBusConnection *session_bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	gchar *startup_id = g_strdup(g_getenv("DESKTOP_STARTUP_ID"));
+	g_unsetenv("DESKTOP_STARTUP_ID");
+
+	/* Init stuff. The config is read while GTK initializes, then with early_shell the first shell
+	 * starts while the window is built */
+	GThread *config_thread = g_thread_new("ume-config", ume_config_load_thread, NULL);
 	gtk_init(&nargc, &nargv);
 	g_strfreev(nargv);
+	g_thread_join(config_thread);
+	ume_a11y_watch(session_bus);
+	if (session_bus)
+		g_object_unref(session_bus);
+	if (no_bridge)
+		g_unsetenv("NO_AT_BRIDGE");
+	ume_init_command();
+	ume_spawn_early();
 	ume_init();
-	signal(SIGUSR1, ume_usr1_signal_handler);
-
-	/* Add initial tabs (1 by default) */
-	for (int i = 0; i < option_ntabs; i++)
-		ume_add_tab();
+	if (startup_id && *startup_id)
+		gtk_window_set_startup_id(GTK_WINDOW(ume.main_window), startup_id);
+	g_free(startup_id);
+	g_unix_signal_add(SIGUSR1, ume_usr1_signal_handler, NULL);
+	g_unix_signal_add(SIGUSR2, ume_usr2_signal_handler, NULL);
+	if (option_dropdown)
+		g_unix_signal_add(SIGHUP, ume_hup_signal_handler, NULL);
+
+	/* Add initial tabs (1 by default), unless tmux has them or there's a session or detached persistent tabs to
+	 * bring back */
+	if (!option_tmux || !ume_tmux_start(option_tmux)) {
+		bool restored = option_restore && ume_session_restore();
+		gint reattached = ume.config.persistent_sessions ? ume_holder_reattach() : 0;
+		if (!restored && reattached > 0)
+			ume_start_current_tab();
+		if (!restored && !reattached) {
+			/* The first tab stays in front, the others are placeholders until switched to */
+			ume_add_tab();
+			session_tab_t tab = {};
+			tab.colorset = ume.config.last_colorset - 1;
+			for (int i = 1; i < option_ntabs; i++)
+				ume_add_tab(&tab);
+		}
+	}
+	ume_session_start_timer();
 
 	ume_sanitize_working_directory();
 